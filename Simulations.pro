@@ -9,8 +9,11 @@ INCLUDEPATH += extlibs
 VPATH += code
 
 SOURCES += \
+    code/adaptiveresolution.cpp \
     code/camera.cpp \
     code/colliders.cpp \
+    code/convergencelog.cpp \
+    code/flipsolver.cpp \
     code/forces.cpp \
     code/glutils.cpp \
     code/glwidget.cpp \
@@ -18,6 +21,7 @@ SOURCES += \
     code/main.cpp \
     code/mainwindow.cpp \
     code/model.cpp \
+    code/multigrid.cpp \
     code/particlesystem.cpp \
     code/scenecloth.cpp \
     code/scenefountain.cpp \
@@ -26,6 +30,10 @@ SOURCES += \
     code/scenerope.cpp \
     code/scenesnowball.cpp \
     code/scenesph_watercube.cpp \
+    code/sdfboundary.cpp \
+    code/sphkernels.cpp \
+    code/surfacereconstruction.cpp \
+    code/threadpool.cpp \
     code/widgetcloth.cpp \
     code/widgetfountain.cpp \
     code/widgetop.cpp \
@@ -35,19 +43,29 @@ SOURCES += \
     code/widgetsph_watercube.cpp
 
 HEADERS += \
+    code/adaptiveresolution.h \
     code/camera.h \
+    code/cellhash.h \
     code/cloth.h \
     code/colliders.h \
+    code/convergencelog.h \
     code/defines.h \
+    code/flipsolver.h \
     code/forces.h \
     code/glutils.h \
     code/glwidget.h \
+    code/grid.h \
     code/hash.h \
     code/integrators.h \
     code/mainwindow.h \
     code/model.h \
+    code/multigrid.h \
+    code/neighborsearch.h \
+    code/neighbortuner.h \
     code/particle.h \
+    code/particlepool.h \
     code/particlesystem.h \
+    code/periodicdomain.h \
     code/rope.h \
     code/sail.h \
     code/scene.h \
@@ -58,6 +76,15 @@ HEADERS += \
     code/scenerope.h \
     code/scenesnowball.h \
     code/scenesph_watercube.h \
+    code/sdfboundary.h \
+    code/sleeptracker.h \
+    code/sparseblockgrid.h \
+    code/sphemitter.h \
+    code/sphkernelpolicies.h \
+    code/sphkernels.h \
+    code/sphtile.h \
+    code/surfacereconstruction.h \
+    code/threadpool.h \
     code/widgetcloth.h \
     code/widgetfountain.h \
     code/widgetop.h \
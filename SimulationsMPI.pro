@@ -0,0 +1,35 @@
+# Water cube without the GUI, split across MPI ranks: mpirun -np 4 ./SimulationsMPI
+QT       -= gui
+QT       += core
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+QMAKE_CXX = mpicxx
+QMAKE_LINK = mpicxx
+
+INCLUDEPATH += code
+INCLUDEPATH += extlibs
+
+VPATH += code
+
+SOURCES += \
+    code/colliders.cpp \
+    code/distributedwatercube.cpp \
+    code/main_mpi.cpp \
+    code/sdfboundary.cpp \
+    code/slabdecomposition.cpp \
+    code/sphkernels.cpp
+
+HEADERS += \
+    code/colliders.h \
+    code/defines.h \
+    code/distributedwatercube.h \
+    code/grid.h \
+    code/neighborsearch.h \
+    code/particle.h \
+    code/periodicdomain.h \
+    code/sdfboundary.h \
+    code/slabdecomposition.h \
+    code/sphkernels.h \
+    code/sphtile.h
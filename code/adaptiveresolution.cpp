@@ -0,0 +1,54 @@
+#include "adaptiveresolution.h"
+
+
+void AdaptiveResolution::merge(Particle* a, const Particle* b) const {
+    double mass = a->mass + b->mass;
+    double wa = a->mass/mass, wb = b->mass/mass;
+    a->pos     = wa*a->pos + wb*b->pos;
+    a->prevPos = wa*a->prevPos + wb*b->prevPos;
+    a->vel     = wa*a->vel + wb*b->vel;
+    a->density  = wa*a->density + wb*b->density;
+    a->pressure = wa*a->pressure + wb*b->pressure;
+    a->mass = mass;
+    a->radius = baseRadius*std::cbrt(mass/baseMass);
+    a->asleep = false;
+}
+
+Particle* AdaptiveResolution::split(Particle* p, const Vec3& axis) const {
+    double mass = 0.5*p->mass;
+    Vec3 offset = 0.5*spacing(level(p) - 1)*axis;
+
+    Particle* child = new Particle(*p);
+    child->mass = mass;
+    child->radius = baseRadius*std::cbrt(mass/baseMass);
+    child->density = p->density;
+    child->pressure = p->pressure;
+    child->pos = p->pos - offset;
+    child->prevPos = p->prevPos - offset;
+
+    p->mass = mass;
+    p->radius = child->radius;
+    p->pos += offset;
+    p->prevPos += offset;
+    p->asleep = false;
+    child->asleep = false;
+    return child;
+}
+
+void AdaptiveResolution::count(const QVector<Particle*>& parts) {
+    numPerLevel.fill(0, maxLevel+1);
+    for (const Particle* p : parts) numPerLevel[std::min(std::max(level(p), 0), maxLevel)]++;
+}
+
+QString AdaptiveResolution::overlayLine() const {
+    QString line = "Levels:  ";
+    int particles = 0;
+    double fine = 0;
+    for (int l = 0; l < numPerLevel.size(); l++) {
+        line += (l ? " / " : "") + QString::number(numPerLevel[l]);
+        particles += numPerLevel[l];
+        fine += numPerLevel[l]*double(1 << l);
+    }
+    if (particles) line += "  (" + QString::number(fine/particles, 'f', 2) + "x fewer)";
+    return line;
+}
@@ -0,0 +1,57 @@
+#ifndef ADAPTIVERESOLUTION_H
+#define ADAPTIVERESOLUTION_H
+
+#include <QVector>
+#include <QString>
+#include <cmath>
+#include "particle.h"
+
+/*
+ *  Mass levels of adaptive SPH. A particle of level L has 2^L times the base mass, and its
+ *  smoothing length, spacing and radius grow with the cube root of its mass, so every level
+ *  sees about the same number of neighbors. Two particles of a level merge into one of the
+ *  next level and a particle splits into two of the previous one, both conserving mass and
+ *  momentum. Which particles merge or split is up to the scene.
+ */
+class AdaptiveResolution {
+public:
+    AdaptiveResolution(int maxLevel_var = 3){
+        maxLevel = maxLevel_var;
+    }
+
+    // mass, radius and lattice spacing of the level 0 particles
+    void setBase(double mass, double radius, double spacing){
+        baseMass = mass;
+        baseRadius = radius;
+        baseSpacing = spacing;
+    }
+
+    int getMaxLevel() const { return maxLevel; }
+    double getBaseMass() const { return baseMass; }
+
+    int level(const Particle* p) const { return int(std::lround(std::log2(p->mass/baseMass))); }
+
+    // h of the particle when level 0 uses h
+    double smoothingLength(const Particle* p, double h) const { return h*std::cbrt(p->mass/baseMass); }
+
+    // distance between neighbors of a level
+    double spacing(int l) const { return baseSpacing*std::cbrt(double(1 << l)); }
+
+    // b goes into a at their center of mass, b can be deleted afterwards
+    void merge(Particle* a, const Particle* b) const;
+
+    // p keeps half of its mass and the returned particle gets the other half, each moved half
+    // the spacing of the finer level along axis to its side
+    Particle* split(Particle* p, const Vec3& axis) const;
+
+    // particles per level for the overlay
+    void count(const QVector<Particle*>& parts);
+    QString overlayLine() const;
+
+protected:
+    int maxLevel;
+    double baseMass = 1, baseRadius = 1, baseSpacing = 1;
+    QVector<int> numPerLevel;
+};
+
+#endif // ADAPTIVERESOLUTION_H
@@ -0,0 +1,266 @@
+#ifndef CELLHASH_H
+#define CELLHASH_H
+
+#include <QVector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "particle.h"
+#include "neighborsearch.h"
+
+/*
+ *  Spatial hash keyed on the exact cell coordinates, packed in 64 bits (21 bits per axis).
+ *  Cells live in an open addressing table with linear probing and a power-of-two size,
+ *  so two different cells never share a bucket and queries only see particles of the
+ *  cells they asked for. Tables grow when the particle count exceeds the capacity.
+ */
+class CellHash : public NeighborSearch {
+public:
+    CellHash(double spacing_var, unsigned int maxNObjects){
+        spacing = spacing_var;
+        maxNumObjects = 0;
+        tableSize = 0;
+        tableFactor = 2;
+        reserve(std::max(maxNObjects, 1u));
+        numCells = 0;
+        querySize = 0;
+        resetStats();
+    }
+
+    static const uint64_t emptyKey = ~uint64_t(0);
+
+    static uint64_t packCoords(int xi, int yi, int zi){
+        const uint64_t mask = (uint64_t(1) << 21) - 1;
+        return ((uint64_t(xi) & mask) << 42) | ((uint64_t(yi) & mask) << 21) | (uint64_t(zi) & mask);
+    }
+
+    // inverse of packCoords for axis shift 42, 21 or 0, sign extending the 21 bits
+    static int unpackCoord(uint64_t key, int shift){
+        return int(int64_t(key << (43-shift)) >> 43);
+    }
+
+    unsigned int slotOf(uint64_t key){
+        // splitmix64 finalizer, the table size is a power of two
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return (unsigned int)(key & (tableSize-1));
+    }
+
+    int intCoord(double coord){
+        return std::floor(coord/ spacing);
+    }
+
+    // along a periodic axis the cells start at the origin of the domain, before wrapping
+    int intCoord(double coord, int axis){
+        return periodic.isPeriodic(axis) ? periodic.cellCoord(coord, axis) : intCoord(coord);
+    }
+
+    uint64_t keyCell(int xi, int yi, int zi){
+        return packCoords(periodic.wrapCell(xi,0), periodic.wrapCell(yi,1), periodic.wrapCell(zi,2));
+    }
+
+    uint64_t keyPos(const Vec3& pos){
+        return keyCell(intCoord(pos.x(),0), intCoord(pos.y(),1), intCoord(pos.z(),2));
+    }
+
+    // sizes every array for nObjects particles
+    void reserve(unsigned int nObjects){
+        if(nObjects <= maxNumObjects) return;
+        maxNumObjects = nObjects;
+        resizeTable();
+        cellStart.resize(maxNumObjects+1);
+        cellKeys.resize(maxNumObjects);
+        cellEntries.resize(maxNumObjects);
+        particleCells.resize(maxNumObjects);
+        queryIds.resize(maxNumObjects);
+    }
+
+    // at least tableFactor slots per object, so the load factor stays under 1/tableFactor
+    void resizeTable(){
+        tableSize = 1;
+        while(tableSize < tableFactor*maxNumObjects) tableSize <<= 1;
+        tableKeys.resize(tableSize);
+        tableCells.resize(tableSize);
+    }
+
+    // dense id of the cell with this key, adding it if it is not in the table yet
+    unsigned int insertCell(uint64_t key){
+        unsigned int slot = slotOf(key);
+        unsigned int probes = 1;
+        while(tableKeys[slot] != emptyKey && tableKeys[slot] != key){
+            slot = (slot+1) & (tableSize-1);
+            probes++;
+        }
+        countProbes(1, probes, probes);
+        if(tableKeys[slot] == emptyKey){
+            tableKeys[slot] = key;
+            tableCells[slot] = numCells;
+            cellKeys[numCells] = key;
+            cellStart[numCells] = 0;
+            numCells++;
+        }
+        return tableCells[slot];
+    }
+
+    // dense id of the cell with this key, -1 if it holds no particle. Adds the slots visited to probes
+    int findCell(uint64_t key, unsigned int& probes){
+        unsigned int slot = slotOf(key);
+        probes = 1;
+        while(tableKeys[slot] != emptyKey){
+            if(tableKeys[slot] == key) return tableCells[slot];
+            slot = (slot+1) & (tableSize-1);
+            probes++;
+        }
+        return -1;
+    }
+
+    virtual void create(const QVector<Particle *>& parts){
+        unsigned int numObjects = parts.size();
+        if(numObjects > maxNumObjects)
+            reserve(std::max(numObjects, 2*maxNumObjects));
+
+        // determine cells and their sizes
+
+        tableKeys.fill(uint64_t(emptyKey));
+        numCells = 0;
+
+        for(unsigned int i=0; i < numObjects; i++){
+            unsigned int c = insertCell(keyPos(parts[i]->pos));
+            particleCells[i] = c;
+            cellStart[c]++;
+        }
+
+        // determine cells starts
+
+        unsigned int start = 0;
+        for(unsigned int i=0; i < numCells; i++){
+            start += cellStart[i];
+            cellStart[i] = start;
+        }
+        cellStart[numCells] = start; //guard
+
+        // fill in objects ids
+
+        for(unsigned int i=0; i < numObjects; i++){
+            unsigned int c = particleCells[i];
+            cellStart[c]--;
+            cellEntries[cellStart[c]] = i;
+        }
+    }
+
+    virtual void query(const Vec3& pos, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        size = 0;
+        int c0[3], c1[3];
+        for(int a=0; a<3; a++){
+            c0[a] = intCoord(pos[a] - maxDist, a);
+            c1[a] = intCoord(pos[a] + maxDist, a);
+            periodic.clampRange(c0[a], c1[a], a);
+        }
+        gatherRange(c0[0], c0[1], c0[2], c1[0], c1[1], c1[2], ids, size);
+        countQuery(size);
+    }
+
+    using NeighborSearch::query;
+    using NeighborSearch::queryCell;
+    using NeighborSearch::queryCellHalf;
+
+    virtual bool hasExactCells() const { return true; }
+    virtual unsigned int getNumCells() const { return numCells; }
+
+    virtual void queryCell(unsigned int c, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        int ci[3] = {unpackCoord(cellKeys[c], 42), unpackCoord(cellKeys[c], 21), unpackCoord(cellKeys[c], 0)};
+        int c0[3], c1[3];
+        for(int a=0; a<3; a++){
+            // periodic cells can be wider than the spacing
+            int r = int(std::ceil(maxDist/(periodic.isPeriodic(a) ? periodic.getCellSize(a) : spacing)));
+            c0[a] = ci[a] - r;
+            c1[a] = ci[a] + r;
+            periodic.clampRange(c0[a], c1[a], a);
+        }
+        size = 0;
+        gatherRange(c0[0], c0[1], c0[2], c1[0], c1[1], c1[2], ids, size);
+        countQuery(size);
+    }
+
+    virtual void queryCellHalf(unsigned int c, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        int r = int(std::ceil(maxDist/spacing));
+        int xi = unpackCoord(cellKeys[c], 42);
+        int yi = unpackCoord(cellKeys[c], 21);
+        int zi = unpackCoord(cellKeys[c], 0);
+        size = 0;
+
+        // offsets lexicographically after (0,0,0)
+        gatherRange(xi, yi, zi+1, xi, yi, zi+r, ids, size);
+        gatherRange(xi, yi+1, zi-r, xi, yi+r, zi+r, ids, size);
+        gatherRange(xi+1, yi-r, zi-r, xi+r, yi+r, zi+r, ids, size);
+        countQuery(size);
+    }
+
+    void gatherRange(int x0, int y0, int z0, int x1, int y1, int z1, QVector<unsigned int>& ids, unsigned int& size){
+        unsigned int lookups = 0, probes = 0, longest = 0;
+        for(int  xi=x0; xi<=x1; xi++){
+            for(int  yi=y0;yi<=y1; yi++){
+                for(int  zi=z0;zi<=z1; zi++){
+                    unsigned int p;
+                    int c = findCell(keyCell(xi,yi,zi), p);
+                    lookups++;
+                    probes += p;
+                    longest = std::max(longest, p);
+                    if(c < 0) continue;
+                    unsigned int start = cellStart[c];
+                    unsigned int end = cellStart[c+1];
+
+                    for(unsigned int i=start; i<end; i++){
+                        ids[size] = cellEntries[i];
+                        size++;
+                    }
+                }
+            }
+        }
+        countProbes(lookups, probes, longest);
+    }
+
+    virtual double getSpacing() const { return spacing; }
+    virtual void setSpacing(double s){
+        spacing = s;
+        periodic.setSpacing(s);
+    }
+    virtual unsigned int getTableSize() const { return tableSize; }
+    virtual unsigned int getTableFactor() const { return tableFactor; }
+
+    // below 2 the probing could not find an empty slot
+    virtual void setTableFactor(unsigned int f){
+        tableFactor = std::max(f, 2u);
+        resizeTable();
+    }
+
+    // statistics
+    double occupancy() const { return double(numCells)/tableSize; }
+    double avgProbeLength() const { return numLookups ? double(numProbes)/numLookups : 0.0; }
+    void resetStats(){ numLookups = 0; numProbes = 0; maxProbeLength = 0; }
+
+    // one call per query, queries from several threads can overlap
+    void countProbes(unsigned int lookups, unsigned int probes, unsigned int longest){
+        numLookups.fetch_add(lookups, std::memory_order_relaxed);
+        numProbes.fetch_add(probes, std::memory_order_relaxed);
+        unsigned int m = maxProbeLength.load(std::memory_order_relaxed);
+        while(longest > m && !maxProbeLength.compare_exchange_weak(m, longest, std::memory_order_relaxed)) {}
+    }
+
+    double spacing;
+    unsigned int tableSize, tableFactor, numCells, maxNumObjects;
+    QVector<uint64_t> tableKeys;
+    QVector<unsigned int> tableCells;
+    QVector<uint64_t> cellKeys;
+    QVector<unsigned int> particleCells;
+
+    std::atomic<uint64_t> numLookups, numProbes;
+    std::atomic<unsigned int> maxProbeLength;
+};
+
+
+
+#endif // CELLHASH_H
@@ -26,6 +26,12 @@ void ColliderPlane::resolveCollision(Particle* p, double kElastic, double kFrict
     p->prevPos -= (velElastic - (kFriction)*velT)*dt;
 }
 
+double ColliderPlane::signedDistance(const Vec3& x, Vec3& normal) const
+{
+    normal = planeN;
+    return planeN.dot(x)+planeD;
+}
+
 /*
  * Sphere
  */
@@ -62,6 +68,14 @@ void ColliderSphere::resolveCollision(Particle* p, double kElastic, double kFric
     p->prevPos -= 0.7*(velElastic - (kFriction)*velT)*dt;
 }
 
+double ColliderSphere::signedDistance(const Vec3& x, Vec3& normal) const
+{
+    Vec3 r = x-sphereC;
+    double d = r.norm();
+    normal = d > 0 ? Vec3(r/d) : Vec3(0,1,0);
+    return d-sphereR;
+}
+
 /*
  * AABB
  */
@@ -167,6 +181,23 @@ bool ColliderLambdaInnerAABB::testCollision(const Particle* p) const
            p->pos.z() >= (pos.z()-scale.z()) && p->pos.z() <= (pos.z()+scale.z())) ;
 }
 
+void ColliderLambdaInnerAABB::getPlanes(Vec3 (&planesN)[6], double (&planesD)[6]) const{
+    // Array for plane normals +x, -x, +y, -y, +z, -z respectively
+    planesN[0] = Vec3(-1.f,  0.f,  0.f);
+    planesN[1] = Vec3( 1.f,  0.f,  0.f);
+    planesN[2] = Vec3( 0.f, -1.f,  0.f);
+    planesN[3] = Vec3( 0.f,  1.f,  0.f);
+    planesN[4] = Vec3( 0.f,  0.f, -1.f);
+    planesN[5] = Vec3( 0.f,  0.f,  1.f);
+    // Array for plane distances +x, -x, +y, -y, +z, -z respectively
+    planesD[0] =  this->pos.x() + this->scale.x();
+    planesD[1] = -this->pos.x() + this->scale.x();
+    planesD[2] =  this->pos.y() + this->scale.y();
+    planesD[3] = -this->pos.y() + this->scale.y();
+    planesD[4] =  this->pos.z() + this->scale.z();
+    planesD[5] = -this->pos.z() + this->scale.z();
+}
+
 void ColliderLambdaInnerAABB::calcLambda(Particle* p, Vec3 (&planesN)[6], double (&planesD)[6], double &lambda, unsigned int &idx) const{
     for(unsigned int i=0;i<3;i++)
         for(unsigned int j=0;j<2;j++){
@@ -198,24 +229,9 @@ void ColliderLambdaInnerAABB::resolveCollision(Particle* p, double kElastic, dou
      * direction (like if its intersection is exactly at the corner).
      */
 
-    // Array for plane normals +x, -x, +y, -y, +z, -z respectively
-    Vec3 planesN[6] = {
-        Vec3(-1.f,  0.f,  0.f),
-        Vec3( 1.f,  0.f,  0.f),
-        Vec3( 0.f, -1.f,  0.f),
-        Vec3( 0.f,  1.f,  0.f),
-        Vec3( 0.f,  0.f, -1.f),
-        Vec3( 0.f,  0.f,  1.f),
-    };
-    // Array for plane distances +x, -x, +y, -y, +z, -z respectively
-    double planesD[6] = {
-         this->pos.x() + this->scale.x(),
-        -this->pos.x() + this->scale.x(),
-         this->pos.y() + this->scale.y(),
-        -this->pos.y() + this->scale.y(),
-         this->pos.z() + this->scale.z(),
-        -this->pos.z() + this->scale.z(),
-    };
+    Vec3 planesN[6];
+    double planesD[6];
+    getPlanes(planesN,planesD);
 
     double lambda;
     unsigned int idx;
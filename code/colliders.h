@@ -3,6 +3,7 @@
 
 #include "defines.h"
 #include "particle.h"
+#include <limits>
 
 
 class Collider  // Abstract interface
@@ -13,6 +14,13 @@ public:
 
     virtual bool testCollision(const Particle* p) const = 0;
     virtual void resolveCollision(Particle* p, double kElastic, double kFriction, double dt) const = 0;
+
+    // signed distance from x to the surface, positive on the side the particles are kept on, and
+    // the unit normal towards that side. Colliders without one are infinitely far
+    virtual double signedDistance(const Vec3& /*x*/, Vec3& normal) const {
+        normal = Vec3(0,0,0);
+        return std::numeric_limits<double>::max();
+    }
 };
 
 
@@ -27,6 +35,7 @@ public:
 
     virtual bool testCollision(const Particle* p) const;
     virtual void resolveCollision(Particle* p, double kElastic, double kFriction, double dt) const;
+    virtual double signedDistance(const Vec3& x, Vec3& normal) const;
 
     Vec3 planeN;
     double planeD;
@@ -61,6 +70,8 @@ public:
 
     Vec3 pos, scale;
 
+    // the six inner walls +x, -x, +y, -y, +z, -z, normals pointing inside
+    void getPlanes(Vec3 (&planesN)[6], double (&planesD)[6]) const;
     void calcLambda(Particle* p, Vec3 (&planesN)[6], double (&planesD)[6], double &lambda, unsigned int &idx) const;
 };
 
@@ -75,6 +86,7 @@ public:
 
     virtual bool testCollision(const Particle* p) const;
     virtual void resolveCollision(Particle* p, double kElastic, double kFriction, double dt) const;
+    virtual double signedDistance(const Vec3& x, Vec3& normal) const;
 
     Vec3 sphereC;
     double sphereR;
@@ -0,0 +1,39 @@
+#include "convergencelog.h"
+#include <QFile>
+#include <QTextStream>
+#include <algorithm>
+
+
+void ConvergenceLog::dropOldest() {
+    int drop = numSteps/2;
+    int removed = 0, r = 0;
+    while (r < rows.size() && removed < drop) {
+        int step = rows[r].step;
+        while (r < rows.size() && rows[r].step == step) r++;
+        removed++;
+    }
+    rows.remove(0, r);
+    numSteps -= removed;
+}
+
+QString ConvergenceLog::overlayLine() const {
+    double ms = 0;
+    for (const Row& row : rows) ms += row.ms;
+    int steps = std::max(numSteps, 1);
+    return "Log:  " + QString::number(numSteps) + " steps, "
+         + QString::number(double(rows.size())/steps, 'f', 1) + " iterations, "
+         + QString::number(ms/steps, 'f', 2) + " ms per step";
+}
+
+bool ConvergenceLog::write(const QString& path) const {
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) return false;
+    QTextStream out(&file);
+    out << "# tolerance " << tolerance << "\n";
+    out << "step,iteration,avg_error,max_error,ms\n";
+    for (const Row& row : rows) {
+        out << row.step << "," << row.iteration << "," << row.avgError << ","
+            << row.maxError << "," << row.ms << "\n";
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef CONVERGENCELOG_H
+#define CONVERGENCELOG_H
+
+#include <QVector>
+#include <QString>
+
+/*
+ *  Residuals of an iterative solver over the last steps: the average and max density error
+ *  after every iteration and the time it took. Exported as CSV, one row per iteration, to see
+ *  how many iterations each step needed and how much time went into the ones that barely
+ *  moved the error. Keeps the last maxSteps steps.
+ */
+class ConvergenceLog {
+public:
+    ConvergenceLog(int maxSteps_var = 10000){
+        maxSteps = maxSteps_var;
+    }
+
+    void clear(){
+        rows.clear();
+        numSteps = 0;
+        currentStep = 0;
+    }
+
+    // steps are numbered from the last clear. The tolerance the errors are compared to goes in
+    // the header of the export
+    void beginStep(double tolerance_var){
+        currentStep++;
+        tolerance = tolerance_var;
+        currentIteration = 0;
+        numSteps++;
+        if(numSteps > maxSteps) dropOldest();
+    }
+
+    void addIteration(double avgError, double maxError, double ms){
+        rows.push_back({currentStep, ++currentIteration, avgError, maxError, ms});
+    }
+
+    int getNumSteps() const { return numSteps; }
+
+    // average iterations and solver time per step over the log
+    QString overlayLine() const;
+
+    // step,iteration,avg_error,max_error,ms with the errors relative to the rest density,
+    // false if the file cannot be written
+    bool write(const QString& path) const;
+
+protected:
+    struct Row {
+        int step, iteration;
+        double avgError, maxError, ms;
+    };
+
+    // drops the oldest half, so it happens once every maxSteps/2 steps
+    void dropOldest();
+
+    int maxSteps;
+    int numSteps = 0;
+    int currentStep = 0, currentIteration = 0;
+    double tolerance = 0;
+    QVector<Row> rows;
+};
+
+#endif // CONVERGENCELOG_H
@@ -0,0 +1,224 @@
+#include "distributedwatercube.h"
+#include <algorithm>
+#include <cmath>
+
+
+DistributedWaterCube::DistributedWaterCube(SlabDecomposition& slabs_var)
+    : slabs(slabs_var)
+{
+}
+
+DistributedWaterCube::~DistributedWaterCube() {
+    for (Particle* p : owned) delete p;
+    delete grid;
+}
+
+bool DistributedWaterCube::reset(const Parameters& params_var) {
+    params = params_var;
+    for (Particle* p : owned) delete p;
+    owned.clear();
+    migratedSinceReport = 0;
+    exchangeSeconds = computeSeconds = 0;
+
+    // container of the scene, widened with the pool, and its walls as signed distances
+    container.setAABB(Vec3(0, 5, 0), Vec3(params.poolSize.x(), 30, params.poolSize.z()));
+    Vec3 planesN[6];
+    double planesD[6];
+    container.getPlanes(planesN, planesD);
+    sdfBoundary.clearColliders();
+    for (int w = 0; w < 6; w++) {
+        containerWalls[w].setPlane(planesN[w], planesD[w]);
+        sdfBoundary.addCollider(&containerWalls[w]);
+    }
+
+    // particles of radius 1 on a lattice of spacing 2, as in the scene
+    h = std::sqrt(8.0)*params.hReduction;
+    kernels.setH(h);
+    sdfBoundary.setKernel(SDFBoundary::Spiky, h, [&](double r) -> double { return kernels.spiky(r*r); });
+    sdfBoundary.setKernel(SDFBoundary::ViscosityLaplacian, h, [&](double r) -> double { return kernels.viscosityLaplacian(r*r); });
+
+    // pool and drop, numbered the same on every rank
+    std::vector<Vec3> positions;
+    Vec3 corner = container.pos - container.scale;
+    for (int i = 1; i < params.poolSize.y(); i++)
+        for (int k = 1; k < params.poolSize.z(); k++)
+            for (int j = 1; j < params.poolSize.x(); j++)
+                positions.push_back(corner + Vec3(j*2, i*2, k*2));
+    Vec3 dropCenter(container.pos.x(),
+                    container.pos.y() + container.scale.y()*3.f/4.f - params.dropSize/2.f,
+                    container.pos.z());
+    for (int i = -params.dropSize/2; i < params.dropSize/2; i++)
+        for (int k = -params.dropSize/2; k < params.dropSize/2; k++)
+            for (int j = -params.dropSize/2; j < params.dropSize/2; j++)
+                if (Vec3(j*2, i*2, k*2).norm()*2.f <= params.dropSize)
+                    positions.push_back(dropCenter + Vec3(j*2, i*2, k*2));
+
+    QVector<double> xs;
+    for (const Vec3& pos : positions) xs.push_back(pos.x());
+    slabs.setCuts(SlabDecomposition::balancedCuts(xs, slabs.getNumRanks()));
+    if (slabs.minWidth() < h) return false;
+
+    for (unsigned int id = 0; id < positions.size(); id++) {
+        if (!slabs.owns(positions[id])) continue;
+        Particle* p = new Particle(positions[id]);
+        p->id = id;
+        p->mass = 0.01;
+        p->density = params.restDensity;
+        owned.push_back(p);
+    }
+
+    // no rank ever holds more than all the particles
+    delete grid;
+    grid = new Grid(h, corner, container.pos + container.scale, positions.size());
+    queryIds.resize(positions.size());
+    return true;
+}
+
+void DistributedWaterCube::bin() {
+    particles = owned;
+    for (int g = 0; g < slabs.getNumGhosts(); g++) particles.push_back(slabs.getGhost(g));
+    std::sort(particles.begin(), particles.end(), [](const Particle* a, const Particle* b){ return a->id < b->id; });
+
+    ownedIndex.clear();
+    for (int l = 0; l < particles.size(); l++)
+        if (slabs.owns(particles[l]->pos)) ownedIndex.push_back(l);
+    grid->create(particles);
+}
+
+void DistributedWaterCube::findNeighbors() {
+    double h2 = h*h;
+    neighborStart.assign(1, 0);
+    neighbors.clear();
+    for (int l : ownedIndex) {
+        const Vec3& pos = particles[l]->pos;
+        unsigned int size;
+        grid->query(pos, h, queryIds, size);
+        for (unsigned int c = 0; c < size; c++)
+            if ((particles[queryIds[c]]->pos - pos).squaredNorm() <= h2) neighbors.push_back(queryIds[c]);
+        neighborStart.push_back(neighbors.size());
+    }
+}
+
+const SPHTile& DistributedWaterCube::loadNeighbors(int i, int fields) {
+    unsigned int begin = neighborStart[i], n = neighborStart[i+1] - begin;
+    if (int(n) > tileIds.size()) tileIds.resize(n);
+    std::copy(neighbors.begin() + begin, neighbors.begin() + begin + n, tileIds.begin());
+    tile.load(particles, tileIds, n, fields);
+    return tile;
+}
+
+void DistributedWaterCube::step() {
+    const double dt = params.timeStep, p0 = params.restDensity, v = params.viscosity;
+    const Vec3 gravity(0, -params.gravity, 0);
+
+    double t0 = MPI_Wtime();
+    migratedSinceReport += slabs.migrate(owned);
+    slabs.exchangeGhosts(owned, h);
+    double t1 = MPI_Wtime();
+
+    bin();
+    findNeighbors();
+    const int numOwned = ownedIndex.size();
+    accelerations.resize(numOwned);
+
+    // 1. densities, and the pressures of the state equation, whose stiffness the scene scales
+    // with the time step
+    const double k = params.stiffness*dt;
+    for (int i = 0; i < numOwned; i++) {
+        Particle* pi = particles[ownedIndex[i]];
+        const SPHTile& t = loadNeighbors(i, SPHTile::Positions);
+        pi->density = kernels.density(pi->pos, t) + p0*sdfBoundary.volume(SDFBoundary::Spiky, pi->pos);
+        pi->pressure = std::max(k*(pi->density/p0 - 1.0), 0.0);
+    }
+    double t2 = MPI_Wtime();
+    slabs.refreshGhosts(owned);
+    double t3 = MPI_Wtime();
+
+    // 2. viscosity and gravity
+    for (int i = 0; i < numOwned; i++) {
+        Particle* pi = particles[ownedIndex[i]];
+        const SPHTile& t = loadNeighbors(i, SPHTile::Velocities | SPHTile::Densities);
+        accelerations[i] = v*(kernels.viscosity(pi->pos, pi->vel, pi->density, t)
+                              + pi->vel/pi->density*sdfBoundary.volume(SDFBoundary::ViscosityLaplacian, pi->pos));
+    }
+    for (int i = 0; i < numOwned; i++) {
+        Particle* pi = particles[ownedIndex[i]];
+        pi->vel += dt*(accelerations[i] + gravity);
+    }
+
+    // 3. pressure, the walls mirror the pressure of the particle
+    for (int i = 0; i < numOwned; i++) {
+        Particle* pi = particles[ownedIndex[i]];
+        const SPHTile& t = loadNeighbors(i, SPHTile::Densities);
+        accelerations[i] = kernels.pressure(pi->pos, pi->pressure, pi->density, t)
+                - 2*pi->pressure/(pi->density*pi->density)*p0*sdfBoundary.volumeGradient(SDFBoundary::Spiky, pi->pos);
+    }
+    for (int i = 0; i < numOwned; i++) {
+        Particle* pi = particles[ownedIndex[i]];
+        pi->vel += dt*accelerations[i];
+        pi->prevPos = pi->pos;
+        pi->pos += dt*pi->vel;
+
+        // 3 times in case of corners
+        for (int c = 0; c < 3; c++)
+            if (container.testCollision(pi)) container.resolveCollision(pi, params.bouncing, params.friction, dt);
+    }
+    double t4 = MPI_Wtime();
+
+    exchangeSeconds += (t1 - t0) + (t3 - t2);
+    computeSeconds += (t2 - t1) + (t4 - t3);
+}
+
+DistributedWaterCube::Report DistributedWaterCube::report() {
+    int numOwned = owned.size(), numGhosts = slabs.getNumGhosts();
+    double energy = 0, maxDensity = 0;
+    for (const Particle* p : owned) {
+        energy += 0.5*p->mass*p->vel.squaredNorm();
+        maxDensity = std::max(maxDensity, double(p->density));
+    }
+    double ms[2] = {1000*exchangeSeconds, 1000*computeSeconds};
+
+    Report r;
+    MPI_Comm comm = slabs.getComm();
+    MPI_Allreduce(&numOwned, &r.numParticles, 1, MPI_INT, MPI_SUM, comm);
+    MPI_Allreduce(&numGhosts, &r.numGhosts, 1, MPI_INT, MPI_SUM, comm);
+    MPI_Allreduce(&numOwned, &r.minOwned, 1, MPI_INT, MPI_MIN, comm);
+    MPI_Allreduce(&numOwned, &r.maxOwned, 1, MPI_INT, MPI_MAX, comm);
+    MPI_Allreduce(&migratedSinceReport, &r.migrated, 1, MPI_INT, MPI_SUM, comm);
+    MPI_Allreduce(&energy, &r.kineticEnergy, 1, MPI_DOUBLE, MPI_SUM, comm);
+    MPI_Allreduce(&maxDensity, &r.maxDensity, 1, MPI_DOUBLE, MPI_MAX, comm);
+    double maxMs[2];
+    MPI_Allreduce(ms, maxMs, 2, MPI_DOUBLE, MPI_MAX, comm);
+    r.exchangeMs = maxMs[0];
+    r.computeMs = maxMs[1];
+
+    migratedSinceReport = 0;
+    exchangeSeconds = computeSeconds = 0;
+    return r;
+}
+
+std::vector<Vec3> DistributedWaterCube::gatherPositions() {
+    std::vector<double> local;
+    for (const Particle* p : owned) {
+        local.push_back(p->id);
+        local.push_back(p->pos.x());
+        local.push_back(p->pos.y());
+        local.push_back(p->pos.z());
+    }
+
+    MPI_Comm comm = slabs.getComm();
+    int count = local.size();
+    std::vector<int> counts(slabs.getNumRanks()), offsets(slabs.getNumRanks());
+    MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+    int total = 0;
+    for (int r = 0; r < slabs.getNumRanks(); r++) {
+        offsets[r] = total;
+        total += counts[r];
+    }
+    std::vector<double> all(slabs.getRank() == 0 ? total : 0);
+    MPI_Gatherv(local.data(), count, MPI_DOUBLE, all.data(), counts.data(), offsets.data(), MPI_DOUBLE, 0, comm);
+
+    std::vector<Vec3> positions(all.size()/4);
+    for (size_t k = 0; k < all.size(); k += 4) positions[size_t(all[k])] = Vec3(all[k+1], all[k+2], all[k+3]);
+    return positions;
+}
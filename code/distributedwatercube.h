@@ -0,0 +1,97 @@
+#ifndef DISTRIBUTEDWATERCUBE_H
+#define DISTRIBUTEDWATERCUBE_H
+
+#include <vector>
+#include <QVector>
+#include "defines.h"
+#include "particle.h"
+#include "colliders.h"
+#include "sdfboundary.h"
+#include "sphkernels.h"
+#include "sphtile.h"
+#include "grid.h"
+#include "slabdecomposition.h"
+
+/*
+ *  Weakly compressible step of the water cube without the GUI, split across the ranks of a
+ *  SlabDecomposition: the pool and the drop of the scene in the container, with signed distance
+ *  walls so no boundary particles have to be shared. Every step the particles migrate to their
+ *  slab, the ghosts within h are exchanged, the densities are computed and sent to the ghosts,
+ *  then viscosity, gravity and pressure move the owned particles.
+ *
+ *  Owned particles and ghosts are binned together, sorted by id, in a grid over the whole
+ *  container, and the neighbors of each particle are the candidates within h in the order of the
+ *  grid. That order does not depend on the slabs, so the sums are the same on any number of
+ *  ranks and the particles end bitwise where a single rank puts them.
+ */
+class DistributedWaterCube {
+public:
+    // defaults of the scene and its widget
+    struct Parameters {
+        Vec3i poolSize = Vec3i(25,5,25);
+        int dropSize = 25;
+        double timeStep = 0.01;
+        double hReduction = 0.7;
+        double restDensity = 0.004;
+        double stiffness = 7;
+        double viscosity = 0;
+        double gravity = 9.81;
+        double bouncing = 0.35, friction = 0.2;
+    };
+
+    // summed over the ranks, times are the largest of any rank since the last report
+    struct Report {
+        int numParticles = 0, numGhosts = 0;
+        int minOwned = 0, maxOwned = 0;
+        int migrated = 0;
+        double kineticEnergy = 0, maxDensity = 0;
+        double exchangeMs = 0, computeMs = 0;
+    };
+
+    DistributedWaterCube(SlabDecomposition& slabs_var);
+    ~DistributedWaterCube();
+
+    // creates the particles of this rank, in slabs holding about the same number each. False if
+    // a slab is thinner than h
+    bool reset(const Parameters& params_var);
+    void step();
+
+    // collective, every rank gets it
+    Report report();
+    // collective, positions by id on rank 0, empty elsewhere
+    std::vector<Vec3> gatherPositions();
+
+    double getH() const { return h; }
+    double getMinSlabWidth() const { return slabs.minWidth(); }
+
+protected:
+    // owned and ghosts by id, their neighbors within h, and the box
+    void bin();
+    void findNeighbors();
+    const SPHTile& loadNeighbors(int i, int fields);
+
+    SlabDecomposition& slabs;
+    Parameters params;
+    double h = 1;
+
+    ColliderLambdaInnerAABB container;
+    ColliderPlane containerWalls[6];
+    SDFBoundary sdfBoundary;
+    SPHKernels kernels;
+
+    QVector<Particle*> owned;
+    // owned and ghosts sorted by id, and where each owned particle is in it
+    QVector<Particle*> particles;
+    QVector<int> ownedIndex;
+    Grid* grid = nullptr;
+    QVector<unsigned int> queryIds;
+    std::vector<unsigned int> neighborStart, neighbors;
+    QVector<unsigned int> tileIds;
+    SPHTile tile;
+    std::vector<Vec3> accelerations;
+
+    int migratedSinceReport = 0;
+    double exchangeSeconds = 0, computeSeconds = 0;
+};
+
+#endif // DISTRIBUTEDWATERCUBE_H
@@ -0,0 +1,315 @@
+#include "flipsolver.h"
+#include <cmath>
+#include <algorithm>
+
+
+FlipSolver::FlipSolver() {
+    for(int a=0; a<3; a++)
+        for(int b=0; b<3; b++)
+            faceDims[a][b] = 0;
+}
+
+FlipSolver::~FlipSolver() {
+    if (bins) delete bins;
+}
+
+template<class Fn>
+void FlipSolver::parallelFor(int n, int chunk, const Fn& fn) {
+    if (pool) pool->parallelFor(n, schedule, chunk, fn);
+    else if (n > 0) fn(0, n, 0);
+}
+
+void FlipSolver::setBounds(const Vec3& bmin, const Vec3& bmax, double dx_var) {
+    int n[3];
+    for(int a=0; a<3; a++) n[a] = std::max(2, int(std::ceil((bmax[a]-bmin[a])/dx_var)));
+
+    origin = bmin;
+    if (bins && dx_var == dx && n[0] == dims[0] && n[1] == dims[1] && n[2] == dims[2]) {
+        bins->setOrigin(bmin);
+        return;
+    }
+
+    dx = dx_var;
+    for(int a=0; a<3; a++) dims[a] = n[a];
+    numCells = dims[0]*dims[1]*dims[2];
+
+    // half a cell short of the last face, so the bins have exactly our cells plus the padding
+    if (bins) delete bins;
+    bins = new Grid(dx, bmin, bmin + dx*Vec3(dims[0]-0.5, dims[1]-0.5, dims[2]-0.5), 0);
+
+    for(int a=0; a<3; a++){
+        for(int b=0; b<3; b++) faceDims[a][b] = dims[b] + (a == b);
+        int numFaces = faceDims[a][0]*faceDims[a][1]*faceDims[a][2];
+        faces[a].fill(0.0, numFaces);
+        oldFaces[a].fill(0.0, numFaces);
+        scratch[a].fill(0.0, numFaces);
+        valid[a].fill(0, numFaces);
+        nextValid[a].fill(0, numFaces);
+    }
+    cellType.fill(MultigridPoisson::Air, numCells);
+    pressure.fill(0.0, numCells);
+    rhs.fill(0.0, numCells);
+}
+
+void FlipSolver::step(const QVector<Particle*>& parts, const Vec3& gravity, double dt, Transfer transfer, double flipRatio) {
+    if (!bins) return;
+
+    // APIC matrices start at zero for the particles we did not see before
+    if (transfer == APIC) {
+        for(int a=0; a<3; a++)
+            if (affine[a].size() != parts.size()) affine[a].fill(Vec3(0,0,0), parts.size());
+    }
+
+    bin(parts);
+    particlesToGrid(transfer);
+    for(int a=0; a<3; a++) {
+        extrapolate(a, 2);
+        // element copy, a shared QVector would detach inside the threads below
+        std::copy(faces[a].constBegin(), faces[a].constEnd(), oldFaces[a].begin());
+    }
+
+    // gravity on every face but the walls
+    for(int a=0; a<3; a++) {
+        if (gravity[a] == 0) continue;
+        parallelFor(faceDims[a][0], 1, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++)
+                for(int j=0; j<faceDims[a][1]; j++)
+                    for(int k=0; k<faceDims[a][2]; k++) {
+                        int c[3] = {i, j, k};
+                        if (c[a] == 0 || c[a] == dims[a]) continue;
+                        faces[a][faceIndex(a,i,j,k)] += dt*gravity[a];
+                    }
+        });
+    }
+
+    project();
+
+    // the projection only fixed the faces next to the fluid, particles leaving it read the rest
+    for(int a=0; a<3; a++) extrapolate(a, 2);
+
+    gridToParticles(transfer, flipRatio);
+    advect(dt);
+}
+
+void FlipSolver::bin(const QVector<Particle*>& parts) {
+    fluidParts.clear();
+    fluidIds.clear();
+    for(int i=0; i<parts.size(); i++) {
+        if (parts[i]->type == ParticleType::Boundary) continue;
+        fluidParts.push_back(parts[i]);
+        fluidIds.push_back(i);
+    }
+    bins->create(fluidParts);
+
+    parallelFor(dims[0], 1, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int j=0; j<dims[1]; j++)
+                for(int k=0; k<dims[2]; k++) {
+                    unsigned int c = bins->cellIndex(i+1, j+1, k+1);
+                    cellType[cellIndex(i,j,k)] = bins->cellStart[c+1] > bins->cellStart[c] ? MultigridPoisson::Fluid : MultigridPoisson::Air;
+                }
+    });
+
+    numFluidCells = 0;
+    for(int c=0; c<numCells; c++) numFluidCells += cellType[c] == MultigridPoisson::Fluid;
+}
+
+void FlipSolver::particlesToGrid(Transfer transfer) {
+    // every face gathers the particles of the cells its trilinear weight reaches, in the order of
+    // the bins, so the sums do not depend on the threads
+    for(int a=0; a<3; a++) {
+        parallelFor(faceDims[a][0], 1, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++)
+                for(int j=0; j<faceDims[a][1]; j++)
+                    for(int k=0; k<faceDims[a][2]; k++) {
+                        int f = faceIndex(a,i,j,k);
+                        int c[3] = {i, j, k};
+
+                        // walls have no normal velocity
+                        if (c[a] == 0 || c[a] == dims[a]) {
+                            faces[a][f] = 0;
+                            valid[a][f] = 1;
+                            continue;
+                        }
+
+                        Vec3 facePos = origin + dx*Vec3(i + (a != 0)*0.5, j + (a != 1)*0.5, k + (a != 2)*0.5);
+                        int lo[3], hi[3];
+                        for(int b=0; b<3; b++) {
+                            lo[b] = std::max(c[b]-1, 0);
+                            hi[b] = std::min(b == a ? c[b] : c[b]+1, dims[b]-1);
+                        }
+
+                        double sumW = 0, sumV = 0;
+                        for(int ci=lo[0]; ci<=hi[0]; ci++)
+                            for(int cj=lo[1]; cj<=hi[1]; cj++)
+                                for(int ck=lo[2]; ck<=hi[2]; ck++) {
+                                    unsigned int cell = bins->cellIndex(ci+1, cj+1, ck+1);
+                                    for(unsigned int e=bins->cellStart[cell]; e<bins->cellStart[cell+1]; e++) {
+                                        unsigned int p = bins->cellEntries[e];
+                                        const Particle* pi = fluidParts[p];
+                                        Vec3 d = (pi->pos - facePos)/dx;
+                                        double w = std::max(1 - std::abs(d.x()), 0.0)
+                                                 * std::max(1 - std::abs(d.y()), 0.0)
+                                                 * std::max(1 - std::abs(d.z()), 0.0);
+                                        if (w <= 0) continue;
+                                        double vel = pi->vel[a];
+                                        if (transfer == APIC) vel -= affine[a][fluidIds[p]].dot(d*dx);
+                                        sumW += w;
+                                        sumV += w*vel;
+                                    }
+                                }
+
+                        faces[a][f] = sumW > 0 ? sumV/sumW : 0;
+                        valid[a][f] = sumW > 0;
+                    }
+        });
+    }
+}
+
+void FlipSolver::extrapolate(int a, int layers) {
+    const int (&fd)[3] = faceDims[a];
+    for(int layer=0; layer<layers; layer++) {
+        parallelFor(fd[0], 1, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++)
+                for(int j=0; j<fd[1]; j++)
+                    for(int k=0; k<fd[2]; k++) {
+                        int f = faceIndex(a,i,j,k);
+                        scratch[a][f] = faces[a][f];
+                        nextValid[a][f] = valid[a][f];
+                        if (valid[a][f]) continue;
+
+                        double sum = 0;
+                        int count = 0;
+                        int c[3] = {i, j, k};
+                        for(int b=0; b<3; b++) {
+                            for(int side=-1; side<=1; side+=2) {
+                                int n[3] = {c[0], c[1], c[2]};
+                                n[b] += side;
+                                if (n[b] < 0 || n[b] >= fd[b]) continue;
+                                int g = faceIndex(a,n[0],n[1],n[2]);
+                                if (!valid[a][g]) continue;
+                                sum += faces[a][g];
+                                count++;
+                            }
+                        }
+                        if (count) {
+                            scratch[a][f] = sum/count;
+                            nextValid[a][f] = 1;
+                        }
+                    }
+        });
+        std::swap(faces[a], scratch[a]);
+        std::swap(valid[a], nextValid[a]);
+    }
+}
+
+void FlipSolver::project() {
+    // with p scaled by dt/(rho dx) the faces lose the pressure difference of their two cells, and
+    // the divergence of a fluid cell vanishes when the Laplacian of p equals minus its net outflow
+    parallelFor(dims[0], 1, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int j=0; j<dims[1]; j++)
+                for(int k=0; k<dims[2]; k++) {
+                    int c = cellIndex(i,j,k);
+                    if (cellType[c] != MultigridPoisson::Fluid) {
+                        rhs[c] = 0;
+                        pressure[c] = 0;
+                        continue;
+                    }
+                    double outflow = faces[0][faceIndex(0,i+1,j,k)] - faces[0][faceIndex(0,i,j,k)]
+                                   + faces[1][faceIndex(1,i,j+1,k)] - faces[1][faceIndex(1,i,j,k)]
+                                   + faces[2][faceIndex(2,i,j,k+1)] - faces[2][faceIndex(2,i,j,k)];
+                    rhs[c] = -outflow;
+                }
+    });
+
+    // warm started with the pressures of the cells that were already fluid
+    poisson.setup(dims, cellType);
+    iterations = poisson.solve(rhs, pressure, tolerance, maxIterations);
+    residual = poisson.getResidual();
+
+    // subtract the pressure gradient from the faces touching a fluid cell
+    for(int a=0; a<3; a++) {
+        int stride = a == 0 ? dims[1]*dims[2] : a == 1 ? dims[2] : 1;
+        parallelFor(faceDims[a][0], 1, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++)
+                for(int j=0; j<faceDims[a][1]; j++)
+                    for(int k=0; k<faceDims[a][2]; k++) {
+                        int c[3] = {i, j, k};
+                        if (c[a] == 0 || c[a] == dims[a]) continue;
+                        int f = faceIndex(a,i,j,k);
+                        int cell = cellIndex(i,j,k);
+                        int prev = cell - stride;
+                        if (cellType[cell] != MultigridPoisson::Fluid && cellType[prev] != MultigridPoisson::Fluid) {
+                            valid[a][f] = 0;
+                            continue;
+                        }
+                        faces[a][f] -= pressure[cell] - pressure[prev];
+                        valid[a][f] = 1;
+                    }
+        });
+    }
+}
+
+double FlipSolver::interpolate(const QVector<double>& f, int a, const Vec3& pos, Vec3* grad) const {
+    const int (&fd)[3] = faceDims[a];
+    int base[3];
+    double t[3];
+    for(int b=0; b<3; b++) {
+        double g = (pos[b] - origin[b])/dx - (b == a ? 0.0 : 0.5);
+        base[b] = std::min(std::max(int(std::floor(g)), 0), fd[b]-2);
+        t[b] = std::min(std::max(g - base[b], 0.0), 1.0);
+    }
+
+    double value = 0;
+    if (grad) *grad = Vec3(0,0,0);
+    for(int di=0; di<2; di++)
+        for(int dj=0; dj<2; dj++)
+            for(int dk=0; dk<2; dk++) {
+                double wx = di ? t[0] : 1 - t[0];
+                double wy = dj ? t[1] : 1 - t[1];
+                double wz = dk ? t[2] : 1 - t[2];
+                double fv = f[faceIndex(a, base[0]+di, base[1]+dj, base[2]+dk)];
+                value += wx*wy*wz*fv;
+                if (grad) {
+                    *grad += fv/dx*Vec3((di ? 1 : -1)*wy*wz, (dj ? 1 : -1)*wx*wz, (dk ? 1 : -1)*wx*wy);
+                }
+            }
+    return value;
+}
+
+Vec3 FlipSolver::velocity(const Vec3& pos) const {
+    return Vec3(interpolate(faces[0],0,pos), interpolate(faces[1],1,pos), interpolate(faces[2],2,pos));
+}
+
+void FlipSolver::gridToParticles(Transfer transfer, double flipRatio) {
+    parallelFor(fluidParts.size(), 1024, [&](int begin, int end, int){
+        for(int p=begin; p<end; p++) {
+            Particle* pi = fluidParts[p];
+            if (transfer == APIC) {
+                for(int a=0; a<3; a++) pi->vel[a] = interpolate(faces[a], a, pi->pos, &affine[a][fluidIds[p]]);
+                continue;
+            }
+            Vec3 vel = velocity(pi->pos);
+            Vec3 change = vel - Vec3(interpolate(oldFaces[0],0,pi->pos),
+                                     interpolate(oldFaces[1],1,pi->pos),
+                                     interpolate(oldFaces[2],2,pi->pos));
+            pi->vel = flipRatio*(pi->vel + change) + (1 - flipRatio)*vel;
+        }
+    });
+}
+
+void FlipSolver::advect(double dt) {
+    // midpoint rule through the grid velocity, then back inside the walls
+    Vec3 lo = origin + Vec3(1e-3, 1e-3, 1e-3)*dx;
+    Vec3 hi = origin + dx*Vec3(dims[0], dims[1], dims[2]) - Vec3(1e-3, 1e-3, 1e-3)*dx;
+    parallelFor(fluidParts.size(), 1024, [&](int begin, int end, int){
+        for(int p=begin; p<end; p++) {
+            Particle* pi = fluidParts[p];
+            Vec3 mid = pi->pos + 0.5*dt*velocity(pi->pos);
+            pi->prevPos = pi->pos;
+            pi->pos += dt*velocity(mid);
+            for(int b=0; b<3; b++) pi->pos[b] = std::min(std::max(pi->pos[b], lo[b]), hi[b]);
+        }
+    });
+}
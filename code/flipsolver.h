@@ -0,0 +1,103 @@
+#ifndef FLIPSOLVER_H
+#define FLIPSOLVER_H
+
+#include <QVector>
+#include "particle.h"
+#include "grid.h"
+#include "threadpool.h"
+#include "multigrid.h"
+
+/*
+ *  Hybrid particle-grid fluid on a MAC grid over a box with solid walls. Every step the particle
+ *  velocities are splatted to the faces of the grid, gravity is added and the velocity field is
+ *  made divergence free with a pressure projection, then the particles take the grid velocity
+ *  back and are advected through it. FLIP takes back the change of the grid velocity, blended with
+ *  some PIC to damp the noise, APIC takes back the grid velocity and its affine part. Boundary
+ *  particles are ignored, the walls of the box are the boundary.
+ */
+class FlipSolver {
+public:
+    enum Transfer {
+        FLIP = 0,
+        APIC = 1,
+    };
+
+    FlipSolver();
+    ~FlipSolver();
+
+    // the loops run on pool with the given scheduling
+    void setPool(ThreadPool* p, ThreadPool::Schedule s) { pool = p; schedule = s; poisson.setPool(p, s); }
+    void setPreconditioner(MultigridPoisson::Preconditioner p) { poisson.setPreconditioner(p); }
+
+    // box covered by the grid, cells of size dx. Moving the box keeps the cells
+    void setBounds(const Vec3& bmin, const Vec3& bmax, double dx);
+
+    // projection stops when |r| <= tolerance |b| or after maxIterations
+    void setTolerance(double tol, int maxIter) { tolerance = tol; maxIterations = maxIter; }
+
+    // flipRatio is the FLIP part of the FLIP/PIC blend, unused with APIC
+    void step(const QVector<Particle*>& parts, const Vec3& gravity, double dt, Transfer transfer, double flipRatio);
+
+    int getIterations() const { return iterations; }
+    double getResidual() const { return residual; }
+    int getNumFluidCells() const { return numFluidCells; }
+    int getDims(int axis) const { return dims[axis]; }
+
+protected:
+    // sorts the fluid particles by cell and marks the cells holding one as fluid
+    void bin(const QVector<Particle*>& parts);
+    void particlesToGrid(Transfer transfer);
+    // faces without particles take the mean of their valid neighbors, layer by layer
+    void extrapolate(int axis, int layers);
+    void project();
+    void gridToParticles(Transfer transfer, double flipRatio);
+    void advect(double dt);
+
+    // trilinear interpolation of the faces of one axis, with the weight gradients if grad is set
+    double interpolate(const QVector<double>& f, int axis, const Vec3& pos, Vec3* grad = nullptr) const;
+    Vec3 velocity(const Vec3& pos) const;
+
+    template<class Fn>
+    void parallelFor(int n, int chunk, const Fn& fn);
+
+    int cellIndex(int i, int j, int k) const { return (i*dims[1] + j)*dims[2] + k; }
+    int faceIndex(int axis, int i, int j, int k) const {
+        return (i*faceDims[axis][1] + j)*faceDims[axis][2] + k;
+    }
+
+    ThreadPool* pool = nullptr;
+    ThreadPool::Schedule schedule = ThreadPool::Static;
+    double tolerance = 1e-4;
+    int maxIterations = 200;
+
+    Vec3 origin;
+    double dx = 1;
+    int dims[3] = {0, 0, 0};
+    int faceDims[3][3];
+    int numCells = 0;
+
+    // particles sorted by cell, bins.cellIndex(i+1, j+1, k+1) is cell (i, j, k)
+    Grid* bins = nullptr;
+
+    // fluid particles and their index in the particle container
+    QVector<Particle*> fluidParts;
+    QVector<int> fluidIds;
+
+    // face velocities, the velocities before the forces and the faces reached by particles
+    QVector<double> faces[3], oldFaces[3], scratch[3];
+    QVector<char> valid[3], nextValid[3];
+    QVector<char> cellType;   // MultigridPoisson::CellType
+
+    // pressure (scaled by dt/(rho dx)) and right hand side
+    QVector<double> pressure, rhs;
+    MultigridPoisson poisson;
+
+    // APIC: gradient of each velocity component carried by every particle
+    QVector<Vec3> affine[3];
+
+    int iterations = 0;
+    double residual = 0;
+    int numFluidCells = 0;
+};
+
+#endif // FLIPSOLVER_H
@@ -4,7 +4,7 @@
 void ForceConstAcceleration::apply() {
     for (Particle* p : particles) {
         // TODO
-        if(p->lock) continue;
+        if(p->lock || p->asleep) continue;
         p->force += p->mass*getAcceleration();
     }
 }
@@ -12,7 +12,7 @@ void ForceConstAcceleration::apply() {
 void ForceSPH::apply() {
     for (Particle* p : particles) {
         // TODO
-        if(p->lock) continue;
+        if(p->lock || p->asleep) continue;
         p->force += getForce();
     }
 }
@@ -20,7 +20,7 @@ void ForceSPH::apply() {
 void ForceDragLinear::apply() {
     for (Particle* p : particles) {
         // TODO
-        if(p->lock) continue;
+        if(p->lock || p->asleep) continue;
         p->force += -0.015 * p->vel;
     }
 }
@@ -28,7 +28,7 @@ void ForceDragLinear::apply() {
 void ForceDragQuadratic::apply() {
     for (Particle* p : particles) {
         // TODO
-        if(p->lock) continue;
+        if(p->lock || p->asleep) continue;
         p->force += -0.015 * p->vel.norm() * p->vel;
     }
 }
@@ -36,7 +36,7 @@ void ForceDragQuadratic::apply() {
 void ForceBlackhole::apply() {
     for (Particle* p : particles) {
         // TODO
-        if(p->lock) continue;
+        if(p->lock || p->asleep) continue;
         Vecd dirF = getPosition() - p->pos;
         double dist = dirF.norm();
         p->force += dirF*intensity*1000/(dist*dist*dist);
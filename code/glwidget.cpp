@@ -69,8 +69,9 @@ void GLWidget::paintTextOverlay()
 
     const int bX = 10;
     const int bY = 10;
+    const QStringList lines = scene->getOverlayLines();
     const int sizeX = 170;
-    const int sizeY = 110;
+    const int sizeY = 110 + 20*lines.size();
 
     // Background
     painter.setPen(penLineGrey);
@@ -90,6 +91,9 @@ void GLWidget::paintTextOverlay()
     painter.drawText(10 + 5, bY + 10 +  50, "Sim time:  " + QString::number(simTime, 'f', 3) + " s");
     painter.drawText(10 + 5, bY + 10 +  70, "Curr perf: " + QString::number(simPerf, 'f', 1) + " ms/step");
     painter.drawText(10 + 5, bY + 10 +  90, "Avg perf:  " + QString::number(simMs/double(simSteps), 'f', 1) + " ms/step");
+    for (int i = 0; i < lines.size(); i++) {
+        painter.drawText(10 + 5, bY + 10 + 110 + 20*i, lines[i]);
+    }
     painter.end();
 
     // Reset GL depth test and alpha
@@ -0,0 +1,283 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <QVector>
+#include <cmath>
+#include <algorithm>
+#include "particle.h"
+#include "neighborsearch.h"
+
+/*
+ *  Dense uniform grid over a known bounding box. Cells are indexed directly, so unlike Hash
+ *  two different cells never share a bucket. The box is padded with one layer of cells and
+ *  particles outside of it are clamped into the border cells, so the 27-cell stencil around
+ *  any particle never leaves the grid. Along a periodic axis the grid covers one period and the
+ *  cells wrap around instead.
+ */
+class Grid : public NeighborSearch {
+public:
+    Grid(double spacing_var, const Vec3& bmin, const Vec3& bmax, unsigned int maxNObjects){
+        spacing = spacing_var;
+        setBounds(bmin, bmax);
+        cellEntries.resize(maxNObjects);
+        queryIds.resize(maxNObjects);
+        querySize = 0;
+    }
+
+    void setBounds(const Vec3& bmin, const Vec3& bmax){
+        origin = bmin;
+        extent = bmax - bmin;
+        for(int a=0; a<3; a++){
+            if(periodic.isPeriodic(a)){
+                origin[a] = periodic.getOrigin()[a];
+                extent[a] = periodic.getPeriod()[a];
+                dims[a] = periodic.getNumCells(a) + 2;
+            } else {
+                dims[a] = std::max(1, int(std::ceil((bmax[a]-bmin[a])/spacing))) + 2;
+            }
+        }
+        numCells = dims[0]*dims[1]*dims[2];
+        cellStart.resize(numCells+1);
+
+        // z is the fastest axis, so the 27-cell stencil is 9 runs of 3 contiguous cells
+        int n = 0;
+        for(int xi=-1; xi<=1; xi++)
+            for(int yi=-1; yi<=1; yi++)
+                stencil[n++] = (xi*dims[1] + yi)*dims[2] - 1;
+    }
+
+    // the container moved but kept its size: shift the grid, keep the cells
+    void setOrigin(const Vec3& bmin){
+        origin = bmin;
+    }
+
+    virtual void setPeriodic(const PeriodicDomain& domain){
+        NeighborSearch::setPeriodic(domain);
+        setBounds(origin, origin + extent);
+    }
+
+    int intCoord(double coord, int axis){
+        if(periodic.isPeriodic(axis)) return periodic.wrapCell(periodic.cellCoord(coord, axis), axis) + 1;
+        int c = int(std::floor((coord - origin[axis])/spacing)) + 1;
+        return std::min(std::max(c, 1), dims[axis]-2);
+    }
+
+    // cells [c0, c1] of the query range along one axis, before wrapping on a periodic axis
+    void axisRange(double lo, double hi, int axis, int& c0, int& c1){
+        if(periodic.isPeriodic(axis)){
+            c0 = periodic.cellCoord(lo, axis);
+            c1 = periodic.cellCoord(hi, axis);
+            periodic.clampRange(c0, c1, axis);
+        } else {
+            c0 = intCoord(lo, axis);
+            c1 = intCoord(hi, axis);
+        }
+    }
+
+    // grid coordinate of a cell of axisRange
+    int wrappedCoord(int c, int axis){
+        return periodic.isPeriodic(axis) ? periodic.wrapCell(c, axis) + 1 : c;
+    }
+
+    unsigned int cellIndex(int xi, int yi, int zi){
+        return (xi*dims[1] + yi)*dims[2] + zi;
+    }
+
+    unsigned int cellPos(const Vec3& pos){
+        return cellIndex(intCoord(pos.x(),0), intCoord(pos.y(),1), intCoord(pos.z(),2));
+    }
+
+    virtual void create(const QVector<Particle *>& parts){
+        // grow rather than leave the particles past the capacity out of the cells
+        unsigned int numObjects = parts.size();
+        if(numObjects > (unsigned int)cellEntries.size()){
+            cellEntries.resize(numObjects);
+            queryIds.resize(numObjects);
+        }
+
+        // determine cell sizes
+
+        cellStart.fill(0);
+
+        for(unsigned int i=0; i < numObjects; i++){
+            cellStart[cellPos(parts[i]->pos)]++;
+        }
+
+        // determine cells starts
+
+        unsigned int start = 0;
+        for(unsigned int i=0; i < numCells; i++){
+            start += cellStart[i];
+            cellStart[i] = start;
+        }
+        cellStart[numCells] = start; //guard
+
+        // fill in objects ids
+
+        for(unsigned int i=0; i < numObjects; i++){
+            unsigned int c = cellPos(parts[i]->pos);
+            cellStart[c]--;
+            cellEntries[cellStart[c]] = i;
+        }
+    }
+
+    virtual void query(const Vec3& pos, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        size = 0;
+
+        if(periodic.any()){
+            int c0[3], c1[3];
+            for(int a=0; a<3; a++) axisRange(pos[a] - maxDist, pos[a] + maxDist, a, c0[a], c1[a]);
+            gatherWrapped(c0, c1, ids, size);
+        } else if(maxDist <= spacing){
+            gatherStencil(cellPos(pos), ids, size);
+        } else {
+            // radius larger than a cell, visit the whole overlapped range
+            gatherRange(intCoord(pos.x() - maxDist,0), intCoord(pos.y() - maxDist,1), intCoord(pos.z() - maxDist,2),
+                        intCoord(pos.x() + maxDist,0), intCoord(pos.y() + maxDist,1), intCoord(pos.z() + maxDist,2), ids, size);
+        }
+        countQuery(size);
+    }
+
+    using NeighborSearch::query;
+    using NeighborSearch::queryCell;
+    using NeighborSearch::queryCellHalf;
+
+    virtual bool hasExactCells() const { return true; }
+    virtual unsigned int getNumCells() const { return numCells; }
+
+    virtual void queryCell(unsigned int c, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        size = 0;
+
+        if(periodic.any()){
+            int ci[3] = {int(c/(dims[1]*dims[2])), int((c/dims[2])%dims[1]), int(c%dims[2])};
+            int c0[3], c1[3];
+            for(int a=0; a<3; a++){
+                if(periodic.isPeriodic(a)){
+                    // back to the cell before wrapping, periodic cells can be wider than the spacing
+                    int r = int(std::ceil(maxDist/periodic.getCellSize(a)));
+                    c0[a] = ci[a] - 1 - r;
+                    c1[a] = ci[a] - 1 + r;
+                    periodic.clampRange(c0[a], c1[a], a);
+                } else {
+                    int r = int(std::ceil(maxDist/spacing));
+                    c0[a] = std::max(ci[a]-r, 1);
+                    c1[a] = std::min(ci[a]+r, dims[a]-2);
+                }
+            }
+            gatherWrapped(c0, c1, ids, size);
+        } else if(maxDist <= spacing){
+            gatherStencil(c, ids, size);
+        } else {
+            int r = int(std::ceil(maxDist/spacing));
+            int xi = c/(dims[1]*dims[2]);
+            int yi = (c/dims[2])%dims[1];
+            int zi = c%dims[2];
+            gatherRange(std::max(xi-r,1), std::max(yi-r,1), std::max(zi-r,1),
+                        std::min(xi+r,dims[0]-2), std::min(yi+r,dims[1]-2), std::min(zi+r,dims[2]-2), ids, size);
+        }
+        countQuery(size);
+    }
+
+    virtual void queryCellHalf(unsigned int c, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        size = 0;
+
+        int r = maxDist <= spacing ? 1 : int(std::ceil(maxDist/spacing));
+        int xi = c/(dims[1]*dims[2]);
+        int yi = (c/dims[2])%dims[1];
+        int zi = c%dims[2];
+
+        // offsets lexicographically after (0,0,0), in runs of contiguous cells along z
+        for(int x=xi; x<=std::min(xi+r,dims[0]-2); x++){
+            for(int y=(x==xi ? yi : std::max(yi-r,1)); y<=std::min(yi+r,dims[1]-2); y++){
+                int z0 = (x==xi && y==yi) ? zi+1 : std::max(zi-r,1);
+                int z1 = std::min(zi+r,dims[2]-2);
+                if(z0 > z1) continue;
+
+                unsigned int start = cellStart[cellIndex(x,y,z0)];
+                unsigned int end = cellStart[cellIndex(x,y,z1)+1];
+
+                for(unsigned int i=start; i<end; i++){
+                    ids[size] = cellEntries[i];
+                    size++;
+                }
+            }
+        }
+        countQuery(size);
+    }
+
+    // 27-cell stencil around cell c
+    void gatherStencil(unsigned int c, QVector<unsigned int>& ids, unsigned int& size){
+        for(int s=0; s<9; s++){
+            unsigned int start = cellStart[c+stencil[s]];
+            unsigned int end = cellStart[c+stencil[s]+3];
+
+            for(unsigned int i=start; i<end; i++){
+                ids[size] = cellEntries[i];
+                size++;
+            }
+        }
+    }
+
+    void gatherRange(int x0, int y0, int z0, int x1, int y1, int z1, QVector<unsigned int>& ids, unsigned int& size){
+        for(int  xi=x0; xi<=x1; xi++){
+            for(int  yi=y0;yi<=y1; yi++){
+                unsigned int c = cellIndex(xi,yi,z0);
+                unsigned int start = cellStart[c];
+                unsigned int end = cellStart[c+z1-z0+1];
+
+                for(unsigned int i=start; i<end; i++){
+                    ids[size] = cellEntries[i];
+                    size++;
+                }
+            }
+        }
+    }
+
+    // the range along z is one run of contiguous cells, or two when it wraps around
+    void gatherWrapped(const int c0[3], const int c1[3], QVector<unsigned int>& ids, unsigned int& size){
+        int runs[2][2];
+        int numRuns = 0;
+        int z0 = wrappedCoord(c0[2],2), z1 = wrappedCoord(c1[2],2);
+        if(z0 <= z1 && c1[2] - c0[2] == z1 - z0){
+            runs[numRuns][0] = z0; runs[numRuns++][1] = z1;
+        } else {
+            runs[numRuns][0] = z0; runs[numRuns++][1] = periodic.getNumCells(2);
+            runs[numRuns][0] = 1;  runs[numRuns++][1] = z1;
+        }
+
+        for(int xi=c0[0]; xi<=c1[0]; xi++){
+            int x = wrappedCoord(xi,0);
+            for(int yi=c0[1]; yi<=c1[1]; yi++){
+                int y = wrappedCoord(yi,1);
+                for(int r=0; r<numRuns; r++){
+                    unsigned int start = cellStart[cellIndex(x,y,runs[r][0])];
+                    unsigned int end = cellStart[cellIndex(x,y,runs[r][1])+1];
+
+                    for(unsigned int i=start; i<end; i++){
+                        ids[size] = cellEntries[i];
+                        size++;
+                    }
+                }
+            }
+        }
+    }
+
+    virtual double getSpacing() const { return spacing; }
+
+    // same box, new cells
+    virtual void setSpacing(double s){
+        spacing = s;
+        periodic.setSpacing(s);
+        setBounds(origin, origin + extent);
+    }
+
+    double spacing;
+    Vec3 origin, extent;
+    int dims[3];
+    unsigned int numCells;
+    int stencil[9];
+};
+
+
+
+#endif // GRID_H
@@ -6,8 +6,9 @@
 #include <cmath>
 #include <algorithm>
 #include "particle.h"
+#include "neighborsearch.h"
 
-class Hash {
+class Hash : public NeighborSearch {
 public:
     Hash(double spacing_var, unsigned int maxNObjects){
         spacing = spacing_var;
@@ -31,22 +32,27 @@ public:
         return std::floor(coord/ spacing);
     }
 
-    unsigned int hashPos(QVector<Particle *> parts, unsigned int nr){
-        return hashCoords(
-                    intCoord(parts[nr]->pos.x()),
-                    intCoord(parts[nr]->pos.y()),
-                    intCoord(parts[nr]->pos.z())
-                    );
+    // along a periodic axis the cells start at the origin of the domain, before wrapping
+    int intCoord(double coord, int axis){
+        return periodic.isPeriodic(axis) ? periodic.cellCoord(coord, axis) : intCoord(coord);
+    }
+
+    unsigned int hashCell(int xi, int yi, int zi){
+        return hashCoords(periodic.wrapCell(xi,0), periodic.wrapCell(yi,1), periodic.wrapCell(zi,2));
     }
-    unsigned int hashPos(Vec3 pos){
-        return hashCoords(
-                    intCoord(pos.x()),
-                    intCoord(pos.y()),
-                    intCoord(pos.z())
+
+    unsigned int hashPos(const QVector<Particle *>& parts, unsigned int nr){
+        return hashPos(parts[nr]->pos);
+    }
+    unsigned int hashPos(const Vec3& pos){
+        return hashCell(
+                    intCoord(pos.x(),0),
+                    intCoord(pos.y(),1),
+                    intCoord(pos.z(),2)
                     );
     }
 
-    void create(QVector<Particle *> parts){
+    virtual void create(const QVector<Particle *>& parts){
         unsigned int numObjects = std::min(parts.size(),cellEntries.size());
 
         // determine cell sizes
@@ -77,61 +83,49 @@ public:
         }
     }
 
-    void query(QVector<Particle *> parts, unsigned int nr, float maxDist){
-        int x0 = intCoord(parts[nr]->pos.x() - maxDist);
-        int y0 = intCoord(parts[nr]->pos.y() - maxDist);
-        int z0 = intCoord(parts[nr]->pos.z() - maxDist);
+    void query(const QVector<Particle *>& parts, unsigned int nr, float maxDist){
+        query(parts[nr]->pos, maxDist, queryIds, querySize);
+    }
 
-        int x1 = intCoord(parts[nr]->pos.x() + maxDist);
-        int y1 = intCoord(parts[nr]->pos.y() + maxDist);
-        int z1 = intCoord(parts[nr]->pos.z() + maxDist);
+    using NeighborSearch::query;
 
-        querySize = 0;
+    virtual void query(const Vec3& pos, float maxDist, QVector<unsigned int>& ids, unsigned int& size){
+        int x0 = intCoord(pos.x() - maxDist,0);
+        int y0 = intCoord(pos.y() - maxDist,1);
+        int z0 = intCoord(pos.z() - maxDist,2);
 
-        for(int  xi=x0; xi<=x1; xi++){
-            for(int  yi=y0;yi<=y1; yi++){
-                for(int  zi=z0;zi<=z1; zi++){
-                    unsigned int h = hashCoords(xi,yi,zi);
-                    unsigned int start = cellStart[h];
-                    unsigned int end = cellStart[h+1];
+        int x1 = intCoord(pos.x() + maxDist,0);
+        int y1 = intCoord(pos.y() + maxDist,1);
+        int z1 = intCoord(pos.z() + maxDist,2);
 
-                    for(unsigned int i=start; i<end; i++){
-                        queryIds[querySize] = cellEntries[i];
-                        querySize++;
-                    }
-                }
-            }
-        }
-    }
+        periodic.clampRange(x0,x1,0);
+        periodic.clampRange(y0,y1,1);
+        periodic.clampRange(z0,z1,2);
 
-    void query(Vec3 pos, float maxDist){
-        int x0 = intCoord(pos.x() - maxDist);
-        int y0 = intCoord(pos.y() - maxDist);
-        int z0 = intCoord(pos.z() - maxDist);
-
-        int x1 = intCoord(pos.x() + maxDist);
-        int y1 = intCoord(pos.y() + maxDist);
-        int z1 = intCoord(pos.z() + maxDist);
-
-        querySize = 0;
+        size = 0;
 
         for(int  xi=x0; xi<=x1; xi++){
             for(int  yi=y0;yi<=y1; yi++){
                 for(int  zi=z0;zi<=z1; zi++){
-                    unsigned int h = hashCoords(xi,yi,zi);
+                    unsigned int h = hashCell(xi,yi,zi);
                     unsigned int start = cellStart[h];
                     unsigned int end = cellStart[h+1];
+                    // buckets shared by several cells of the range are gathered more than once
+                    if(size + end - start > (unsigned int)ids.size())
+                        ids.resize(2*(size + end - start));
 
                     for(unsigned int i=start; i<end; i++){
-                        queryIds[querySize] = cellEntries[i];
-                        querySize++;
+                        ids[size] = cellEntries[i];
+                        size++;
                     }
                 }
             }
         }
+
+        countQuery(size);
     }
 
-    void queryAll(QVector<Particle *> parts, float maxDist){
+    void queryAll(const QVector<Particle *>& parts, float maxDist){
         int num = 0;
         float maxDist2 = maxDist * maxDist;
 
@@ -144,7 +138,7 @@ public:
                 int id1 = queryIds[j];
                 if (id1 >= id0)
                     continue;
-                float dist2 = (parts[id0]->pos-parts[id1]->pos).squaredNorm();//vecDistSquared(parts, id0, parts, id1);
+                float dist2 = periodic.minimumImage(parts[id0]->pos-parts[id1]->pos).squaredNorm();//vecDistSquared(parts, id0, parts, id1);
                 if (dist2 > maxDist2)
                     continue;
 
@@ -160,9 +154,21 @@ public:
         firstAdjId[maxNumObjects] = num;
     }
 
+    virtual double getSpacing() const { return spacing; }
+    virtual void setSpacing(double s){
+        spacing = s;
+        periodic.setSpacing(s);
+    }
+    virtual unsigned int getTableSize() const { return tableSize; }
+    virtual unsigned int getTableFactor() const { return maxNumObjects ? tableSize/maxNumObjects : 0; }
+
+    virtual void setTableFactor(unsigned int f){
+        tableSize = f * maxNumObjects;
+        cellStart.resize(tableSize+1);
+    }
+
     double spacing;
-    unsigned int tableSize, querySize;
-    QVector<unsigned int> cellStart, cellEntries, queryIds;
+    unsigned int tableSize;
 
     unsigned int maxNumObjects;
     QVector<int> firstAdjId;
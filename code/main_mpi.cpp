@@ -0,0 +1,118 @@
+#include <mpi.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <QFile>
+#include <QTextStream>
+#include "distributedwatercube.h"
+
+/*
+ *  Water cube without the GUI, split in slabs across the MPI ranks:
+ *
+ *      mpirun -np 4 ./SimulationsMPI --steps 200 --pool 91 5 91 --out positions.csv
+ *
+ *  Rank 0 prints a report every --report steps and, at the end, a checksum of the positions
+ *  ordered by id, which is the same for any number of ranks.
+ */
+
+static void usage() {
+    printf("usage: SimulationsMPI [--steps n] [--report n] [--pool x y z] [--drop d] [--dt s]\n"
+           "                      [--viscosity v] [--out positions.csv]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    MPI_Init(&argc, &argv);
+    int status = 0;
+    {
+        SlabDecomposition slabs;
+        const bool root = slabs.getRank() == 0;
+
+        DistributedWaterCube::Parameters params;
+        int steps = 200, reportEvery = 20;
+        const char* out = nullptr;
+        for (int a = 1; a < argc; a++) {
+            bool more = a + 1 < argc;
+            if (!strcmp(argv[a], "--steps") && more) steps = atoi(argv[++a]);
+            else if (!strcmp(argv[a], "--report") && more) reportEvery = std::max(1, atoi(argv[++a]));
+            else if (!strcmp(argv[a], "--pool") && a + 3 < argc) {
+                params.poolSize = Vec3i(atoi(argv[a+1]), atoi(argv[a+2]), atoi(argv[a+3]));
+                a += 3;
+            }
+            else if (!strcmp(argv[a], "--drop") && more) params.dropSize = atoi(argv[++a]);
+            else if (!strcmp(argv[a], "--dt") && more) params.timeStep = atof(argv[++a]);
+            else if (!strcmp(argv[a], "--viscosity") && more) params.viscosity = atof(argv[++a]);
+            else if (!strcmp(argv[a], "--out") && more) out = argv[++a];
+            else {
+                if (root) usage();
+                status = 1;
+                break;
+            }
+        }
+
+        DistributedWaterCube cube(slabs);
+        if (!status && !cube.reset(params)) {
+            if (root) printf("a slab is %.2f wide, thinner than h = %.2f: use fewer ranks or a wider pool\n",
+                             cube.getMinSlabWidth(), cube.getH());
+            status = 1;
+        }
+
+        if (!status) {
+            if (root) {
+                printf("%d ranks, h %.3f", slabs.getNumRanks(), cube.getH());
+                if (std::isfinite(cube.getMinSlabWidth())) printf(", slabs at least %.2f wide", cube.getMinSlabWidth());
+                printf("\n");
+            }
+            double start = MPI_Wtime();
+            for (int s = 1; s <= steps; s++) {
+                cube.step();
+                if (s % reportEvery && s != steps) continue;
+                DistributedWaterCube::Report r = cube.report();
+                int since = s % reportEvery ? s % reportEvery : reportEvery;
+                if (root) printf("step %4d  particles %d, owned %d to %d, ghosts %d, migrated %d  "
+                                 "kinetic %.6e  max density %.6f  exchange %.2f ms, compute %.2f ms per step\n",
+                                 s, r.numParticles, r.minOwned, r.maxOwned, r.numGhosts, r.migrated,
+                                 r.kineticEnergy, r.maxDensity, r.exchangeMs/since, r.computeMs/since);
+            }
+            double seconds = MPI_Wtime() - start;
+
+            std::vector<Vec3> positions = cube.gatherPositions();
+            if (root) {
+                // FNV-1a over the bits of the coordinates, in id order
+                double sum = 0;
+                uint64_t bits = 1469598103934665603ull;
+                for (const Vec3& p : positions) {
+                    for (int c = 0; c < 3; c++) {
+                        uint64_t u;
+                        memcpy(&u, &p[c], sizeof(u));
+                        bits = (bits ^ u)*1099511628211ull;
+                        sum += p[c];
+                    }
+                }
+                printf("%d steps in %.2f s, %.2f ms per step\n", steps, seconds, 1000*seconds/std::max(steps, 1));
+                printf("checksum %.17g bits %016llx\n", sum, (unsigned long long)bits);
+
+                if (out) {
+                    QFile file(out);
+                    if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+                        QTextStream stream(&file);
+                        stream << "id,x,y,z\n";
+                        for (size_t id = 0; id < positions.size(); id++) {
+                            const Vec3& p = positions[id];
+                            stream << id << "," << QString::number(p.x(), 'g', 17) << ","
+                                   << QString::number(p.y(), 'g', 17) << "," << QString::number(p.z(), 'g', 17) << "\n";
+                        }
+                    } else {
+                        printf("cannot write %s\n", out);
+                        status = 1;
+                    }
+                }
+            }
+        }
+    }
+    MPI_Finalize();
+    return status;
+}
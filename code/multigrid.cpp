@@ -0,0 +1,278 @@
+#include "multigrid.h"
+#include <cmath>
+#include <algorithm>
+
+
+template<class Fn>
+void MultigridPoisson::parallelFor(int n, int chunk, const Fn& fn) {
+    if (pool) pool->parallelFor(n, schedule, chunk, fn);
+    else if (n > 0) fn(0, n, 0);
+}
+
+void MultigridPoisson::setup(const int dims[3], const QVector<char>& cellTypes) {
+    // halve every axis until the coarsest level is a handful of cells
+    int numLevels = 1;
+    int d[3] = {dims[0], dims[1], dims[2]};
+    while (d[0]*d[1]*d[2] > 64 && (d[0] > 1 || d[1] > 1 || d[2] > 1)) {
+        for(int a=0; a<3; a++) d[a] = (d[a] + 1)/2;
+        numLevels++;
+    }
+    levels.resize(numLevels);
+
+    for(int l=0; l<numLevels; l++) {
+        Level& level = levels[l];
+        for(int a=0; a<3; a++) level.dims[a] = l == 0 ? dims[a] : (levels[l-1].dims[a] + 1)/2;
+        level.numCells = level.dims[0]*level.dims[1]*level.dims[2];
+        level.invH2 = 1.0/double(1 << (2*l));
+        level.type.resize(level.numCells);
+        level.diagonal.resize(level.numCells);
+        level.x.fill(0.0, level.numCells);
+        level.b.fill(0.0, level.numCells);
+        level.r.fill(0.0, level.numCells);
+
+        if (l == 0) {
+            std::copy(cellTypes.begin(), cellTypes.begin() + level.numCells, level.type.begin());
+        } else {
+            // air if any child is air, the pressure is pinned there
+            const Level& fine = levels[l-1];
+            parallelFor(level.dims[0], 1, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++)
+                    for(int j=0; j<level.dims[1]; j++)
+                        for(int k=0; k<level.dims[2]; k++) {
+                            char type = Fluid;
+                            for(int fi=2*i; fi<std::min(2*i+2, fine.dims[0]); fi++)
+                                for(int fj=2*j; fj<std::min(2*j+2, fine.dims[1]); fj++)
+                                    for(int fk=2*k; fk<std::min(2*k+2, fine.dims[2]); fk++)
+                                        if (fine.type[fine.index(fi,fj,fk)] == Air) type = Air;
+                            level.type[level.index(i,j,k)] = type;
+                        }
+            });
+        }
+
+        // walls are not neighbors, air and fluid cells are
+        parallelFor(level.dims[0], 1, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++)
+                for(int j=0; j<level.dims[1]; j++)
+                    for(int k=0; k<level.dims[2]; k++) {
+                        int c = level.index(i,j,k);
+                        level.diagonal[c] = level.type[c] != Fluid ? 0 :
+                            (i > 0) + (i < level.dims[0]-1) + (j > 0) + (j < level.dims[1]-1) + (k > 0) + (k < level.dims[2]-1);
+                    }
+        });
+    }
+
+    int n = levels[0].numCells;
+    r.fill(0.0, n);
+    z.fill(0.0, n);
+    s.fill(0.0, n);
+    As.fill(0.0, n);
+    dotBlocks.fill(0.0, numDotBlocks);
+}
+
+void MultigridPoisson::applyLaplacian(const Level& l, const QVector<double>& x, QVector<double>& result) {
+    int strideI = l.dims[1]*l.dims[2], strideJ = l.dims[2];
+    parallelFor(l.dims[0], 1, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int j=0; j<l.dims[1]; j++)
+                for(int k=0; k<l.dims[2]; k++) {
+                    int c = l.index(i,j,k);
+                    if (l.type[c] != Fluid) {
+                        result[c] = 0;
+                        continue;
+                    }
+                    // air neighbors hold zero, only the fluid ones contribute
+                    double sum = l.diagonal[c]*x[c];
+                    if (i > 0)           sum -= x[c - strideI];
+                    if (i < l.dims[0]-1) sum -= x[c + strideI];
+                    if (j > 0)           sum -= x[c - strideJ];
+                    if (j < l.dims[1]-1) sum -= x[c + strideJ];
+                    if (k > 0)           sum -= x[c - 1];
+                    if (k < l.dims[2]-1) sum -= x[c + 1];
+                    result[c] = l.invH2*sum;
+                }
+    });
+}
+
+void MultigridPoisson::smooth(Level& l, int color) {
+    // the cells of one color only read the other one, so they update in any order
+    int strideI = l.dims[1]*l.dims[2], strideJ = l.dims[2];
+    parallelFor(l.dims[0], 1, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int j=0; j<l.dims[1]; j++)
+                for(int k=(i + j + color) & 1; k<l.dims[2]; k+=2) {
+                    int c = l.index(i,j,k);
+                    if (l.type[c] != Fluid) continue;
+                    // air neighbors hold zero
+                    double sum = l.b[c]/l.invH2;
+                    if (i > 0)           sum += l.x[c - strideI];
+                    if (i < l.dims[0]-1) sum += l.x[c + strideI];
+                    if (j > 0)           sum += l.x[c - strideJ];
+                    if (j < l.dims[1]-1) sum += l.x[c + strideJ];
+                    if (k > 0)           sum += l.x[c - 1];
+                    if (k < l.dims[2]-1) sum += l.x[c + 1];
+                    l.x[c] = sum/l.diagonal[c];
+                }
+    });
+}
+
+void MultigridPoisson::restrictResidual(const Level& fine, Level& coarse) {
+    // transpose of the trilinear prolongation over 8, fine cells 2I-1 .. 2I+2 weigh 1/4, 3/4, 3/4, 1/4
+    static const double weights[4] = {0.25, 0.75, 0.75, 0.25};
+    parallelFor(coarse.dims[0], 1, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int j=0; j<coarse.dims[1]; j++)
+                for(int k=0; k<coarse.dims[2]; k++) {
+                    int c = coarse.index(i,j,k);
+                    if (coarse.type[c] != Fluid) {
+                        coarse.b[c] = 0;
+                        continue;
+                    }
+                    double sum = 0;
+                    for(int di=0; di<4; di++) {
+                        int fi = 2*i - 1 + di;
+                        if (fi < 0 || fi >= fine.dims[0]) continue;
+                        for(int dj=0; dj<4; dj++) {
+                            int fj = 2*j - 1 + dj;
+                            if (fj < 0 || fj >= fine.dims[1]) continue;
+                            for(int dk=0; dk<4; dk++) {
+                                int fk = 2*k - 1 + dk;
+                                if (fk < 0 || fk >= fine.dims[2]) continue;
+                                sum += weights[di]*weights[dj]*weights[dk]*fine.r[fine.index(fi,fj,fk)];
+                            }
+                        }
+                    }
+                    coarse.b[c] = sum/8;
+                }
+    });
+}
+
+void MultigridPoisson::prolongate(const Level& coarse, Level& fine) {
+    // every fine cell reads its parent with 3/4 and the next coarse cell on its side with 1/4 per axis
+    parallelFor(fine.dims[0], 1, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int j=0; j<fine.dims[1]; j++)
+                for(int k=0; k<fine.dims[2]; k++) {
+                    int f = fine.index(i,j,k);
+                    if (fine.type[f] != Fluid) continue;
+                    int parent[3] = {i/2, j/2, k/2};
+                    int side[3] = {i & 1 ? 1 : -1, j & 1 ? 1 : -1, k & 1 ? 1 : -1};
+                    double sum = 0;
+                    for(int di=0; di<2; di++) {
+                        int ci = parent[0] + di*side[0];
+                        if (ci < 0 || ci >= coarse.dims[0]) continue;
+                        for(int dj=0; dj<2; dj++) {
+                            int cj = parent[1] + dj*side[1];
+                            if (cj < 0 || cj >= coarse.dims[1]) continue;
+                            for(int dk=0; dk<2; dk++) {
+                                int ck = parent[2] + dk*side[2];
+                                if (ck < 0 || ck >= coarse.dims[2]) continue;
+                                double w = (di ? 0.25 : 0.75)*(dj ? 0.25 : 0.75)*(dk ? 0.25 : 0.75);
+                                sum += w*coarse.x[coarse.index(ci,cj,ck)];
+                            }
+                        }
+                    }
+                    fine.x[f] += sum;
+                }
+    });
+}
+
+void MultigridPoisson::vCycle(int l) {
+    Level& level = levels[l];
+    level.x.fill(0.0);
+
+    // coarsest level: many sweeps, forward then backward so the cycle stays symmetric
+    if (l == levels.size()-1) {
+        for(int it=0; it<coarseSmooth; it++) { smooth(level, 0); smooth(level, 1); }
+        for(int it=0; it<coarseSmooth; it++) { smooth(level, 1); smooth(level, 0); }
+        return;
+    }
+
+    for(int it=0; it<preSmooth; it++) { smooth(level, 0); smooth(level, 1); }
+
+    applyLaplacian(level, level.x, level.r);
+    parallelFor(level.numCells, 4096, [&](int begin, int end, int){
+        for(int c=begin; c<end; c++) level.r[c] = level.b[c] - level.r[c];
+    });
+    restrictResidual(level, levels[l+1]);
+    vCycle(l+1);
+    prolongate(levels[l+1], level);
+
+    for(int it=0; it<postSmooth; it++) { smooth(level, 1); smooth(level, 0); }
+}
+
+void MultigridPoisson::precondition(const QVector<double>& in, QVector<double>& out) {
+    Level& fine = levels[0];
+    if (preconditioner == Jacobi) {
+        parallelFor(fine.numCells, 4096, [&](int begin, int end, int){
+            for(int c=begin; c<end; c++) out[c] = fine.diagonal[c] > 0 ? in[c]/fine.diagonal[c] : 0;
+        });
+        return;
+    }
+    std::copy(in.begin(), in.end(), fine.b.begin());
+    vCycle(0);
+    std::copy(fine.x.begin(), fine.x.end(), out.begin());
+}
+
+double MultigridPoisson::dot(const QVector<double>& a, const QVector<double>& b) {
+    int n = levels[0].numCells;
+    parallelFor(numDotBlocks, 1, [&](int begin, int end, int){
+        for(int block=begin; block<end; block++) {
+            int c0 = int((long long)n*block/numDotBlocks);
+            int c1 = int((long long)n*(block+1)/numDotBlocks);
+            double sum = 0;
+            for(int c=c0; c<c1; c++) sum += a[c]*b[c];
+            dotBlocks[block] = sum;
+        }
+    });
+    double sum = 0;
+    for(int block=0; block<numDotBlocks; block++) sum += dotBlocks[block];
+    return sum;
+}
+
+int MultigridPoisson::solve(const QVector<double>& b, QVector<double>& x, double tolerance, int maxIterations) {
+    residual = 0;
+    if (levels.isEmpty()) return 0;
+    Level& fine = levels[0];
+    int n = fine.numCells;
+
+    double bNorm = std::sqrt(dot(b, b));
+    if (bNorm == 0) {
+        x.fill(0.0);
+        return 0;
+    }
+
+    applyLaplacian(fine, x, As);
+    parallelFor(n, 4096, [&](int begin, int end, int){
+        for(int c=begin; c<end; c++) r[c] = b[c] - As[c];
+    });
+    precondition(r, z);
+    std::copy(z.begin(), z.end(), s.begin());
+    double rz = dot(r, z);
+    residual = std::sqrt(dot(r, r))/bNorm;
+
+    int iterations = 0;
+    while (iterations < maxIterations && residual > tolerance) {
+        applyLaplacian(fine, s, As);
+        double sAs = dot(s, As);
+        if (sAs <= 0) break;
+        double alpha = rz/sAs;
+        parallelFor(n, 4096, [&](int begin, int end, int){
+            for(int c=begin; c<end; c++) {
+                x[c] += alpha*s[c];
+                r[c] -= alpha*As[c];
+            }
+        });
+        iterations++;
+        residual = std::sqrt(dot(r, r))/bNorm;
+        if (residual <= tolerance) break;
+
+        precondition(r, z);
+        double rzNext = dot(r, z);
+        double beta = rzNext/rz;
+        rz = rzNext;
+        parallelFor(n, 4096, [&](int begin, int end, int){
+            for(int c=begin; c<end; c++) s[c] = z[c] + beta*s[c];
+        });
+    }
+    return iterations;
+}
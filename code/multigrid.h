@@ -0,0 +1,84 @@
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+
+#include <QVector>
+#include "threadpool.h"
+
+/*
+ *  Conjugate gradient for the pressure Poisson equation of a MAC grid, preconditioned with one
+ *  geometric multigrid V-cycle. Fluid cells are the unknowns, air cells hold zero pressure and
+ *  the faces of the grid are solid walls. The 7-point Laplacian is matrix-free on every level:
+ *  a coarse cell is air if any of its 8 children is, transfers are cell-centered trilinear and
+ *  the smoother is red-black Gauss-Seidel, mirrored on the way up so the V-cycle is symmetric.
+ *  Every loop runs on the pool and gives the same result for any number of threads.
+ */
+class MultigridPoisson {
+public:
+    enum CellType {
+        Air   = 0,
+        Fluid = 1,
+    };
+
+    enum Preconditioner {
+        Jacobi    = 0,
+        Multigrid = 1,
+    };
+
+    MultigridPoisson() {}
+
+    void setPool(ThreadPool* p, ThreadPool::Schedule s) { pool = p; schedule = s; }
+    void setPreconditioner(Preconditioner p) { preconditioner = p; }
+
+    // dims[0]*dims[1]*dims[2] cells, z fastest, cellTypes holds a CellType per cell.
+    // Builds the coarse levels, call it every time the fluid cells change
+    void setup(const int dims[3], const QVector<char>& cellTypes);
+
+    // solves L x = b with L = 6-point degree minus neighbors, the negative Laplacian of unit
+    // spacing, x is the initial guess. Stops when
+    // |r| <= tolerance |b| or after maxIterations, returns the iterations run
+    int solve(const QVector<double>& b, QVector<double>& x, double tolerance, int maxIterations);
+
+    double getResidual() const { return residual; }
+    int getNumLevels() const { return levels.size(); }
+
+protected:
+    struct Level {
+        int dims[3];
+        int numCells;
+        double invH2;                // 1/h^2 in fine cells
+        QVector<char> type;
+        QVector<double> diagonal;    // neighbors inside the grid
+        QVector<double> x, b, r;
+
+        int index(int i, int j, int k) const { return (i*dims[1] + j)*dims[2] + k; }
+    };
+
+    void applyLaplacian(const Level& l, const QVector<double>& x, QVector<double>& result);
+    void smooth(Level& l, int color);
+    void restrictResidual(const Level& fine, Level& coarse);
+    void prolongate(const Level& coarse, Level& fine);
+    void vCycle(int level);
+    // z = M^-1 r with the chosen preconditioner
+    void precondition(const QVector<double>& in, QVector<double>& out);
+    // dot product summed per fixed block, the same whatever the number of threads
+    double dot(const QVector<double>& a, const QVector<double>& b);
+
+    template<class Fn>
+    void parallelFor(int n, int chunk, const Fn& fn);
+
+    ThreadPool* pool = nullptr;
+    ThreadPool::Schedule schedule = ThreadPool::Static;
+    Preconditioner preconditioner = Multigrid;
+
+    static const int preSmooth = 2, postSmooth = 2, coarseSmooth = 20;
+    QVector<Level> levels;
+
+    // conjugate gradient vectors on the finest level
+    QVector<double> r, z, s, As;
+    QVector<double> dotBlocks;
+    static const int numDotBlocks = 64;
+
+    double residual = 0;
+};
+
+#endif // MULTIGRID_H
@@ -0,0 +1,99 @@
+#ifndef NEIGHBORSEARCH_H
+#define NEIGHBORSEARCH_H
+
+#include <QVector>
+#include <cstdint>
+#include <atomic>
+#include "particle.h"
+#include "periodicdomain.h"
+
+class NeighborSearch  // Abstract interface
+{
+public:
+    NeighborSearch() {}
+    virtual ~NeighborSearch() {}
+
+    // bins the particles, call it every time they move
+    virtual void create(const QVector<Particle *>& parts) = 0;
+
+    // fills ids[0..size) with every particle binned in a cell overlapped by the sphere (pos, maxDist).
+    // Queries only read the bins, threads can run them at the same time with their own ids and size
+    virtual void query(const Vec3& pos, float maxDist, QVector<unsigned int>& ids, unsigned int& size) = 0;
+    void query(const Vec3& pos, float maxDist){ query(pos, maxDist, queryIds, querySize); }
+
+    // cell-wise traversal, only for backends where two different cells never share a bucket
+    virtual bool hasExactCells() const { return false; }
+    virtual unsigned int getNumCells() const { return 0; }
+
+    // fills ids with every particle that can be within maxDist of a point of cell c
+    virtual void queryCell(unsigned int, float, QVector<unsigned int>&, unsigned int& size) { size = 0; }
+    void queryCell(unsigned int c, float maxDist){ queryCell(c, maxDist, queryIds, querySize); }
+
+    // same as queryCell but only for the forward half of the neighbor cells, without cell c itself
+    virtual void queryCellHalf(unsigned int, float, QVector<unsigned int>&, unsigned int& size) { size = 0; }
+    void queryCellHalf(unsigned int c, float maxDist){ queryCellHalf(c, maxDist, queryIds, querySize); }
+
+    // calls fn(i, j) once for every unordered pair of particles in the same or in adjacent cells.
+    // Not for periodic domains, where the cells next to a seam can be reached from both sides
+    template<class PairFn>
+    void forEachPair(float maxDist, const PairFn& fn){
+        forEachPair(0, getNumCells(), maxDist, fn, queryIds, querySize);
+    }
+
+    // same, only for the pairs found from the cells [cBegin, cEnd)
+    template<class PairFn>
+    void forEachPair(unsigned int cBegin, unsigned int cEnd, float maxDist, const PairFn& fn,
+                     QVector<unsigned int>& ids, unsigned int& size){
+        for(unsigned int c=cBegin; c<cEnd; c++){
+            unsigned int start = cellStart[c];
+            unsigned int end = cellStart[c+1];
+            if(start == end) continue;
+
+            // pairs inside the cell
+            for(unsigned int a=start; a<end; a++)
+                for(unsigned int b=a+1; b<end; b++)
+                    fn(cellEntries[a], cellEntries[b]);
+
+            // pairs with the forward neighbor cells, the backward ones visit us
+            queryCellHalf(c, maxDist, ids, size);
+            for(unsigned int a=start; a<end; a++)
+                for(unsigned int b=0; b<size; b++)
+                    fn(cellEntries[a], ids[b]);
+        }
+    }
+
+    // cells wrap around along the periodic axes of the domain, call create afterwards. The
+    // queries return the particles, the caller picks their nearest images
+    virtual void setPeriodic(const PeriodicDomain& domain){
+        periodic = domain;
+        periodic.setSpacing(getSpacing());
+    }
+    const PeriodicDomain& getPeriodic() const { return periodic; }
+
+    // cell size and table size, NeighborTuner changes them between two calls to create
+    virtual double getSpacing() const = 0;
+    virtual void setSpacing(double s) = 0;
+    virtual unsigned int getTableSize() const { return 0; }
+    virtual unsigned int getTableFactor() const { return 0; }
+    virtual void setTableFactor(unsigned int) {} // buckets per object, ignored without a table
+
+    // candidates returned by the queries since the last resetQueryStats
+    void resetQueryStats(){ numQueries = 0; numCandidates = 0; }
+    double avgCandidates() const { return numQueries ? double(numCandidates)/numQueries : 0.0; }
+    void countQuery(unsigned int size){
+        numQueries.fetch_add(1, std::memory_order_relaxed);
+        numCandidates.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> numQueries{0}, numCandidates{0};
+
+    PeriodicDomain periodic;
+
+    unsigned int querySize = 0;
+    QVector<unsigned int> queryIds;
+
+    // particles binned in cell c are cellEntries[cellStart[c]] .. cellEntries[cellStart[c+1]-1]
+    QVector<unsigned int> cellStart, cellEntries;
+};
+
+#endif // NEIGHBORSEARCH_H
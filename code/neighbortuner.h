@@ -0,0 +1,171 @@
+#ifndef NEIGHBORTUNER_H
+#define NEIGHBORTUNER_H
+
+#include <QVector>
+#include <QString>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <cmath>
+#include "neighborsearch.h"
+
+/*
+ *  Picks the cell size and then the table size of a NeighborSearch for the current workload.
+ *  Each candidate runs for a few steps while the step time, the build time and the candidates
+ *  per query are measured, and the fastest one is kept. It starts over when the backend, the
+ *  query radius or the number of particles changes.
+ *
+ *  The parameters come from wall-clock timings, so two identical runs can end with different
+ *  cells and, with them, different neighbor orders and sums. Tuning is off by default and the
+ *  search keeps its parameters, switching it off puts back the ones it had before tuning.
+ */
+class NeighborTuner {
+public:
+    NeighborTuner(int stepsPerTrial_var = 4){
+        stepsPerTrial = stepsPerTrial_var;
+        candidateTables << 2 << 5 << 10;
+    }
+
+    void setEnabled(bool enabled_var){
+        if(enabled_var == enabled) return;
+        enabled = enabled_var;
+        if(!enabled && target){
+            target->setSpacing(untunedSpacing);
+            if(untunedTableFactor) target->setTableFactor(untunedTableFactor);
+            phase = Done;
+        }
+        // the next step measures the parameters the search has now
+        if(enabled) target = nullptr;
+    }
+    bool isEnabled() const { return enabled; }
+
+    // call before create; may change the parameters of ns when enabled
+    void beginStep(NeighborSearch* ns, double radius_var, unsigned int numObjects_var){
+        if(!enabled){
+            target = ns;
+        } else if(ns != target || std::abs(radius_var - radius) > 0.01*radius
+                || numObjects_var > 1.25*numObjects || numObjects_var < 0.8*numObjects){
+            restart(ns, radius_var, numObjects_var);
+        }
+        target->resetQueryStats();
+        timer.start();
+    }
+
+    // call right after create
+    void endBuild(){
+        buildMs = 1e-6 * double(timer.nsecsElapsed());
+    }
+
+    // call once the work that depends on the queries is done
+    void endStep(){
+        stepMs = 1e-6 * double(timer.nsecsElapsed());
+        avgCandidates = target->avgCandidates();
+        if(!tuning()) return;
+
+        // the first step of a trial pays for the reallocation, do not count it
+        if(trialStep > 0) trialMs += stepMs;
+        trialStep++;
+        if(trialStep < stepsPerTrial) return;
+
+        double ms = trialMs / (stepsPerTrial-1);
+        if(ms < bestMs){
+            bestMs = ms;
+            bestSpacing = target->getSpacing();
+            if(phase == Table) bestTableFactor = candidateTables[trial];
+        }
+        nextTrial();
+    }
+
+    bool tuning() const { return phase != Done; }
+
+    QStringList overlayLines() const {
+        QStringList lines;
+        if(!target) return lines;
+        QString state = !enabled ? " (fixed)" : tuning() ? " (tuning)" : " (tuned)";
+        lines << "Cell size: " + QString::number(target->getSpacing(), 'f', 2) + state;
+        if(target->getTableSize())
+            lines << "Table size: " + QString::number(target->getTableSize());
+        lines << "Cand/query: " + QString::number(avgCandidates, 'f', 1);
+        lines << "Build:     " + QString::number(buildMs, 'f', 2) + " ms";
+        return lines;
+    }
+
+    int stepsPerTrial;
+    double buildMs = 0, stepMs = 0, avgCandidates = 0;
+
+protected:
+    enum Phase { Spacing, Table, Done };
+
+    void restart(NeighborSearch* ns, double radius_var, unsigned int numObjects_var){
+        if(ns != target){
+            untunedSpacing = ns->getSpacing();
+            untunedTableFactor = ns->getTableFactor();
+        }
+        target = ns;
+        radius = radius_var;
+        numObjects = numObjects_var;
+        bestMs = 1e30;
+        bestSpacing = target->getSpacing();
+
+        // the current cell size is measured first, so tuning never ends worse than it. Cells
+        // smaller than the radius are only tried with exact cells, in Hash they share buckets
+        candidateSpacings.clear();
+        candidateSpacings.append(target->getSpacing());
+        double factors[] = {0.5, 0.75, 1.0, 1.5, 2.0};
+        for(double f : factors){
+            if(f < 1.0 && !target->hasExactCells()) continue;
+            if(std::abs(f*radius - target->getSpacing()) > 0.01*radius)
+                candidateSpacings.append(f*radius);
+        }
+
+        phase = Spacing;
+        trial = -1;
+        nextTrial();
+    }
+
+    void nextTrial(){
+        trial++;
+        trialStep = 0;
+        trialMs = 0;
+
+        if(phase == Spacing){
+            if(trial < candidateSpacings.size()){
+                target->setSpacing(candidateSpacings[trial]);
+                return;
+            }
+            target->setSpacing(bestSpacing);
+            if(target->getTableSize()){
+                // with the cell size fixed, try a few buckets per object
+                phase = Table;
+                bestMs = 1e30;
+                trial = -1;
+                nextTrial();
+                return;
+            }
+        } else if(phase == Table){
+            if(trial < candidateTables.size()){
+                target->setTableFactor(candidateTables[trial]);
+                return;
+            }
+            target->setTableFactor(bestTableFactor);
+        }
+        phase = Done;
+    }
+
+    NeighborSearch* target = nullptr;
+    bool enabled = false;
+    double radius = 0;
+    unsigned int numObjects = 0;
+
+    Phase phase = Done;
+    int trial = 0, trialStep = 0;
+    double trialMs = 0, bestMs = 0;
+    double bestSpacing = 0;
+    unsigned int bestTableFactor = 0;
+    double untunedSpacing = 0;
+    unsigned int untunedTableFactor = 0;
+    QVector<double> candidateSpacings;
+    QVector<unsigned int> candidateTables;
+    QElapsedTimer timer;
+};
+
+#endif // NEIGHBORTUNER_H
@@ -26,6 +26,7 @@ public:
     Vec3 color    = Vec3(1, 1, 1);
     unsigned int id = 0;
     bool lock = false;
+    bool asleep = false;   // settled, see SleepTracker
     int id_height,id_width;
 
     Particle() {
@@ -91,6 +92,7 @@ public:
         radius  = p.radius;
         life    = p.life;
         lock = p.lock;
+        asleep = p.asleep;
         type = p.type;
     }
 
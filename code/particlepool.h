@@ -0,0 +1,72 @@
+#ifndef PARTICLEPOOL_H
+#define PARTICLEPOOL_H
+
+#include <QVector>
+#include "particle.h"
+#include "forces.h"
+
+/*
+ *  Parked fluid particles, each with the SPH force that moves it, allocated on reset so that
+ *  emitting and draining during a run neither allocates nor rebuilds the force lists. The scene
+ *  registers the parked particles and their forces with the system once: parked particles are
+ *  locked, which the forces skip, and stay out of the particles of the system and the neighbor
+ *  search. Particles in use belong to the scene, the pool deletes the parked ones.
+ */
+class ParticlePool {
+public:
+    ParticlePool() {}
+    ~ParticlePool(){ clear(); }
+
+    void clear(){
+        for(Particle* p : particles) delete p;
+        for(ForceSPH* f : forces) delete f;
+        particles.clear();
+        forces.clear();
+    }
+
+    // parks numNew new particles, with room to park up to capacity without allocating
+    void allocate(int numNew, int capacity){
+        particles.reserve(capacity);
+        forces.reserve(capacity);
+        for(int i=0; i<numNew; i++){
+            Particle* p = new Particle();
+            ForceSPH* f = new ForceSPH();
+            f->addInfluencedParticle(p);
+            park(p, f);
+        }
+    }
+
+    int getNumParked() const { return particles.size(); }
+    bool empty() const { return particles.isEmpty(); }
+
+    // for registering them with the forces and the system
+    const QVector<Particle*>& getParticles() const { return particles; }
+    const QVector<ForceSPH*>& getForces() const { return forces; }
+
+    // the most recently parked particle, unlocked, and its force
+    Particle* take(ForceSPH*& force){
+        Particle* p = particles.back();
+        force = forces.back();
+        particles.pop_back();
+        forces.pop_back();
+        p->lock = false;
+        return p;
+    }
+
+    // f has to be the force influencing p
+    void park(Particle* p, ForceSPH* f){
+        p->lock = true;
+        p->asleep = false;
+        p->vel = Vec3(0,0,0);
+        p->force = Vec3(0,0,0);
+        f->setForce(Vec3(0,0,0));
+        particles.push_back(p);
+        forces.push_back(f);
+    }
+
+protected:
+    QVector<Particle*> particles;
+    QVector<ForceSPH*> forces;
+};
+
+#endif // PARTICLEPOOL_H
@@ -0,0 +1,111 @@
+#ifndef PERIODICDOMAIN_H
+#define PERIODICDOMAIN_H
+
+#include <cmath>
+#include <algorithm>
+#include "defines.h"
+
+/*
+ *  Box that repeats along some of its axes: a particle leaving through one side comes back
+ *  through the other, and two particles interact through the images closest to each other.
+ *  Positions are kept in [origin, origin + period) on the periodic axes. The neighbor
+ *  searches cut the period in a whole number of cells no smaller than their spacing, so the
+ *  cell indices wrap around exactly. Images are only unique while the period is longer than
+ *  twice the search radius plus one cell.
+ */
+class PeriodicDomain {
+public:
+    PeriodicDomain(){ clear(); }
+
+    void clear(){
+        for(int a=0; a<3; a++){
+            periodic[a] = false;
+            numCells[a] = 1;
+            cellSize[a] = 1;
+        }
+        origin = Vec3(0,0,0);
+        period = Vec3(1,1,1);
+    }
+
+    // repeats with the extent of the box along the axes flagged in axes
+    void set(const Vec3& bmin, const Vec3& bmax, const bool axes[3]){
+        origin = bmin;
+        period = bmax - bmin;
+        for(int a=0; a<3; a++) periodic[a] = axes[a] && period[a] > 0;
+        setSpacing(spacing);
+    }
+
+    // the box moved but kept its size
+    void setOrigin(const Vec3& bmin){ origin = bmin; }
+
+    bool any() const { return periodic[0] || periodic[1] || periodic[2]; }
+    bool isPeriodic(int axis) const { return periodic[axis]; }
+    const Vec3& getOrigin() const { return origin; }
+    const Vec3& getPeriod() const { return period; }
+
+    // displacement bringing x back into the box
+    Vec3 wrapShift(const Vec3& x) const {
+        Vec3 shift(0,0,0);
+        for(int a=0; a<3; a++)
+            if(periodic[a]) shift[a] = -period[a]*std::floor((x[a] - origin[a])/period[a]);
+        return shift;
+    }
+
+    // whole periods to take off the displacement d to get the shortest one
+    double imageShift(double d, int axis) const {
+        if(!periodic[axis] || std::abs(d) <= 0.5*period[axis]) return 0.0;
+        return period[axis]*std::floor(d/period[axis] + 0.5);
+    }
+
+    // shortest of the displacements between the images
+    double minimumImage(double d, int axis) const { return d - imageShift(d, axis); }
+    Vec3 minimumImage(const Vec3& d) const {
+        return Vec3(minimumImage(d.x(),0), minimumImage(d.y(),1), minimumImage(d.z(),2));
+    }
+
+    // image of x closest to ref, x itself when it already is, whatever ref
+    double nearestImage(double x, double ref, int axis) const { return x - imageShift(x - ref, axis); }
+    Vec3 nearestImage(const Vec3& x, const Vec3& ref) const {
+        return Vec3(nearestImage(x.x(),ref.x(),0), nearestImage(x.y(),ref.y(),1), nearestImage(x.z(),ref.z(),2));
+    }
+
+    // cells of the neighbor search along the periodic axes
+    void setSpacing(double spacing_var){
+        spacing = spacing_var;
+        for(int a=0; a<3; a++){
+            numCells[a] = periodic[a] ? std::max(1, int(period[a]/spacing)) : 1;
+            cellSize[a] = periodic[a] ? period[a]/numCells[a] : spacing;
+        }
+    }
+
+    int getNumCells(int axis) const { return numCells[axis]; }
+    double getCellSize(int axis) const { return cellSize[axis]; }
+
+    // cell of the coordinate before wrapping
+    int cellCoord(double coord, int axis) const {
+        return int(std::floor((coord - origin[axis])/cellSize[axis]));
+    }
+
+    int wrapCell(int c, int axis) const {
+        if(!periodic[axis]) return c;
+        c %= numCells[axis];
+        return c < 0 ? c + numCells[axis] : c;
+    }
+
+    // a range of cells before wrapping, shortened to one period so no cell is visited twice
+    void clampRange(int& c0, int& c1, int axis) const {
+        if(periodic[axis] && c1 - c0 + 1 >= numCells[axis]){
+            c0 = 0;
+            c1 = numCells[axis] - 1;
+        }
+    }
+
+protected:
+    bool periodic[3];
+    Vec3 origin, period;
+    double spacing = 1;
+    int numCells[3];
+    double cellSize[3];
+};
+
+#endif // PERIODICDOMAIN_H
@@ -3,6 +3,7 @@
 
 #include <QWidget>
 #include <QMouseEvent>
+#include <QStringList>
 #include "camera.h"
 
 class Scene : public QObject
@@ -26,6 +27,9 @@ public:
     virtual void getSceneBounds(Vec3& bmin, Vec3& bmax) = 0;
     virtual unsigned int getNumParticles() { return 0; }
 
+    // scene specific lines for the text overlay
+    virtual QStringList getOverlayLines() { return QStringList(); }
+
     virtual QWidget* sceneUI() = 0;
 
     double timeStep, bouncing, friction;
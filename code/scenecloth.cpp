@@ -377,9 +377,13 @@ void SceneCloth::update() {
     double dt = timeStep;
     float maxVelocity = 0.2 * cloth->thickness / dt;
 
-    hash->create(system.getParticles());
     float maxTravelDist = maxVelocity * dt;
+    neighborTuner.setEnabled(widget->getTuneNeighborSearch());
+    neighborTuner.beginStep(hash,maxTravelDist,system.getParticles().size());
+    hash->create(system.getParticles());
+    neighborTuner.endBuild();
     hash->queryAll(system.getParticles(),maxTravelDist);
+    neighborTuner.endStep();
 
     int n_substeps=10;
     for(int i_substeps=0;i_substeps<n_substeps;i_substeps++){
@@ -11,6 +11,7 @@
 #include "integrators.h"
 #include "colliders.h"
 #include "hash.h"
+#include "neighbortuner.h"
 #include "cloth.h"
 
 class SceneCloth : public Scene
@@ -35,6 +36,7 @@ public:
         bmax = Vec3( 50, 100, 50);
     }
     virtual unsigned int getNumParticles() { return system.getNumParticles(); }
+    virtual QStringList getOverlayLines() { return neighborTuner.overlayLines(); }
 
     virtual QWidget* sceneUI() { return widget; }
 
@@ -69,6 +71,7 @@ protected:
     int mouseX, mouseY;
 
     Hash *hash;
+    NeighborTuner neighborTuner;
     Cloth* cloth;
 
 
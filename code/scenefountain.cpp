@@ -68,8 +68,8 @@ void SceneFountain::initialize(double dt, double bo, double fr, unsigned int dra
     colliderSphere.setSphere(Vec3(20, 0, 20), 20);
     colliderAABB.setAABB(Vec3(0, 0, 0),Vec3(15, 15, 30));
 
-    // create spatial hashing
-    hash = new Hash(2.0,2000);
+    // create spatial hashing, it grows with the number of emitted particles
+    hash = new CellHash(2.0,2000);
 
 }
 
@@ -252,7 +252,6 @@ void SceneFountain::update() {
 
     // collisions
     for (Particle* pi : system.getParticles()) {
-        float particleMinDist = 2.0 * pi->radius;
         // Floor collider
         if (colliderFloor.testCollision(pi)) {
             colliderFloor.resolveCollision(pi, bouncing, friction, dt);
@@ -265,32 +264,33 @@ void SceneFountain::update() {
         if (colliderAABB.testCollision(pi)) {
             colliderAABB.resolveCollision(pi, bouncing, friction, dt);
         }
-        // Spatial Hashing collider
-        hash->query(system.getParticles(),pi->id,2.0 * pi->radius);
+    }
 
-        for(unsigned int nr=0; nr<hash->querySize;nr++){
-            Particle *pj = system.getParticles()[hash->queryIds[nr]];
-            Vecd normal = pi->pos - pj->pos;
-            double d = (normal).norm();
-            double d2 = d*d;
+    // Spatial Hashing collider: each pair is resolved once, moving both particles
+    hash->forEachPair(2.0, [&](unsigned int i, unsigned int j){
+        Particle *pi = system.getParticles()[i];
+        Particle *pj = system.getParticles()[j];
+        float particleMinDist = pi->radius + pj->radius;
+        Vecd normal = pi->pos - pj->pos;
+        double d = (normal).norm();
+        double d2 = d*d;
 
-            if(d2 > 0.f && d2 < particleMinDist*particleMinDist) {
-                normal = normal/d;
+        if(d2 > 0.f && d2 < particleMinDist*particleMinDist) {
+            normal = normal/d;
 
-                double corr = (particleMinDist - d) * 0.5;
+            double corr = (particleMinDist - d) * 0.5;
 
-                pi->pos += normal*corr;
-                pj->pos -= normal*corr;
+            pi->pos += normal*corr;
+            pj->pos -= normal*corr;
 
-                double vi = pi->vel.dot(normal);
-                double vj = pj->vel.dot(normal);
+            double vi = pi->vel.dot(normal);
+            double vj = pj->vel.dot(normal);
 
-                pi->vel += normal*(vj-vi);
-                pj->vel += normal*(vi-vj);
+            pi->vel += normal*(vj-vi);
+            pj->vel += normal*(vi-vj);
 
-            }
         }
-    }
+    });
 
     // check dead particles
     for (Particle* p : system.getParticles()) {
@@ -9,7 +9,7 @@
 #include "particlesystem.h"
 #include "integrators.h"
 #include "colliders.h"
-#include "hash.h"
+#include "cellhash.h"
 
 class SceneFountain : public Scene
 {
@@ -62,7 +62,7 @@ protected:
     Vec3 fountainPos;
     int mouseX, mouseY;
 
-    Hash *hash;
+    CellHash *hash;
 };
 
 #endif // SCENEFOUNTAIN_H
@@ -526,9 +526,13 @@ void SceneOP::update() {
         p->prevPos = p->pos - timeStep*p->vel;
     }
 
-    hash->create(cloth->particles);
     float maxTravelDist = maxVelocity * dt;
+    neighborTuner.setEnabled(widget->getTuneNeighborSearch());
+    neighborTuner.beginStep(hash,maxTravelDist,cloth->particles.size());
+    hash->create(cloth->particles);
+    neighborTuner.endBuild();
     hash->queryAll(cloth->particles,maxTravelDist);
+    neighborTuner.endStep();
 
     int n_substeps=10;
     for(int i_substeps=0;i_substeps<n_substeps;i_substeps++){
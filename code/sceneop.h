@@ -13,6 +13,7 @@
 #include "integrators.h"
 #include "colliders.h"
 #include "hash.h"
+#include "neighbortuner.h"
 #include "sail.h"
 
 class SceneOP : public Scene
@@ -39,6 +40,7 @@ public:
         bmax = Vec3( 50, 100, 50);
     }
     virtual unsigned int getNumParticles() { return system.getNumParticles(); }
+    virtual QStringList getOverlayLines() { return neighborTuner.overlayLines(); }
 
     virtual QWidget* sceneUI() { return widget; }
 
@@ -79,6 +81,7 @@ protected:
     int mouseX, mouseY;
 
     Hash *hash;
+    NeighborTuner neighborTuner;
     Sail *cloth;
 
 
@@ -82,6 +82,8 @@ void SceneSnowball::initialize(double dt, double bo, double fr, unsigned int dra
     // create spatial hashing
     //hash = new Hash(2.0,1000);
 
+    sleepTracker.reset(system.getParticles(), 0);
+
 }
 
 
@@ -131,6 +133,8 @@ void SceneSnowball::reset(double dt, double bo, double fr, unsigned int dragt)
     }
 
     //hash->create(system.getParticles());
+
+    sleepTracker.reset(system.getParticles(), 0);
 }
 
 
@@ -146,6 +150,15 @@ void SceneSnowball::updateSimParams()
     kFriction = 0.1;
     maxParticleLife = 10.0;
     emitRate = 100;
+
+    wakeEverything = true;
+}
+
+
+QStringList SceneSnowball::getOverlayLines() {
+    QStringList lines;
+    if(widget->getSleeping()) lines << sleepTracker.overlayLine();
+    return lines;
 }
 
 
@@ -232,6 +245,13 @@ void SceneSnowball::update() {
 
     //hash->create(system.getParticles());
 
+    // the particles do not interact, so only moving the sphere or the blackhole wakes them
+    bool sleeping = widget->getSleeping();
+    if (!sleeping || wakeEverything) {
+        if (sleepTracker.getNumAsleep()) sleepTracker.wakeAll(system.getParticles());
+        wakeEverything = false;
+    }
+
     // integration step
     Vecd ppos = system.getPositions();
     integrator.step(system, dt);
@@ -239,6 +259,7 @@ void SceneSnowball::update() {
 
     // collisions
     for (Particle* pi : system.getParticles()) {
+        if (pi->asleep) continue;
         float particleMinDist = 2.0 * pi->radius;
         // Sphere collider
         if (colliderSnowball.testCollision(pi)) {
@@ -270,6 +291,17 @@ void SceneSnowball::update() {
             }
         }*/
     }
+
+    // resting on the sphere they bounce back at up to three steps of gravity, a flying
+    // particle is never below four for ten steps in a row
+    if (sleeping) {
+        sleepTracker.setThresholds(4*widget->getGravity()*dt, 0, 10);
+        for (int i = 0; i < system.getNumParticles(); i++) {
+            Particle* pi = system.getParticles()[i];
+            if (!pi->asleep) sleepTracker.update(pi, i, 0);
+        }
+        sleepTracker.count(system.getParticles());
+    }
 }
 
 void SceneSnowball::mousePressed(const QMouseEvent* e, const Camera&)
@@ -302,9 +334,11 @@ void SceneSnowball::mouseMoved(const QMouseEvent* e, const Camera& cam)
                 pi->pos += disp;
                 pi->vel += disp;
             }
+            wakeEverything = true;
             break;
         case 1:
             fBlackhole->position += disp;
+            wakeEverything = true;
             break;
         }
     }
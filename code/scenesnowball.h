@@ -10,6 +10,7 @@
 #include "integrators.h"
 #include "colliders.h"
 #include "hash.h"
+#include "sleeptracker.h"
 
 class SceneSnowball : public Scene
 {
@@ -32,6 +33,7 @@ public:
         bmax = Vec3( 50, 100, 50);
     }
     virtual unsigned int getNumParticles() { return system.getNumParticles(); }
+    virtual QStringList getOverlayLines();
 
     virtual QWidget* sceneUI() { return widget; }
 
@@ -52,6 +54,10 @@ protected:
     ForceBlackhole* fBlackhole;
     ColliderSnowball colliderSnowball;
 
+    // snow resting on the sphere sleeps until the sphere or the blackhole moves
+    SleepTracker sleepTracker;
+    bool wakeEverything = true;
+
     double kBounce, kFriction;
     double emitRate;
     double maxParticleLife;
@@ -2,11 +2,18 @@
 #include "glutils.h"
 #include "model.h"
 #include <QOpenGLFunctions_3_3_Core>
+#include <QElapsedTimer>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <iostream>
 
 
 SceneSPHWaterCube::SceneSPHWaterCube() {
     widget = new WidgetSPHWaterCube();
     connect(widget, SIGNAL(updatedParameters()), this, SLOT(updateSimParams()));
+    connect(widget, SIGNAL(exportedConvergenceLog(QString)), this, SLOT(exportConvergenceLog(QString)));
+    connect(widget, SIGNAL(exportedSurfaceMesh(QString)), this, SLOT(exportSurfaceMesh(QString)));
 }
 
 
@@ -16,8 +23,16 @@ SceneSPHWaterCube::~SceneSPHWaterCube() {
     if (vaoFloor)   delete vaoFloor;
     if (vaoSphereS) delete vaoSphereS;
     if (vaoSphereBigS) delete vaoSphereBigS;
+    if (vaoMesh)    delete vaoMesh;
+    if (vboMesh)    delete vboMesh;
+    if (nboMesh)    delete nboMesh;
+    if (iboMesh)    delete iboMesh;
     if (fGravity)   delete fGravity;
     if (fBlackhole) delete fBlackhole;
+    if (hash)       delete hash;
+    if (grid)       delete grid;
+    if (cellHash)   delete cellHash;
+    if (boundaryGrid) delete boundaryGrid;
     if (fSPHSystem.size()) fSPHSystem.clear();
 }
 
@@ -29,6 +44,7 @@ void SceneSPHWaterCube::initialize(double dt, double bo, double fr, unsigned int
     friction = fr;
     dragType = dragt;
     double p0 = widget->getRestDensity();
+    boundaryHandling = widget->getBoundaryHandling();
 
     // load shader
     shader = glutils::loadShaderProgram(":/shaders/phong.vert", ":/shaders/phong.frag");
@@ -56,6 +72,29 @@ void SceneSPHWaterCube::initialize(double dt, double bo, double fr, unsigned int
     numFacesCube = cube.numFaces();
     glutils::checkGLError();
 
+    // create surface mesh VAO, its buffers are filled again for every new mesh
+    vaoMesh = new QOpenGLVertexArrayObject();
+    vaoMesh->create();
+    vaoMesh->bind();
+    vboMesh = new QOpenGLBuffer(QOpenGLBuffer::Type::VertexBuffer);
+    vboMesh->create();
+    vboMesh->bind();
+    vboMesh->setUsagePattern(QOpenGLBuffer::UsagePattern::DynamicDraw);
+    shader->setAttributeBuffer("vertex", GL_FLOAT, 0, 3, 0);
+    shader->enableAttributeArray("vertex");
+    nboMesh = new QOpenGLBuffer(QOpenGLBuffer::Type::VertexBuffer);
+    nboMesh->create();
+    nboMesh->bind();
+    nboMesh->setUsagePattern(QOpenGLBuffer::UsagePattern::DynamicDraw);
+    shader->setAttributeBuffer("normal", GL_FLOAT, 0, 3, 0);
+    shader->enableAttributeArray("normal");
+    iboMesh = new QOpenGLBuffer(QOpenGLBuffer::Type::IndexBuffer);
+    iboMesh->create();
+    iboMesh->bind();
+    iboMesh->setUsagePattern(QOpenGLBuffer::UsagePattern::DynamicDraw);
+    vaoMesh->release();
+    glutils::checkGLError();
+
     // create gravity force
     fGravity = new ForceConstAcceleration();
     system.addForce(fGravity);
@@ -139,128 +178,144 @@ void SceneSPHWaterCube::initialize(double dt, double bo, double fr, unsigned int
                 }
             }
 
-    // create boundary particles
-    for(int i=0;i<=boundarySize.y();i++)
-        for(int k=0;k<=boundarySize.z();k++){
-            //plane -x
-            Vec3 npos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        0.f,
-                        i*2,
-                        k*2
-                        );
-            Particle *np =new Particle(npos);
-            np->color = Vec3(1.f, 1.f, 1.f);
-            np->mass = 0.01;
-            np->type = ParticleType::Boundary;
-            np->density = p0;
-            boundaryParticles.push_back(np);
-            system.addParticle(np);
-            //plane +x
-            Vec3 ppos=Vec3(
-                        colliderCube.pos.x()+colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        0.f,
-                        i*2,
-                        k*2
-                        );
-            Particle *pp =new Particle(ppos);
-            pp->color = Vec3(1.f, 1.f, 1.f);
-            pp->mass = 0.01;
-            pp->type = ParticleType::Boundary;
-            pp->density = p0;
-            boundaryParticles.push_back(pp);
-            system.addParticle(pp);
-        }
-    for(int j=0;j<=boundarySize.x();j++)
-        for(int k=1;k<boundarySize.z();k++){
-            //plane -y
-            Vec3 npos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        0.f,
-                        k*2
-                        );
-            Particle *np =new Particle(npos);
-            np->color = Vec3(1.f, 1.f, 1.f);
-            np->mass = 0.01;
-            np->type = ParticleType::Boundary;
-            np->density = p0;
-            boundaryParticles.push_back(np);
-            system.addParticle(np);
-            //plane +y
-            Vec3 ppos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()+colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        0.f,
-                        k*2
-                        );
-            Particle *pp =new Particle(ppos);
-            pp->color = Vec3(1.f, 1.f, 1.f);
-            pp->mass = 0.01;
-            pp->type = ParticleType::Boundary;
-            pp->density = p0;
-            boundaryParticles.push_back(pp);
-            system.addParticle(pp);
-        }
-    for(int i=1;i<boundarySize.y();i++)
-        for(int j=1;j<boundarySize.x();j++){
-            //plane -z
-            Vec3 npos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        i*2,
-                        0.f
-                        );
-            Particle *np =new Particle(npos);
-            np->color = Vec3(1.f, 1.f, 1.f);
-            np->mass = 0.01;
-            np->type = ParticleType::Boundary;
-            np->density = p0;
-            boundaryParticles.push_back(np);
-            system.addParticle(np);
-            //plane +z
-            Vec3 ppos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()+colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        i*2,
-                        0.f
-                        );
-            Particle *pp =new Particle(ppos);
-            pp->color = Vec3(1.f, 1.f, 1.f);
-            pp->mass = 0.01;
-            pp->type = ParticleType::Boundary;
-            pp->density = p0;
-            boundaryParticles.push_back(pp);
-            system.addParticle(pp);
-        }
-
+    // create boundary particles, the signed distance walls need none
+    if(boundaryHandling == BoundaryHandling::BoundaryParticles){
+        for(int i=0;i<=boundarySize.y();i++)
+            for(int k=0;k<=boundarySize.z();k++){
+                //plane -x
+                Vec3 npos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()-colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            0.f,
+                            i*2,
+                            k*2
+                            );
+                Particle *np =new Particle(npos);
+                np->color = Vec3(1.f, 1.f, 1.f);
+                np->mass = 0.01;
+                np->type = ParticleType::Boundary;
+                np->density = p0;
+                boundaryParticles.push_back(np);
+                system.addParticle(np);
+                //plane +x
+                Vec3 ppos=Vec3(
+                            colliderCube.pos.x()+colliderCube.scale.x(),
+                            colliderCube.pos.y()-colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            0.f,
+                            i*2,
+                            k*2
+                            );
+                Particle *pp =new Particle(ppos);
+                pp->color = Vec3(1.f, 1.f, 1.f);
+                pp->mass = 0.01;
+                pp->type = ParticleType::Boundary;
+                pp->density = p0;
+                boundaryParticles.push_back(pp);
+                system.addParticle(pp);
+            }
+        for(int j=0;j<=boundarySize.x();j++)
+            for(int k=1;k<boundarySize.z();k++){
+                //plane -y
+                Vec3 npos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()-colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            j*2,
+                            0.f,
+                            k*2
+                            );
+                Particle *np =new Particle(npos);
+                np->color = Vec3(1.f, 1.f, 1.f);
+                np->mass = 0.01;
+                np->type = ParticleType::Boundary;
+                np->density = p0;
+                boundaryParticles.push_back(np);
+                system.addParticle(np);
+                //plane +y
+                Vec3 ppos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()+colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            j*2,
+                            0.f,
+                            k*2
+                            );
+                Particle *pp =new Particle(ppos);
+                pp->color = Vec3(1.f, 1.f, 1.f);
+                pp->mass = 0.01;
+                pp->type = ParticleType::Boundary;
+                pp->density = p0;
+                boundaryParticles.push_back(pp);
+                system.addParticle(pp);
+            }
+        for(int i=1;i<boundarySize.y();i++)
+            for(int j=1;j<boundarySize.x();j++){
+                //plane -z
+                Vec3 npos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()-colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            j*2,
+                            i*2,
+                            0.f
+                            );
+                Particle *np =new Particle(npos);
+                np->color = Vec3(1.f, 1.f, 1.f);
+                np->mass = 0.01;
+                np->type = ParticleType::Boundary;
+                np->density = p0;
+                boundaryParticles.push_back(np);
+                system.addParticle(np);
+                //plane +z
+                Vec3 ppos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()-colliderCube.scale.y(),
+                            colliderCube.pos.z()+colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            j*2,
+                            i*2,
+                            0.f
+                            );
+                Particle *pp =new Particle(ppos);
+                pp->color = Vec3(1.f, 1.f, 1.f);
+                pp->mass = 0.01;
+                pp->type = ParticleType::Boundary;
+                pp->density = p0;
+                boundaryParticles.push_back(pp);
+                system.addParticle(pp);
+            }
+    }
 
-    // create spatial hashing
-    hash = new Hash(2.f,system.getNumParticles());
+    // the neighbor structures hold the fluid, the boundary has a grid of its own
+    fluidParticles = poolParticles;
+    fluidParticles.append(dropParticles);
+    boundaryMoved = true;
+    setupSDFBoundary();
+    sleepTracker.reset(fluidParticles,p0);
+    adaptive.setBase(0.01,fluidParticles.isEmpty() ? 1.0 : fluidParticles[0]->radius,2*water_radius);
+    smoothingLengths.clear();
+    variableH = false;
+    stepsSinceRefine = 0;
+
+    // create spatial hashing, and a dense grid covering the container for the bounded case, both
+    // with room for the reserve of the tap
+    int capacity = system.getNumParticles() + poolReserve;
+    hash = new Hash(2.f,capacity);
+    grid = new Grid(2.f,colliderCube.pos-colliderCube.scale,colliderCube.pos+colliderCube.scale,capacity);
+    cellHash = new CellHash(2.f,capacity);
 
 }
 
@@ -272,11 +327,32 @@ void SceneSPHWaterCube::reset(double dt, double bo, double fr, unsigned int drag
     friction = fr;
     dragType = dragt;
     double p0 = widget->getRestDensity();
+    boundaryHandling = widget->getBoundaryHandling();
 
     colliderFloor.setPlane(Vec3(0, 1, 0), 50);
     colliderSphere.setSphere(Vec3(60, 60, 0), 15);
     colliderCube.setAABB(Vec3(0, 5, 0),boundarySize);
 
+    // periodic along x and z over the container, without its side walls. The grid of FLIP and
+    // APIC has walls on every side
+    periodicDomain.clear();
+    bool hybridMethod = widget->getSPHMethod() == SPHMethod::FLIP || widget->getSPHMethod() == SPHMethod::APIC;
+    if(widget->getPeriodic() && !hybridMethod){
+        const bool axes[3] = {true, false, true};
+        periodicDomain.set(colliderCube.pos-colliderCube.scale,colliderCube.pos+colliderCube.scale,axes);
+    }
+
+    // the warm start values and the mesh being built belong to the previous particles
+    surface.takeMesh(surfaceMesh);
+    surfaceMesh = Model();
+    surfaceMeshChanged = true;
+    surface.setSpacing(2*water_radius);
+    dfsphKappa.clear();
+    dfsphKappaV.clear();
+    iwcsphPressure.clear();
+    iisphPressure.clear();
+    convergenceLog.clear();
+
     // update values from UI
     updateSimParams();
 
@@ -298,10 +374,12 @@ void SceneSPHWaterCube::reset(double dt, double bo, double fr, unsigned int drag
     dropParticles.clear();
     boundaryParticles.clear();
 
-    // create pool particles
+    // create pool particles, up to the seam on the periodic axes so it sees the lattice spacing
+    unsigned int jPool = periodicDomain.isPeriodic(0) ? 0 : 1;
+    unsigned int kPool = periodicDomain.isPeriodic(2) ? 0 : 1;
     for(unsigned int i=1;i<poolSize.y();i++)
-        for(unsigned int k=1;k<poolSize.z();k++)
-            for(unsigned int j=1;j<poolSize.x();j++){
+        for(unsigned int k=kPool;k<poolSize.z();k++)
+            for(unsigned int j=jPool;j<poolSize.x();j++){
                 Vec3 pos=Vec3(
                             colliderCube.pos.x()-colliderCube.scale.x(),
                             colliderCube.pos.y()-colliderCube.scale.y(),
@@ -365,126 +443,171 @@ void SceneSPHWaterCube::reset(double dt, double bo, double fr, unsigned int drag
                 }
             }
 
-    // create boundary particles
-    for(int i=0;i<=boundarySize.y();i++)
-        for(int k=0;k<=boundarySize.z();k++){
-            //plane -x
-            Vec3 npos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        0.f,
-                        i*2,
-                        k*2
-                        );
-            Particle *np =new Particle(npos);
-            np->color = Vec3(1.f, 1.f, 1.f);
-            np->mass = 0.01;
-            np->type = ParticleType::Boundary;
-            np->density = p0;
-            boundaryParticles.push_back(np);
-            system.addParticle(np);
-            //plane +x
-            Vec3 ppos=Vec3(
-                        colliderCube.pos.x()+colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        0.f,
-                        i*2,
-                        k*2
-                        );
-            Particle *pp =new Particle(ppos);
-            pp->color = Vec3(1.f, 1.f, 1.f);
-            pp->mass = 0.01;
-            pp->type = ParticleType::Boundary;
-            pp->density = p0;
-            boundaryParticles.push_back(pp);
-            system.addParticle(pp);
-        }
-    for(int j=0;j<=boundarySize.x();j++)
-        for(int k=1;k<boundarySize.z();k++){
-            //plane -y
-            Vec3 npos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        0.f,
-                        k*2
-                        );
-            Particle *np =new Particle(npos);
-            np->color = Vec3(1.f, 1.f, 1.f);
-            np->mass = 0.01;
-            np->type = ParticleType::Boundary;
-            np->density = p0;
-            boundaryParticles.push_back(np);
-            system.addParticle(np);
-            //plane +y
-            Vec3 ppos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()+colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        0.f,
-                        k*2
-                        );
-            Particle *pp =new Particle(ppos);
-            pp->color = Vec3(1.f, 1.f, 1.f);
-            pp->mass = 0.01;
-            pp->type = ParticleType::Boundary;
-            pp->density = p0;
-            boundaryParticles.push_back(pp);
-            system.addParticle(pp);
+    // create boundary particles, the signed distance walls need none
+    if(boundaryHandling == BoundaryHandling::BoundaryParticles){
+        // periodic: no side walls, and the floor and the lid stop one spacing short of the far
+        // sides, which are images of the near ones
+        bool periodic = periodicDomain.any();
+        int jEnd = int(boundarySize.x()) - (periodic ? 1 : 0);
+        int kBegin = periodic ? 0 : 1;
+        if(!periodic){
+            for(int i=0;i<=boundarySize.y();i++)
+                for(int k=0;k<=boundarySize.z();k++){
+                    //plane -x
+                    Vec3 npos=Vec3(
+                                colliderCube.pos.x()-colliderCube.scale.x(),
+                                colliderCube.pos.y()-colliderCube.scale.y(),
+                                colliderCube.pos.z()-colliderCube.scale.z()
+                                ) +
+                            Vec3(
+                                0.f,
+                                i*2,
+                                k*2
+                                );
+                    Particle *np =new Particle(npos);
+                    np->color = Vec3(1.f, 1.f, 1.f);
+                    np->mass = 0.01;
+                    np->type = ParticleType::Boundary;
+                    np->density = p0;
+                    boundaryParticles.push_back(np);
+                    system.addParticle(np);
+                    //plane +x
+                    Vec3 ppos=Vec3(
+                                colliderCube.pos.x()+colliderCube.scale.x(),
+                                colliderCube.pos.y()-colliderCube.scale.y(),
+                                colliderCube.pos.z()-colliderCube.scale.z()
+                                ) +
+                            Vec3(
+                                0.f,
+                                i*2,
+                                k*2
+                                );
+                    Particle *pp =new Particle(ppos);
+                    pp->color = Vec3(1.f, 1.f, 1.f);
+                    pp->mass = 0.01;
+                    pp->type = ParticleType::Boundary;
+                    pp->density = p0;
+                    boundaryParticles.push_back(pp);
+                    system.addParticle(pp);
+                }
         }
-    for(int i=1;i<boundarySize.y();i++)
-        for(int j=1;j<boundarySize.x();j++){
-            //plane -z
-            Vec3 npos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()-colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        i*2,
-                        0.f
-                        );
-            Particle *np =new Particle(npos);
-            np->color = Vec3(1.f, 1.f, 1.f);
-            np->mass = 0.01;
-            np->type = ParticleType::Boundary;
-            np->density = p0;
-            boundaryParticles.push_back(np);
-            system.addParticle(np);
-            //plane +z
-            Vec3 ppos=Vec3(
-                        colliderCube.pos.x()-colliderCube.scale.x(),
-                        colliderCube.pos.y()-colliderCube.scale.y(),
-                        colliderCube.pos.z()+colliderCube.scale.z()
-                        ) +
-                    Vec3(
-                        j*2,
-                        i*2,
-                        0.f
-                        );
-            Particle *pp =new Particle(ppos);
-            pp->color = Vec3(1.f, 1.f, 1.f);
-            pp->mass = 0.01;
-            pp->type = ParticleType::Boundary;
-            pp->density = p0;
-            boundaryParticles.push_back(pp);
-            system.addParticle(pp);
+        for(int j=0;j<=jEnd;j++)
+            for(int k=kBegin;k<boundarySize.z();k++){
+                //plane -y
+                Vec3 npos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()-colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            j*2,
+                            0.f,
+                            k*2
+                            );
+                Particle *np =new Particle(npos);
+                np->color = Vec3(1.f, 1.f, 1.f);
+                np->mass = 0.01;
+                np->type = ParticleType::Boundary;
+                np->density = p0;
+                boundaryParticles.push_back(np);
+                system.addParticle(np);
+                //plane +y
+                Vec3 ppos=Vec3(
+                            colliderCube.pos.x()-colliderCube.scale.x(),
+                            colliderCube.pos.y()+colliderCube.scale.y(),
+                            colliderCube.pos.z()-colliderCube.scale.z()
+                            ) +
+                        Vec3(
+                            j*2,
+                            0.f,
+                            k*2
+                            );
+                Particle *pp =new Particle(ppos);
+                pp->color = Vec3(1.f, 1.f, 1.f);
+                pp->mass = 0.01;
+                pp->type = ParticleType::Boundary;
+                pp->density = p0;
+                boundaryParticles.push_back(pp);
+                system.addParticle(pp);
+            }
+        if(!periodic){
+            for(int i=1;i<boundarySize.y();i++)
+                for(int j=1;j<boundarySize.x();j++){
+                    //plane -z
+                    Vec3 npos=Vec3(
+                                colliderCube.pos.x()-colliderCube.scale.x(),
+                                colliderCube.pos.y()-colliderCube.scale.y(),
+                                colliderCube.pos.z()-colliderCube.scale.z()
+                                ) +
+                            Vec3(
+                                j*2,
+                                i*2,
+                                0.f
+                                );
+                    Particle *np =new Particle(npos);
+                    np->color = Vec3(1.f, 1.f, 1.f);
+                    np->mass = 0.01;
+                    np->type = ParticleType::Boundary;
+                    np->density = p0;
+                    boundaryParticles.push_back(np);
+                    system.addParticle(np);
+                    //plane +z
+                    Vec3 ppos=Vec3(
+                                colliderCube.pos.x()-colliderCube.scale.x(),
+                                colliderCube.pos.y()-colliderCube.scale.y(),
+                                colliderCube.pos.z()+colliderCube.scale.z()
+                                ) +
+                            Vec3(
+                                j*2,
+                                i*2,
+                                0.f
+                                );
+                    Particle *pp =new Particle(ppos);
+                    pp->color = Vec3(1.f, 1.f, 1.f);
+                    pp->mass = 0.01;
+                    pp->type = ParticleType::Boundary;
+                    pp->density = p0;
+                    boundaryParticles.push_back(pp);
+                    system.addParticle(pp);
+                }
         }
+    }
 
-    hash->create(system.getParticles());
+    fluidParticles = poolParticles;
+    fluidParticles.append(dropParticles);
+    boundaryMoved = true;
+    boundaryPsi.clear();
+
+    // the reserve of the tap, parked until emitted. Everything indexed by fluid particle can grow
+    // up to the capacity without reallocating, and shrinks without releasing memory
+    int capacity = fluidParticles.size() + poolReserve;
+    particlePool.clear();
+    particlePool.allocate(poolReserve,capacity);
+    for(QVector<Particle*>* group : {&poolParticles, &dropParticles, &fluidParticles}) group->reserve(capacity);
+    fSPHSystem.reserve(capacity);
+    system.getParticles().reserve(capacity + boundaryParticles.size());
+    for(QVector<Vec3>* values : {&accelerations, &predictedPositions, &nonPressureAccelerations, &pressureAccelerations})
+        values->reserve(capacity + boundaryParticles.size());
+    for(QVector<double>* values : {&densities, &densityErrors, &densityChanges, &dfsphAlpha, &dfsphKappa, &dfsphKappaV, &dfsphStep, &iisphDiagonal, &iisphPressure, &pbfLambda, &iwcsphPressure})
+        values->reserve(capacity + boundaryParticles.size());
+    tap.setDisk(colliderCube.pos,Vec3(1,0,0),3*water_radius,2*water_radius);
+    tap.reset();
+    numEmitted = 0;
+    numDrained = 0;
+    setupSDFBoundary();
+    sleepTracker.reset(fluidParticles,p0);
+    adaptive.setBase(0.01,fluidParticles.isEmpty() ? 1.0 : fluidParticles[0]->radius,2*water_radius);
+    smoothingLengths.clear();
+    variableH = false;
+    stepsSinceRefine = 0;
+    stepsSincePrecisionCheck = 0;
+    precisionReport.clear();
+
+    grid->setOrigin(colliderCube.pos-colliderCube.scale);
+    hash->create(fluidParticles);
+    grid->create(fluidParticles);
+    cellHash->create(fluidParticles);
+    registerParkedParticles();
     system.addForce(fGravity);
     system.addForce(fBlackhole);
     system.addForce(fWind);
@@ -498,12 +621,26 @@ void SceneSPHWaterCube::updateSimParams()
     // get gravity from UI and update force
     double g = widget->getGravity();
     fGravity->setAcceleration(Vec3(0, -g, 0));
+    wakeEverything = true;
+    // the method or k may have changed
+    iwcsphPressure.clear();
+    iisphPressure.clear();
 
     // get other relevant UI values and update simulation params
     maxParticleLife = 20.0;
     emitRate = 50;
 }
 
+void SceneSPHWaterCube::exportConvergenceLog(const QString& path)
+{
+    if(!convergenceLog.write(path)) std::cerr << "Could not write the convergence log to " << path.toStdString() << std::endl;
+}
+
+void SceneSPHWaterCube::exportSurfaceMesh(const QString& path)
+{
+    if(!SurfaceReconstruction::writeOBJ(surfaceMesh, path)) std::cerr << "Could not write the surface mesh to " << path.toStdString() << std::endl;
+}
+
 
 void SceneSPHWaterCube::paint(const Camera& camera) {
 
@@ -554,41 +691,68 @@ void SceneSPHWaterCube::paint(const Camera& camera) {
     shader->setUniformValue("alpha", 1.0f);
     glFuncs->glDrawElements(GL_TRIANGLES, 3*numFacesSphereBigS, GL_UNSIGNED_INT, 0);
 
-    // draw the different spheres
-    vaoSphereS->bind();
-    for (const Particle* particle : poolParticles) {
-        Vec3   p = particle->pos;
-        Vec3   c = particle->color;
-        double r = particle->radius;
-
-        modelMat = QMatrix4x4();
-        modelMat.translate(p[0], p[1], p[2]);
-        modelMat.scale(r);
-        shader->setUniformValue("ModelMatrix", modelMat);
-
-        shader->setUniformValue("matdiff", GLfloat(c[0]), GLfloat(c[1]), GLfloat(c[2]));
+    // draw the fluid surface instead of its particles, filling the buffers when a new mesh came
+    bool drawSurface = widget->getSurfaceMesh();
+    if (drawSurface) {
+        vaoMesh->bind();
+        if (surfaceMeshChanged) {
+            numMeshIndices = surfaceMesh.getIndices().size();
+            if (numMeshIndices) {
+                vboMesh->bind();
+                vboMesh->allocate(surfaceMesh.getCoordsPtr(), surfaceMesh.numVertices()*3*sizeof(float));
+                nboMesh->bind();
+                nboMesh->allocate(surfaceMesh.getNormalsPtr(), surfaceMesh.numVertices()*3*sizeof(float));
+                iboMesh->bind();
+                iboMesh->allocate(surfaceMesh.getIndicesPtr(), numMeshIndices*sizeof(unsigned int));
+            }
+            surfaceMeshChanged = false;
+        }
+        shader->setUniformValue("ModelMatrix", QMatrix4x4());
+        shader->setUniformValue("matdiff", GLfloat(95/255.0), GLfloat(150/255.0), GLfloat(165/255.0));
         shader->setUniformValue("matspec", 0.297254f, 0.30829f, 0.306678f);
         shader->setUniformValue("matshin", 12.8f);
         shader->setUniformValue("alpha", 1.0f);
-
-        glFuncs->glDrawElements(GL_TRIANGLES, 3*numFacesSphereS, GL_UNSIGNED_INT, 0);
+        if (numMeshIndices) glFuncs->glDrawElements(GL_TRIANGLES, numMeshIndices, GL_UNSIGNED_INT, 0);
+        vaoMesh->release();
     }
-    for (const Particle* particle : dropParticles) {
-        Vec3   p = particle->pos;
-        Vec3   c = particle->color;
-        double r = particle->radius;
-
-        modelMat = QMatrix4x4();
-        modelMat.translate(p[0], p[1], p[2]);
-        modelMat.scale(r);
-        shader->setUniformValue("ModelMatrix", modelMat);
 
-        shader->setUniformValue("matdiff", GLfloat(c[0]), GLfloat(c[1]), GLfloat(c[2]));
-        shader->setUniformValue("matspec", 0.297254f, 0.30829f, 0.306678f);
-        shader->setUniformValue("matshin", 12.8f);
-        shader->setUniformValue("alpha", 1.0f);
-
-        glFuncs->glDrawElements(GL_TRIANGLES, 3*numFacesSphereS, GL_UNSIGNED_INT, 0);
+    // draw the different spheres
+    vaoSphereS->bind();
+    if (!drawSurface) {
+        for (const Particle* particle : poolParticles) {
+            Vec3   p = particle->pos;
+            Vec3   c = particle->color;
+            double r = particle->radius;
+
+            modelMat = QMatrix4x4();
+            modelMat.translate(p[0], p[1], p[2]);
+            modelMat.scale(r);
+            shader->setUniformValue("ModelMatrix", modelMat);
+
+            shader->setUniformValue("matdiff", GLfloat(c[0]), GLfloat(c[1]), GLfloat(c[2]));
+            shader->setUniformValue("matspec", 0.297254f, 0.30829f, 0.306678f);
+            shader->setUniformValue("matshin", 12.8f);
+            shader->setUniformValue("alpha", 1.0f);
+
+            glFuncs->glDrawElements(GL_TRIANGLES, 3*numFacesSphereS, GL_UNSIGNED_INT, 0);
+        }
+        for (const Particle* particle : dropParticles) {
+            Vec3   p = particle->pos;
+            Vec3   c = particle->color;
+            double r = particle->radius;
+
+            modelMat = QMatrix4x4();
+            modelMat.translate(p[0], p[1], p[2]);
+            modelMat.scale(r);
+            shader->setUniformValue("ModelMatrix", modelMat);
+
+            shader->setUniformValue("matdiff", GLfloat(c[0]), GLfloat(c[1]), GLfloat(c[2]));
+            shader->setUniformValue("matspec", 0.297254f, 0.30829f, 0.306678f);
+            shader->setUniformValue("matshin", 12.8f);
+            shader->setUniformValue("alpha", 1.0f);
+
+            glFuncs->glDrawElements(GL_TRIANGLES, 3*numFacesSphereS, GL_UNSIGNED_INT, 0);
+        }
     }
     for (const Particle* particle : boundaryParticles) {
         Vec3   p = particle->pos;
@@ -623,111 +787,1141 @@ void SceneSPHWaterCube::paint(const Camera& camera) {
     shader->release();
 }
 
-double getKernelFunctionPoly(Vec3 r, double h){
-    double r_norm = r.norm();
-    if(0.f <= r_norm && r_norm <= h){
-        double h2_r2 = h*h - r_norm*r_norm;
-        double h9 = h*h*h*h*h*h*h*h*h;
-        return 315.f/(64.f*3.14159192*h9)*h2_r2*h2_r2*h2_r2;
+double SceneSPHWaterCube::getPressureFunctionStateEquation(double pi, double p0){
+    double pressure = k*(pi/p0-1.f);
+    if(pressure>=0.f) return pressure;
+    return 0.0;
+}
+
+double SceneSPHWaterCube::getPressureFunctionSound(double pi, double p0){
+    double pressure = c*c*(pi-p0);
+    if(pressure>=0.f) return pressure;
+    return 0.f;
+}
+
+double getPijMeanDensitySquare(double mj, double pressurei, double densityi, double pressurej, double densityj){
+    return -mj*(pressurei/(densityi*densityi) + pressurej/(densityj*densityj));
+}
+
+Vec3 getVijMeanDensitySquare(double mj, const Vec3& veli, double densityi, const Vec3& velj, double densityj){
+    return -mj/densityj*(velj-veli)/densityi;
+}
+
+template<class Fn>
+void SceneSPHWaterCube::parallelFor(int n, int chunk, const Fn& fn){
+    pool.parallelFor(n, ThreadPool::Schedule(widget->getSchedule()), chunk, fn);
+}
+
+template<class Active, class Eval>
+void SceneSPHWaterCube::forEachNeighborhood(double h, int fields, const Active& active, const Eval& eval){
+    // the neighbor structures only hold the fluid particles, which come first in the system
+    const int numFluid = fluidParticles.size();
+
+    // with variable smoothing lengths each particle searches as far as its largest pair support,
+    // the boundary keeps h
+    auto support = [&](unsigned int i){ return variableH ? 0.5*(smoothingLengths[i] + h*neighborScale[i]) : h; };
+
+    // in a periodic domain the tiles hold the images of the neighbors closest to the particles
+    const bool periodic = periodicDomain.any();
+
+    // the mixed precision sums read the positions of the tiles relative to a point next to the
+    // particles, which the tiles take when they are loaded
+    for(SPHThreadData& td : threadData) td.tile.relativePositions = td.boundaryTile.relativePositions = mixedPrecision;
+
+    if(widget->getTraversal() == SPHTraversal::CellWise && neighbors->hasExactCells()){
+        // one gather per cell, shared by all the particles binned in it. When h is larger than a
+        // cell this is more candidates than a per-particle query, so the lanes of the sums group
+        // the neighbors differently and the two traversals only agree to rounding
+        parallelFor(neighbors->getNumCells(), 64, [&](int begin, int end, int thread){
+            SPHThreadData& td = threadData[thread];
+            for(int c=begin; c<end; c++){
+                unsigned int start = neighbors->cellStart[c];
+                unsigned int stop = neighbors->cellStart[c+1];
+
+                bool anyActive = false;
+                double radius = h;
+                for(unsigned int k=start; k<stop; k++){
+                    unsigned int i = neighbors->cellEntries[k];
+                    if(!active(i)) continue;
+                    anyActive = true;
+                    if(!variableH) break;
+                    radius = std::max(radius,support(i));
+                }
+                if(!anyActive) continue;
+
+                neighbors->queryCell(c,radius,td.queryIds,td.querySize);
+                td.tile.load(fluidParticles,td.queryIds,td.querySize,fields,nullptr,variableH ? &smoothingLengths : nullptr);
+                // the images closest to the middle of the particles of the cell are the closest
+                // ones to each of them. A particle that crossed the seam since it was binned is
+                // an image away from the others and gets the tile moved to it
+                Vec3 middle(0,0,0);
+                if(periodic){
+                    const Vec3& first = fluidParticles[neighbors->cellEntries[start]]->pos;
+                    Vec3 lo = first, hi = first;
+                    for(unsigned int k=start+1; k<stop; k++){
+                        Vec3 x = periodicDomain.nearestImage(fluidParticles[neighbors->cellEntries[k]]->pos,first);
+                        lo = lo.cwiseMin(x);
+                        hi = hi.cwiseMax(x);
+                    }
+                    middle = 0.5*(lo + hi);
+                    td.tile.nearestImages(periodicDomain,middle);
+                }
+                for(unsigned int k=start; k<stop; k++){
+                    unsigned int i = neighbors->cellEntries[k];
+                    if(!active(i)) continue;
+                    const Vec3& x = fluidParticles[i]->pos;
+                    boundaryGrid->query(x,h,td.boundaryIds,td.boundarySize);
+                    td.boundaryTile.load(boundaryParticles,td.boundaryIds,td.boundarySize,fields,&boundaryPsi);
+                    bool crossed = false;
+                    if(periodic){
+                        td.boundaryTile.nearestImages(periodicDomain,x);
+                        crossed = periodicDomain.minimumImage(x - middle) != x - middle;
+                        if(crossed) td.tile.nearestImages(periodicDomain,x);
+                    }
+                    eval(i,td.tile,td.boundaryTile);
+                    if(crossed) td.tile.nearestImages(periodicDomain,middle);
+                }
+            }
+        });
+    } else {
+        parallelFor(numFluid, 64, [&](int begin, int end, int thread){
+            SPHThreadData& td = threadData[thread];
+            for(int i=begin; i<end; i++){
+                if(!active(i)) continue;
+                neighbors->query(fluidParticles[i]->pos,support(i),td.queryIds,td.querySize);
+                td.tile.load(fluidParticles,td.queryIds,td.querySize,fields,nullptr,variableH ? &smoothingLengths : nullptr);
+                boundaryGrid->query(fluidParticles[i]->pos,h,td.boundaryIds,td.boundarySize);
+                td.boundaryTile.load(boundaryParticles,td.boundaryIds,td.boundarySize,fields,&boundaryPsi);
+                if(periodic){
+                    td.tile.nearestImages(periodicDomain,fluidParticles[i]->pos);
+                    td.boundaryTile.nearestImages(periodicDomain,fluidParticles[i]->pos);
+                }
+                eval(i,td.tile,td.boundaryTile);
+            }
+        });
     }
-    return 0;
 }
 
-Vec3 getKernelFunctionGradientPoly(Vec3 r, double h){
-    double r_norm = r.norm();
-    if(0.f <= r_norm && r_norm <= h){
-        double h2_r2 = h*h - r_norm*r_norm;
-        double h9 = h*h*h*h*h*h*h*h*h;
-        return -r*945.f/(32.f*3.14159192*h9)*h2_r2*h2_r2;
+template<class Active, class Eval>
+void SceneSPHWaterCube::forEachBoundaryNeighborhood(double h, int fields, const Active& active, const Eval& eval){
+    for(SPHThreadData& td : threadData) td.boundaryTile.relativePositions = mixedPrecision;
+    parallelFor(fluidParticles.size(), 64, [&](int begin, int end, int thread){
+        SPHThreadData& td = threadData[thread];
+        for(int i=begin; i<end; i++){
+            if(!active(i)) continue;
+            boundaryGrid->query(fluidParticles[i]->pos,h,td.boundaryIds,td.boundarySize);
+            if(td.boundarySize == 0 && boundaryHandling == BoundaryHandling::BoundaryParticles) continue;
+            td.boundaryTile.load(boundaryParticles,td.boundaryIds,td.boundarySize,fields,&boundaryPsi);
+            if(periodicDomain.any()) td.boundaryTile.nearestImages(periodicDomain,fluidParticles[i]->pos);
+            eval(i,td.boundaryTile);
+        }
+    });
+}
+
+void SceneSPHWaterCube::setupSDFBoundary(){
+    sdfBoundary.clearColliders();
+    if(boundaryHandling != BoundaryHandling::SignedDistance) return;
+    // the walls are set from the container in updateBoundary, the sphere is read where it is.
+    // Walls 2w and 2w+1 face axis w, the ones of the periodic axes are left out
+    for(int w=0; w<6; w++)
+        if(!periodicDomain.isPeriodic(w/2)) sdfBoundary.addCollider(&containerWalls[w]);
+    sdfBoundary.addCollider(&colliderSphere);
+}
+
+void SceneSPHWaterCube::updateBoundary(double h, double p0, int densityKernel){
+    if(boundaryHandling == BoundaryHandling::SignedDistance){
+        if(boundaryMoved){
+            Vec3 planesN[6];
+            double planesD[6];
+            colliderCube.getPlanes(planesN,planesD);
+            for(int w=0; w<6; w++) containerWalls[w].setPlane(planesN[w],planesD[w]);
+        }
+        if(sdfH != h){
+            sdfBoundary.setKernel(SDFBoundary::Spiky, h, [&](double r) -> double { return kernels.spiky(r*r); });
+            sdfBoundary.setKernel(SDFBoundary::Poly6, h, [&](double r) -> double { return poly6.value(r*r); });
+            sdfBoundary.setKernel(SDFBoundary::CubicSpline, h, [&](double r) -> double { return cubicSpline.value(r*r); });
+            sdfBoundary.setKernel(SDFBoundary::ViscosityLaplacian, h, [&](double r) -> double { return kernels.viscosityLaplacian(r*r); });
+            sdfH = h;
+        }
+    }
+
+    bool rebin = boundaryMoved || !boundaryGrid || boundaryGrid->getSpacing() != h;
+    if(rebin){
+        Vec3 bmin = boundaryParticles.size() ? boundaryParticles[0]->pos : Vec3(0,0,0);
+        Vec3 bmax = bmin;
+        for(const Particle* pb : boundaryParticles){
+            bmin = bmin.cwiseMin(pb->pos);
+            bmax = bmax.cwiseMax(pb->pos);
+        }
+        delete boundaryGrid;
+        boundaryGrid = new Grid(h,bmin,bmax,boundaryParticles.size());
+        boundaryGrid->setPeriodic(periodicDomain);
+        boundaryGrid->create(boundaryParticles);
+        boundaryMoved = false;
     }
-    return Vec3(0.f,0.f,0.f);
+
+    // the volumes do not change when the container only moves
+    if(boundaryPsi.size() == boundaryParticles.size() && boundaryPsiH == h && boundaryPsiP0 == p0 && boundaryPsiKernel == densityKernel) return;
+    if(densityKernel == SPHDensityKernel::Poly6Density) computeBoundaryPsi(poly6,h,p0);
+    else if(densityKernel == SPHDensityKernel::CubicSplineDensity) computeBoundaryPsi(cubicSpline,h,p0);
+    else computeBoundaryPsi(BatchedSpikyKernel(kernels),h,p0);
+    boundaryPsiH = h;
+    boundaryPsiP0 = p0;
+    boundaryPsiKernel = densityKernel;
+}
+
+template<class Kernel>
+void SceneSPHWaterCube::computeBoundaryPsi(const Kernel& w, double h, double p0){
+    boundaryPsi.resize(boundaryParticles.size());
+    double h2 = h*h;
+    parallelFor(boundaryParticles.size(), 256, [&](int begin, int end, int thread){
+        SPHThreadData& td = threadData[thread];
+        for(int b=begin; b<end; b++){
+            const Vec3& pos = boundaryParticles[b]->pos;
+            boundaryGrid->query(pos,h,td.boundaryIds,td.boundarySize);
+            double sum = 0;
+            for(unsigned int k=0; k<td.boundarySize; k++){
+                double r2 = periodicDomain.minimumImage(pos - boundaryParticles[td.boundaryIds[k]]->pos).squaredNorm();
+                if(r2 > h2) continue;
+                sum += w.value(r2);
+            }
+            boundaryPsi[b] = p0/sum;
+        }
+    });
+}
+
+template<class T, class PairFn>
+void SceneSPHWaterCube::accumulatePairs(double h, QVector<T>& result, QVector<T>& blocks, const T& zero, const PairFn& fn){
+    // the pairs found from each block of cells add up into their own copy of the results, summed
+    // in block order afterwards, so the sums do not depend on the number of threads
+    const int n = result.size();
+    const unsigned long long numCells = neighbors->getNumCells();
+    blocks.resize(numPairBlocks*n);
+
+    parallelFor(numPairBlocks, 1, [&](int begin, int end, int thread){
+        SPHThreadData& td = threadData[thread];
+        for(int b=begin; b<end; b++){
+            T* acc = blocks.data() + b*n;
+            std::fill(acc, acc+n, zero);
+            neighbors->forEachPair(numCells*b/numPairBlocks, numCells*(b+1)/numPairBlocks, h,
+                [&](unsigned int i, unsigned int j){ fn(i,j,acc); }, td.queryIds, td.querySize);
+        }
+    });
+
+    parallelFor(n, 1024, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++)
+            for(int b=0; b<numPairBlocks; b++)
+                result[i] += blocks[b*n+i];
+    });
 }
 
-double getKernelFunctionSpiky(Vec3 r, double h){
-    double r_norm = r.norm();
-    if(0.f <= r_norm && r_norm <= h){
-        double h_r = h - r_norm;
-        double h6 = h*h*h*h*h*h;
-        return 15.f/(3.14159192*h6)*h_r*h_r*h_r;
+bool SceneSPHWaterCube::useSymmetricPairs(){
+    // the pairs do not see the nearest images of a periodic domain
+    return widget->getTraversal() == SPHTraversal::SymmetricPairs && neighbors->hasExactCells() && !variableH && !periodicDomain.any();
+}
+
+void SceneSPHWaterCube::wakeParticles(double h, bool sleeping){
+    if(!sleeping || wakeEverything){
+        if(sleepTracker.getNumAsleep()) sleepTracker.wakeAll(fluidParticles);
+        wakeEverything = false;
+        sphereMoved = false;
+        return;
     }
-    return 0;
+
+    // a sleeping particle only changes the velocity of its neighbors, so waking it does not
+    // change what the other sleeping particles see in this pass
+    double h2 = h*h;
+    double wake2 = sleepTracker.getWakeSpeed()*sleepTracker.getWakeSpeed();
+    forEachNeighborhood(h, SPHTile::Velocities,
+        [&](unsigned int i){ return fluidParticles[i]->asleep; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile&){
+            Particle *pi = fluidParticles[i];
+            bool wake = false;
+            for(unsigned int k=0; k<t.size && !wake; k++){
+                double r2 = (pi->pos - Vec3(t.x[k],t.y[k],t.z[k])).squaredNorm();
+                wake = r2 <= h2 && t.vx[k]*t.vx[k] + t.vy[k]*t.vy[k] + t.vz[k]*t.vz[k] > wake2;
+            }
+            Vec3 normal;
+            if(!wake && sphereMoved) wake = colliderSphere.signedDistance(pi->pos,normal) < h;
+            if(wake) sleepTracker.wake(pi,i);
+        });
+    sphereMoved = false;
 }
 
-Vec3 getKernelFunctionGradientSpiky(Vec3 r, double h){
-    double r_norm = r.norm();
-    if(0.f <= r_norm && r_norm <= h){
-        double h_r = h - r_norm;
-        double h6 = h*h*h*h*h*h;
-        return -r*45.f/(3.14159192*h6*r_norm)*h_r*h_r;
+void SceneSPHWaterCube::updateSmoothingLengths(double h){
+    const int numFluid = fluidParticles.size();
+    smoothingLengths.resize(numFluid);
+    maxSmoothingLength = h;
+    for(int i=0; i<numFluid; i++){
+        smoothingLengths[i] = adaptive.smoothingLength(fluidParticles[i],h);
+        maxSmoothingLength = std::max(maxSmoothingLength,smoothingLengths[i]);
     }
-    return Vec3(0.f,0.f,0.f);
+    variableH = maxSmoothingLength > h;
 }
 
-double getKernelFunctionLaplacianViscosity(Vec3 r, double h){
-    double r_norm = r.norm();
-    if(0.f <= r_norm && r_norm <= h){
-        double h5 = h*h*h*h*h;
-        return 45.f/(3.14159192*h5)*(1.f-r_norm/h);
+void SceneSPHWaterCube::setFluidParticles(const QVector<Particle*>& pool, const QVector<Particle*>& drop){
+    poolParticles = pool;
+    dropParticles = drop;
+    fluidParticles = pool;
+    fluidParticles.append(drop);
+
+    system.clearParticles();
+    for(Particle* p : fluidParticles) system.addParticle(p);
+    for(Particle* p : boundaryParticles) system.addParticle(p);
+
+    // one SPH force per fluid particle, added before gravity, the blackhole and the wind as on reset
+    fGravity->clearInfluencedParticles();
+    fBlackhole->clearInfluencedParticles();
+    system.clearForces();
+    while(fSPHSystem.size() > fluidParticles.size()){
+        delete fSPHSystem.back();
+        fSPHSystem.pop_back();
     }
-    return 0.f;
+    while(fSPHSystem.size() < fluidParticles.size()) fSPHSystem.push_back(new ForceSPH());
+    for(int i=0; i<fluidParticles.size(); i++){
+        fGravity->addInfluencedParticle(fluidParticles[i]);
+        fBlackhole->addInfluencedParticle(fluidParticles[i]);
+        fSPHSystem[i]->clearInfluencedParticles();
+        fSPHSystem[i]->addInfluencedParticle(fluidParticles[i]);
+        system.addForce(fSPHSystem[i]);
+    }
+    registerParkedParticles();
+    system.addForce(fGravity);
+    system.addForce(fBlackhole);
+    system.addForce(fWind);
+
+    // the neighbor structures and the query buffers follow the new particles
+    neighbors->create(fluidParticles);
+    for(SPHThreadData& td : threadData)
+        if(td.queryIds.size() < int(system.getNumParticles())) td.queryIds.resize(system.getNumParticles());
+}
+
+void SceneSPHWaterCube::wrapParticles(){
+    if(!periodicDomain.any()) return;
+    parallelFor(fluidParticles.size(), 1024, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++){
+            Particle* p = fluidParticles[i];
+            Vec3 shift = periodicDomain.wrapShift(p->pos);
+            p->pos += shift;
+            p->prevPos += shift;
+        }
+    });
+}
+
+void SceneSPHWaterCube::registerParkedParticles(){
+    for(Particle* p : particlePool.getParticles()){
+        fGravity->addInfluencedParticle(p);
+        fBlackhole->addInfluencedParticle(p);
+    }
+    for(ForceSPH* f : particlePool.getForces()) system.addForce(f);
 }
 
-double getKernelFunctionCubicSpline(Vec3 r, double h){
-    double r_norm = r.norm();
-    double q = r_norm/h;
-    double sigma = 8/(3.141519192*h*h*h);
-    if(0.f <= q && q <= 1/2.f){
-        return sigma*6.f*(q*q*q-q*q)+1.f;
+bool SceneSPHWaterCube::emitAndDrain(double dt, double p0){
+    const int numFluid = fluidParticles.size();
+    const int numBoundary = boundaryParticles.size();
+
+    // the tap is a jet along x from the -x wall, the drain a slot in the floor along the +x wall
+    const Vec3& center = colliderCube.pos;
+    const Vec3& scale = colliderCube.scale;
+    tap.setCenter(center + Vec3(-0.6*scale.x(), 0.5*scale.y(), 0));
+    drain.bmin = center + Vec3(scale.x() - 8, -scale.y() - 2, -4);
+    drain.bmax = center + Vec3(scale.x() + 2, -scale.y() + 3, 4);
+
+    // the warm starts follow their particles, the ones also covering the boundary, by system
+    // index, get it back zeroed
+    QVector<double>* warmStarts[] = {&iwcsphPressure, &iisphPressure, &dfsphKappa, &dfsphKappaV};
+    int beyondFluid[4];
+    bool followed[4];
+    for(int a=0; a<4; a++){
+        beyondFluid[a] = warmStarts[a]->size() - numFluid;
+        followed[a] = !warmStarts[a]->isEmpty() && beyondFluid[a] >= 0;
+    }
+
+    // 1. the survivors move down the lists in order, so the groups stay contiguous and a fluid
+    // index is still a system index
+    int w = 0, r = 0;
+    for(QVector<Particle*>* group : {&poolParticles, &dropParticles}){
+        int groupSize = 0;
+        for(int g=0; g<group->size(); g++, r++){
+            Particle* p = (*group)[g];
+            if(drain.contains(p->pos)){
+                particlePool.park(p,fSPHSystem[r]);
+                continue;
+            }
+            (*group)[groupSize++] = p;
+            fluidParticles[w] = p;
+            fSPHSystem[w] = fSPHSystem[r];
+            sleepTracker.move(r,w);
+            for(int a=0; a<4; a++) if(followed[a]) (*warmStarts[a])[w] = (*warmStarts[a])[r];
+            w++;
+        }
+        group->resize(groupSize);
     }
-    if(1.f/2.f <= q <= 1.f){
-        return sigma*2.f*(1.f-q)*(1.f-q)*(1.f-q);
+    fluidParticles.resize(w);
+    fSPHSystem.resize(w);
+    int drained = numFluid - w;
+
+    // 2. the tap stops while the pool is empty
+    int emitted = tap.step(dt, tapSpeed, [&](const Vec3& pos, const Vec3& vel){
+        if(particlePool.empty()) return false;
+        ForceSPH* f;
+        Particle* p = particlePool.take(f);
+        p->pos = pos;
+        p->vel = vel;
+        p->prevPos = pos - dt*vel;
+        p->mass = adaptive.getBaseMass();
+        p->density = p0;
+        p->pressure = 0;
+        p->color = Vec3(120/255.0, 190/255.0, 215/255.0);
+        dropParticles.push_back(p);
+        fluidParticles.push_back(p);
+        fSPHSystem.push_back(f);
+        return true;
+    });
+    numEmitted += emitted;
+    numDrained += drained;
+    if(!emitted && !drained) return false;
+
+    // 3. the fluid is followed by the boundary in the system, the new particles get zeroed warm
+    // starts and start awake
+    const int newNumFluid = fluidParticles.size();
+    QVector<Particle*>& parts = system.getParticles();
+    parts.resize(newNumFluid + numBoundary);
+    std::copy(fluidParticles.begin(), fluidParticles.end(), parts.begin());
+    std::copy(boundaryParticles.begin(), boundaryParticles.end(), parts.begin() + newNumFluid);
+    sleepTracker.resize(newNumFluid);
+    for(int a=0; a<4; a++){
+        if(!followed[a]) continue;
+        warmStarts[a]->resize(w);
+        warmStarts[a]->resize(newNumFluid + beyondFluid[a]);
+    }
+    // the fluid resting on the drained particles has to move again
+    if(drained) wakeEverything = true;
+    return true;
+}
+
+void SceneSPHWaterCube::updateNeighborScales(double h){
+    // the largest h_j around every particle, with h/2 of slack for the particles moving until the
+    // next refinement, so the queries in between do not all have to reach the coarsest level
+    if(!variableH) return;
+    const int numFluid = fluidParticles.size();
+    neighborScale.resize(numFluid);
+    parallelFor(numFluid, 64, [&](int begin, int end, int thread){
+        SPHThreadData& td = threadData[thread];
+        for(int i=begin; i<end; i++){
+            const Vec3& x = fluidParticles[i]->pos;
+            double largest = smoothingLengths[i];
+            neighbors->query(x,0.5*(smoothingLengths[i] + maxSmoothingLength) + 0.5*h,td.queryIds,td.querySize);
+            for(unsigned int k=0; k<td.querySize; k++){
+                unsigned int j = td.queryIds[k];
+                double reach = 0.5*(smoothingLengths[i] + smoothingLengths[j]) + 0.5*h;
+                if(smoothingLengths[j] > largest && periodicDomain.minimumImage(fluidParticles[j]->pos - x).squaredNorm() <= reach*reach)
+                    largest = smoothingLengths[j];
+            }
+            neighborScale[i] = largest/h;
+        }
+    });
+}
+
+Vec3 SceneSPHWaterCube::splitAxis(const Particle* p, int preferred) const{
+    // the children must not end up behind a wall, the collisions only catch particles crossing it
+    double offset = 0.5*adaptive.spacing(adaptive.level(p) - 1);
+    double clearance[3];
+    int best = 0;
+    for(int axis=0; axis<3; axis++){
+        clearance[axis] = colliderCube.scale[axis] - std::abs(p->pos[axis] - colliderCube.pos[axis]);
+        if(clearance[axis] > clearance[best]) best = axis;
     }
-    return 0;
+    return Vec3::Unit(clearance[preferred%3] > offset ? preferred%3 : best);
 }
 
-Vec3 getKernelFunctionGradientCubicSpline(Vec3 r, double h){
-    double r_norm = r.norm();
-    double q = r_norm/h;
-    double sigma = 8/(3.141519192*h*h*h);
-    if(0.f <= q && q <= 1/2.f){
-        return r.normalized()*sigma*(18*q*q-12*q);
+bool SceneSPHWaterCube::adaptResolution(double h, bool enabled){
+    const int numPool = poolParticles.size();
+
+    // back to level 0 at once, the children of a particle split again when they are reached
+    if(!enabled){
+        stepsSinceRefine = 0;
+        if(!variableH) return false;
+        QVector<Particle*> pool = poolParticles, drop = dropParticles;
+        for(QVector<Particle*>* group : {&pool, &drop}){
+            for(int i=0; i<group->size(); i++){
+                Particle* p = (*group)[i];
+                for(int axis=0; adaptive.level(p) > 0; axis++) group->push_back(adaptive.split(p,splitAxis(p,axis)));
+            }
+        }
+        setFluidParticles(pool,drop);
+        updateSmoothingLengths(h);
+        return true;
+    }
+
+    if(++stepsSinceRefine < refineInterval) return false;
+    stepsSinceRefine = 0;
+
+    const int numFluid = fluidParticles.size();
+    const int maxLevel = adaptive.getMaxLevel();
+    updateSmoothingLengths(h);
+    QVector<int> levels(numFluid);
+    for(int i=0; i<numFluid; i++) levels[i] = adaptive.level(fluidParticles[i]);
+
+    // the particles missing fluid neighbors against a filled level 0 lattice are at the free
+    // surface, where the distance starts at 0. Next to a wall it starts at the closest boundary
+    // particle, as a deep pool can be compressed enough to hide the missing neighbors
+    double spacing = 2*water_radius;
+    int n = int(std::ceil(h/spacing));
+    double latticeDensity = 0;
+    for(int i=-n; i<=n; i++)
+        for(int j=-n; j<=n; j++)
+            for(int k=-n; k<=n; k++){
+                double r2 = spacing*spacing*(i*i + j*j + k*k);
+                if(r2 <= kernels.h2) latticeDensity += adaptive.getBaseMass()*kernels.spiky(r2);
+            }
+    const double* hs = smoothingLengths.constData();
+    const double far = std::numeric_limits<double>::max();
+    surfaceDistance.fill(far,numFluid);
+    forEachNeighborhood(h, SPHTile::Positions, [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double density = variableH ? kernels.density(pi->pos,hs[i],t) : kernels.density(pi->pos,t);
+            if(density < 0.9*latticeDensity){
+                surfaceDistance[i] = 0;
+                return;
+            }
+            for(unsigned int k=0; k<b.size; k++){
+                double r = (pi->pos - Vec3(b.x[k],b.y[k],b.z[k])).norm();
+                surfaceDistance[i] = std::min(surfaceDistance[i],r);
+            }
+            if(surfaceDistance[i] == far && boundaryDensity(pi->pos,b) > 0) surfaceDistance[i] = 0;
+        });
+
+    // the distance travels through the neighbors, as far as the support of the coarsest level
+    for(int pass=0; pass<=maxLevel; pass++){
+        QVector<double> previous = surfaceDistance;
+        forEachNeighborhood(h, SPHTile::Positions, [&](unsigned int i){ return previous[i] > 0; },
+            [&](unsigned int i, const SPHTile& t, const SPHTile&){
+                const Vec3& x = fluidParticles[i]->pos;
+                for(unsigned int k=0; k<t.size; k++){
+                    unsigned int j = t.ids[k];
+                    if(previous[j] == far) continue;
+                    double hij = 0.5*(hs[i] + hs[j]);
+                    double r2 = (x - Vec3(t.x[k],t.y[k],t.z[k])).squaredNorm();
+                    if(r2 <= hij*hij) surfaceDistance[i] = std::min(surfaceDistance[i],previous[j] + std::sqrt(r2));
+                }
+            });
     }
-    if(1.f/2.f <= q <= 1.f){
-        return -r.normalized()*sigma*6*(1-q)*(1-q);
+
+    // the coarsest level whose support stays clear of the surface and the walls. Merging asks
+    // for half a spacing more, so the particles on the edge of a level do not merge and split
+    // back every time
+    auto targetLevel = [&](double distance){
+        int l = 0;
+        while(l < maxLevel && h*std::cbrt(double(2 << l)) <= distance) l++;
+        return l;
+    };
+    QVector<int> targets(numFluid), mergeTargets(numFluid);
+    for(int i=0; i<numFluid; i++){
+        targets[i] = targetLevel(surfaceDistance[i]);
+        mergeTargets[i] = targetLevel(surfaceDistance[i] - 0.5*spacing);
     }
-    return Vec3(0.f,0.f,0.f);
+
+    // merge candidates pick their closest candidate of the same level, the pairs that picked each
+    // other merge, so the result does not depend on the order or the number of threads
+    auto mergeable = [&](unsigned int i){ return levels[i] < mergeTargets[i] && !fluidParticles[i]->lock; };
+    mergePartner.fill(-1,numFluid);
+    forEachNeighborhood(h, SPHTile::Positions, mergeable,
+        [&](unsigned int i, const SPHTile& t, const SPHTile&){
+            const Vec3& x = fluidParticles[i]->pos;
+            double best2 = 0.8*hs[i]*0.8*hs[i];
+            for(unsigned int k=0; k<t.size; k++){
+                int j = t.ids[k];
+                if(j == int(i) || levels[j] != levels[i] || !mergeable(j)) continue;
+                // merging averages the positions, so not the images: a partner across a periodic
+                // seam is too far
+                double r2 = (x - fluidParticles[j]->pos).squaredNorm();
+                if(r2 < best2 || (r2 == best2 && j < mergePartner[i])){
+                    best2 = r2;
+                    mergePartner[i] = j;
+                }
+            }
+        });
+
+    QVector<char> removed(numFluid,0);
+    QVector<Particle*> poolChildren, dropChildren;
+    int numChanged = 0;
+    for(int i=0; i<numFluid; i++){
+        int j = mergePartner[i];
+        if(j > i && mergePartner[j] == i){
+            adaptive.merge(fluidParticles[i],fluidParticles[j]);
+            removed[j] = 1;
+            numChanged++;
+        }
+    }
+    // splitting goes down to the target at once, a coarse particle coming close to the surface
+    // can not wait for the next refinements
+    for(int i=0; i<numFluid; i++){
+        if(removed[i] || levels[i] <= targets[i] || fluidParticles[i]->lock) continue;
+        QVector<Particle*>& children = i < numPool ? poolChildren : dropChildren;
+        int first = children.size();
+        Particle* pi = fluidParticles[i];
+        for(int axis=i; adaptive.level(pi) > targets[i]; axis++) children.push_back(adaptive.split(pi,splitAxis(pi,axis)));
+        for(int c=first; c<children.size(); c++)
+            for(int axis=c+1; adaptive.level(children[c]) > targets[i]; axis++)
+                children.push_back(adaptive.split(children[c],splitAxis(children[c],axis)));
+        numChanged++;
+    }
+    if(!numChanged){
+        updateNeighborScales(h);
+        return false;
+    }
+
+    // the children follow their group, so a fluid index is still a system index
+    QVector<Particle*> pool, drop;
+    for(int i=0; i<numFluid; i++){
+        if(removed[i]) delete fluidParticles[i];
+        else (i < numPool ? pool : drop).push_back(fluidParticles[i]);
+    }
+    pool.append(poolChildren);
+    drop.append(dropChildren);
+    setFluidParticles(pool,drop);
+    updateSmoothingLengths(h);
+    updateNeighborScales(h);
+    return true;
+}
+
+// table of the signed distance boundary integrating each density and gradient kernel
+static SDFBoundary::Kernel sdfKernel(const SpikyKernel&) { return SDFBoundary::Spiky; }
+static SDFBoundary::Kernel sdfKernel(const BatchedSpikyKernel&) { return SDFBoundary::Spiky; }
+static SDFBoundary::Kernel sdfKernel(const Poly6Kernel&) { return SDFBoundary::Poly6; }
+static SDFBoundary::Kernel sdfKernel(const CubicSplineKernel&) { return SDFBoundary::CubicSpline; }
+template<class K>
+static SDFBoundary::Kernel sdfKernel(const KernelTable<K>& t) { return sdfKernel(t.analytic()); }
+
+template<class Kernel>
+double SceneSPHWaterCube::boundaryDensity(const Kernel& w, const Vec3& x, const SPHTile& b) const{
+    return tileDensity(w,x,b) + boundaryPsiP0*sdfBoundary.volume(sdfKernel(w),x);
 }
 
-double getKernelFunctionLaplacianViscosityImproved(Vec3 r, double h){
-    double r_norm = r.norm();
-    if(0.f <= r_norm && r_norm <= h){
-        return 2*getKernelFunctionGradientCubicSpline(r,h).norm()/r.norm();
+template<class Kernel>
+Vec3 SceneSPHWaterCube::boundaryGradient(const Kernel& w, const Vec3& x, const SPHTile& b) const{
+    return tileGradient(w,x,b) + boundaryPsiP0*sdfBoundary.volumeGradient(sdfKernel(w),x);
+}
+
+template<class Kernel>
+Vec3 SceneSPHWaterCube::boundaryViscosity(const Kernel& w, const Vec3& x, const Vec3& vel, double density, const SPHTile& b) const{
+    return tileViscosity(w,x,vel,density,b) + vel/density*sdfBoundary.volume(SDFBoundary::ViscosityLaplacian,x);
+}
+
+double SceneSPHWaterCube::boundaryDensity(const Vec3& x, const SPHTile& b) const{
+    return boundaryDensity(BatchedSpikyKernel(kernels),x,b);
+}
+
+Vec3 SceneSPHWaterCube::boundaryGradient(const Vec3& x, const SPHTile& b) const{
+    return boundaryGradient(BatchedSpikyKernel(kernels),x,b);
+}
+
+Vec3 SceneSPHWaterCube::boundaryViscosity(const Vec3& x, const Vec3& vel, double density, const SPHTile& b) const{
+    return boundaryViscosity(BatchedViscosityKernel(kernels),x,vel,density,b);
+}
+
+void SceneSPHWaterCube::computeDensities(double h, double p0, bool speedOfSound){
+    // one switch per pass, the kernel is inlined into the loops of the templated one
+    switch(densityKernel){
+    case SPHDensityKernel::Poly6Density:
+        if(tabulatedKernels) computeDensitiesWith(poly6Table,h,p0,speedOfSound);
+        else computeDensitiesWith(poly6,h,p0,speedOfSound);
+        break;
+    case SPHDensityKernel::CubicSplineDensity:
+        if(tabulatedKernels) computeDensitiesWith(cubicSplineTable,h,p0,speedOfSound);
+        else computeDensitiesWith(cubicSpline,h,p0,speedOfSound);
+        break;
+    default:
+        if(tabulatedKernels) computeDensitiesWith(spikyTable,h,p0,speedOfSound);
+        else if(mixedPrecision) computeDensitiesWith(MixedSpikyKernel(kernels),h,p0,speedOfSound);
+        else computeDensitiesWith(BatchedSpikyKernel(kernels),h,p0,speedOfSound);
     }
-    return 0.f;
 }
 
-double SceneSPHWaterCube::getPressureFunctionStateEquation(double pi, double p0){
-    double pressure = k*(pi/p0-1.f);
-    if(pressure>=0.f) return pressure;
-    return 0.0;
+void SceneSPHWaterCube::computeViscosityAccelerations(double h, double v){
+    if(tabulatedKernels) computeViscosityAccelerationsWith(viscosityTable,h,v);
+    else if(mixedPrecision) computeViscosityAccelerationsWith(MixedViscosityKernel(kernels),h,v);
+    else computeViscosityAccelerationsWith(BatchedViscosityKernel(kernels),h,v);
 }
 
-double SceneSPHWaterCube::getPressureFunctionSound(double pi, double p0){
-    double pressure = c*c*(pi-p0);
-    if(pressure>=0.f) return pressure;
-    return 0.f;
+void SceneSPHWaterCube::computePressureAccelerations(double h, bool boundaryPressure){
+    // the pressure gradient stays Spiky whatever the density kernel, it does not vanish at r = 0
+    if(tabulatedKernels) computePressureAccelerationsWith(spikyTable,h,boundaryPressure);
+    else if(mixedPrecision) computePressureAccelerationsWith(MixedSpikyKernel(kernels),h,boundaryPressure);
+    else computePressureAccelerationsWith(BatchedSpikyKernel(kernels),h,boundaryPressure);
+}
+
+template<class Kernel>
+void SceneSPHWaterCube::computeDensitiesWith(const Kernel& w, double h, double p0, bool speedOfSound){
+    const int numFluid = fluidParticles.size();
+    auto active = [&](unsigned int i){
+        return !fluidParticles[i]->asleep;
+    };
+
+    if(useSymmetricPairs()){
+        double h2 = h*h;
+        densities.resize(numFluid);
+        for(int i=0; i<numFluid; i++){
+            densities[i] = fluidParticles[i]->mass*w.value(0.0);
+        }
+        accumulatePairs(h, densities, densityBlocks, 0.0, [&](unsigned int i, unsigned int j, double* acc){
+            bool ai = active(i), aj = active(j);
+            if(!ai && !aj) return;
+            double r2 = (fluidParticles[i]->pos-fluidParticles[j]->pos).squaredNorm();
+            if(r2 > h2) return;
+            double wij = w.value(r2);
+            if(ai) acc[i] += fluidParticles[j]->mass*wij;
+            if(aj) acc[j] += fluidParticles[i]->mass*wij;
+        });
+        forEachBoundaryNeighborhood(h, SPHTile::Positions, active, [&](unsigned int i, const SPHTile& b){
+            densities[i] += boundaryDensity(w,fluidParticles[i]->pos,b);
+        });
+        parallelFor(numFluid, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++){
+                if(!active(i)) continue;
+                Particle *pi = fluidParticles[i];
+                pi->density = densities[i];
+                pi->pressure = speedOfSound ? getPressureFunctionSound(pi->density,p0) : getPressureFunctionStateEquation(pi->density,p0);
+            }
+        });
+        return;
+    }
+
+    forEachNeighborhood(h, SPHTile::Positions, active,
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double fluidDensity = variableH ? kernels.density(pi->pos,smoothingLengths[i],t) : tileDensity(w,pi->pos,t);
+            pi->density = fluidDensity + boundaryDensity(w,pi->pos,b);
+            pi->pressure = speedOfSound ? getPressureFunctionSound(pi->density,p0) : getPressureFunctionStateEquation(pi->density,p0);
+        });
+}
+
+template<class Kernel>
+void SceneSPHWaterCube::computeViscosityAccelerationsWith(const Kernel& w, double h, double v){
+    accelerations.resize(system.getNumParticles());
+    accelerations.fill(Vec3(0.f,0.f,0.f));
+
+    auto active = [&](unsigned int i){
+        return !fluidParticles[i]->asleep;
+    };
+
+    if(useSymmetricPairs()){
+        double h2 = h*h;
+        accumulatePairs(h, accelerations, accelerationBlocks, Vec3(0,0,0), [&](unsigned int i, unsigned int j, Vec3* acc){
+            bool ai = active(i), aj = active(j);
+            if(!ai && !aj) return;
+            Particle *pi = fluidParticles[i];
+            Particle *pj = fluidParticles[j];
+            double r2 = (pi->pos-pj->pos).squaredNorm();
+            if(r2 > h2) return;
+            double k = w.laplacian(r2);
+            if(!k) return;
+            if(ai) acc[i] += v*getVijMeanDensitySquare(pj->mass,pi->vel,pi->density,pj->vel,pj->density)*k;
+            if(aj) acc[j] += v*getVijMeanDensitySquare(pi->mass,pj->vel,pj->density,pi->vel,pi->density)*k;
+        });
+        forEachBoundaryNeighborhood(h, SPHTile::Velocities | SPHTile::Densities, active,
+            [&](unsigned int i, const SPHTile& b){
+                Particle *pi = fluidParticles[i];
+                accelerations[i] += v*boundaryViscosity(w,pi->pos,pi->vel,pi->density,b);
+            });
+        return;
+    }
+
+    forEachNeighborhood(h, SPHTile::Velocities | SPHTile::Densities, active,
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            Vec3 fluidViscosity = variableH ? kernels.viscosity(pi->pos,pi->vel,pi->density,smoothingLengths[i],t)
+                                            : tileViscosity(w,pi->pos,pi->vel,pi->density,t);
+            accelerations[i] = v*(fluidViscosity + boundaryViscosity(w,pi->pos,pi->vel,pi->density,b));
+        });
+}
+
+template<class Kernel>
+void SceneSPHWaterCube::computePressureAccelerationsWith(const Kernel& w, double h, bool boundaryPressure){
+    accelerations.resize(system.getNumParticles());
+    accelerations.fill(Vec3(0.f,0.f,0.f));
+    auto active = [&](unsigned int i){
+        return !fluidParticles[i]->asleep;
+    };
+    // boundary particles mirror the pressure of the fluid particle, a_i = -2 p_i/rho_i^2 sum psi_b grad W_ib
+    auto boundaryAcceleration = [&](const Particle *pi, const SPHTile& b){
+        return -2*pi->pressure/(pi->density*pi->density)*boundaryGradient(w,pi->pos,b);
+    };
+
+    if(useSymmetricPairs()){
+        double h2 = h*h;
+        // fluid pairs with equal masses get equal and opposite contributions
+        accumulatePairs(h, accelerations, accelerationBlocks, Vec3(0,0,0), [&](unsigned int i, unsigned int j, Vec3* acc){
+            bool ai = active(i), aj = active(j);
+            if(!ai && !aj) return;
+            Particle *pi = fluidParticles[i];
+            Particle *pj = fluidParticles[j];
+            Vec3 r = pi->pos-pj->pos;
+            double r2 = r.squaredNorm();
+            if(r2 > h2 || r2 == 0.0) return;
+            Vec3 gradient = w.gradientFactor(r2)*r;
+            if(ai) acc[i] += getPijMeanDensitySquare(pj->mass,pi->pressure,pi->density,pj->pressure,pj->density)*gradient;
+            if(aj) acc[j] -= getPijMeanDensitySquare(pi->mass,pj->pressure,pj->density,pi->pressure,pi->density)*gradient;
+        });
+        if(boundaryPressure){
+            forEachBoundaryNeighborhood(h, SPHTile::Positions, active, [&](unsigned int i, const SPHTile& b){
+                accelerations[i] += boundaryAcceleration(fluidParticles[i],b);
+            });
+        }
+        return;
+    }
+
+    forEachNeighborhood(h, SPHTile::Densities, active,
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            accelerations[i] = variableH ? kernels.pressure(pi->pos,pi->pressure,pi->density,smoothingLengths[i],t)
+                                         : tilePressure(w,pi->pos,pi->pressure,pi->density,t);
+            if(boundaryPressure) accelerations[i] += boundaryAcceleration(pi,b);
+        });
+}
+
+void SceneSPHWaterCube::measureMixedPrecision(double h){
+    const int numFluid = fluidParticles.size();
+    precisionErrors.resize(numFluid);
+    precisionMagnitudes.resize(numFluid);
+    precisionErrors.fill(Vec3(0,0,0));
+    precisionMagnitudes.fill(Vec3(0,0,0));
+    auto active = [&](unsigned int i){
+        return !fluidParticles[i]->asleep && fluidParticles[i]->density > 0;
+    };
+
+    const BatchedSpikyKernel w64(kernels);
+    const MixedSpikyKernel w32(kernels);
+    const BatchedViscosityKernel v64(kernels);
+    const MixedViscosityKernel v32(kernels);
+    forEachNeighborhood(h, SPHTile::Velocities | SPHTile::Densities, active,
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            const Particle *pi = fluidParticles[i];
+            double density64 = tileDensity(w64,pi->pos,t) + boundaryDensity(w64,pi->pos,b);
+            double density32 = tileDensity(w32,pi->pos,t) + boundaryDensity(w32,pi->pos,b);
+            double boundaryCoef = -2*pi->pressure/(pi->density*pi->density);
+            Vec3 pressure64 = tilePressure(w64,pi->pos,pi->pressure,pi->density,t) + boundaryCoef*boundaryGradient(w64,pi->pos,b);
+            Vec3 pressure32 = tilePressure(w32,pi->pos,pi->pressure,pi->density,t) + boundaryCoef*boundaryGradient(w32,pi->pos,b);
+            Vec3 viscosity64 = tileViscosity(v64,pi->pos,pi->vel,pi->density,t) + boundaryViscosity(v64,pi->pos,pi->vel,pi->density,b);
+            Vec3 viscosity32 = tileViscosity(v32,pi->pos,pi->vel,pi->density,t) + boundaryViscosity(v32,pi->pos,pi->vel,pi->density,b);
+            precisionErrors[i] = Vec3(std::abs(density32 - density64), (pressure32 - pressure64).norm(), (viscosity32 - viscosity64).norm());
+            precisionMagnitudes[i] = Vec3(density64, pressure64.norm(), viscosity64.norm());
+        });
+
+    // densities relative to themselves, the accelerations to the largest one, many of them are
+    // close to 0
+    double densityError = 0;
+    Vec3 maxError(0,0,0), maxMagnitude(0,0,0);
+    for(int i=0; i<numFluid; i++){
+        if(precisionMagnitudes[i].x() > 0) densityError = std::max(densityError, precisionErrors[i].x()/precisionMagnitudes[i].x());
+        maxError = maxError.cwiseMax(precisionErrors[i]);
+        maxMagnitude = maxMagnitude.cwiseMax(precisionMagnitudes[i]);
+    }
+    double pressureError = maxMagnitude.y() > 0 ? maxError.y()/maxMagnitude.y() : 0;
+    double viscosityError = maxMagnitude.z() > 0 ? maxError.z()/maxMagnitude.z() : 0;
+    precisionReport = "Mixed precision:  density " + QString::number(densityError, 'e', 1) + ", pressure "
+                    + QString::number(pressureError, 'e', 1) + ", viscosity " + QString::number(viscosityError, 'e', 1)
+                    + " max relative error";
+}
+
+void SceneSPHWaterCube::computeLatticeGradients(double h, Vec3& sumGradient, double& sumGradient2){
+    // prototype particle in the middle of the lattice the fluid is created on
+    double spacing = 2*water_radius;
+    int n = int(std::ceil(h/spacing));
+    sumGradient = Vec3(0,0,0);
+    sumGradient2 = 0;
+    for(int i=-n; i<=n; i++)
+        for(int j=-n; j<=n; j++)
+            for(int k=-n; k<=n; k++){
+                Vec3 r = -spacing*Vec3(i,j,k);
+                double r2 = r.squaredNorm();
+                if(r2 == 0.0 || r2 > kernels.h2) continue;
+                Vec3 gradient = kernels.spikyGradient(r,r2);
+                sumGradient += gradient;
+                sumGradient2 += gradient.dot(gradient);
+            }
+}
+
+double SceneSPHWaterCube::computePCISPHDelta(double h, double p0, double dt){
+    double mass = poolParticles.size() ? poolParticles[0]->mass : 0.01;
+    Vec3 sumGradient;
+    double sumGradient2;
+    computeLatticeGradients(h,sumGradient,sumGradient2);
+
+    // a pressure p moves the particle by -dt^2 2m p/p0^2 sum grad W, which changes its density by
+    // p times beta (sum grad W . sum grad W + sum grad W . grad W)
+    double beta = dt*dt*mass*mass*2/(p0*p0);
+    double denominator = beta*(sumGradient.dot(sumGradient) + sumGradient2);
+    return denominator > 0 ? 1/denominator : 0;
+}
+
+void SceneSPHWaterCube::findPredictedNeighbors(double h){
+    const int numFluid = fluidParticles.size();
+    predictedNeighbors.resize(numFluid);
+    predictedBoundaryNeighbors.resize(numFluid);
+    parallelFor(numFluid, 64, [&](int begin, int end, int thread){
+        SPHThreadData& td = threadData[thread];
+        for(int i=begin; i<end; i++){
+            const Vec3& x = fluidParticles[i]->pos;
+            neighbors->query(x,h,td.queryIds,td.querySize);
+            predictedNeighbors[i].resize(td.querySize);
+            std::copy(td.queryIds.begin(), td.queryIds.begin() + td.querySize, predictedNeighbors[i].begin());
+            boundaryGrid->query(x,h,td.boundaryIds,td.boundarySize);
+            predictedBoundaryNeighbors[i].resize(td.boundarySize);
+            std::copy(td.boundaryIds.begin(), td.boundaryIds.begin() + td.boundarySize, predictedBoundaryNeighbors[i].begin());
+        }
+    });
+}
+
+void SceneSPHWaterCube::computePredictedDensities(double h){
+    double h2 = h*h;
+    parallelFor(fluidParticles.size(), 1024, [&](int begin, int end, int){
+        for(int i=begin; i<end; i++){
+            const Vec3& x = predictedPositions[i];
+            double density = 0;
+            for(unsigned int j : predictedNeighbors[i]){
+                double r2 = periodicDomain.minimumImage(x-predictedPositions[j]).squaredNorm();
+                if(r2 <= h2) density += fluidParticles[j]->mass*kernels.spiky(r2);
+            }
+            // boundary particles do not move
+            for(unsigned int b : predictedBoundaryNeighbors[i]){
+                double r2 = periodicDomain.minimumImage(x-boundaryParticles[b]->pos).squaredNorm();
+                if(r2 <= h2) density += boundaryPsi[b]*kernels.spiky(r2);
+            }
+            density += boundaryPsiP0*sdfBoundary.volume(SDFBoundary::Spiky,x);
+            fluidParticles[i]->density = density;
+        }
+    });
+}
+
+void SceneSPHWaterCube::computeDFSPHFactors(double h){
+    double h2 = h*h;
+
+    // particles with only a few neighbors near the edge of the kernel get no factor: their
+    // gradients are close to zero and the stiffness they would need changes too fast to warm start
+    double mass = poolParticles.size() ? poolParticles[0]->mass : 0.01;
+    Vec3 latticeGradient;
+    double latticeGradient2;
+    computeLatticeGradients(h,latticeGradient,latticeGradient2);
+    double minDenominator = 0.1*mass*mass*latticeGradient2;
+
+    forEachNeighborhood(h, SPHTile::Positions,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            Vec3 sumGradient(0,0,0);
+            double sumGradient2 = 0;
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                Vec3 gradient = t.mass[k]*kernels.spikyGradient(r,r2);
+                sumGradient += gradient;
+                sumGradient2 += gradient.squaredNorm();
+            }
+            // boundary particles have no factor of their own
+            sumGradient += boundaryGradient(pi->pos,b);
+            double denominator = sumGradient.squaredNorm() + sumGradient2;
+            dfsphAlpha[i] = denominator > minDenominator ? pi->density/denominator : 0;
+        });
+}
+
+void SceneSPHWaterCube::computeDensityChanges(double h){
+    double h2 = h*h;
+    forEachNeighborhood(h, SPHTile::Velocities,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double change = 0;
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                change += t.mass[k]*(pi->vel - Vec3(t.vx[k],t.vy[k],t.vz[k])).dot(kernels.spikyGradient(r,r2));
+            }
+            for(unsigned int k=0; k<b.size; k++){
+                Vec3 r = pi->pos - Vec3(b.x[k],b.y[k],b.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                change += b.mass[k]*(pi->vel - Vec3(b.vx[k],b.vy[k],b.vz[k])).dot(kernels.spikyGradient(r,r2));
+            }
+            change += boundaryPsiP0*pi->vel.dot(sdfBoundary.volumeGradient(SDFBoundary::Spiky,pi->pos));
+            densityChanges[i] = change;
+        });
+}
+
+void SceneSPHWaterCube::applyDFSPHPressure(double h, const QVector<double>& values, double scale, double dt){
+    double h2 = h*h;
+    forEachNeighborhood(h, SPHTile::Densities,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double ki = values[i]*scale/pi->density;
+            Vec3 dv(0,0,0);
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                dv += (ki + values[t.ids[k]]*scale/t.density[k])*t.mass[k]*kernels.spikyGradient(r,r2);
+            }
+            // boundary particles only push back with the pressure of the fluid particle
+            dv += ki*boundaryGradient(pi->pos,b);
+            pi->vel -= dt*dv;
+        });
 }
 
-double getPijMeanDensitySquare(Particle* pi, Particle* pj){
-    return -pj->mass*(pi->pressure/(pi->density*pi->density) + pj->pressure/(pj->density*pj->density));
+void SceneSPHWaterCube::computeIISPHDiagonal(double h, double dt){
+    double h2 = h*h;
+    forEachNeighborhood(h, SPHTile::Positions,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double invDensity2 = 1/(pi->density*pi->density);
+
+            // d a_i/d p_i, boundary particles push with twice the pressure of the fluid particle
+            Vec3 sumGradient(0,0,0);
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                sumGradient += t.mass[k]*kernels.spikyGradient(r,r2);
+            }
+            Vec3 gradientB = boundaryGradient(pi->pos,b);
+            sumGradient += 2*gradientB;
+
+            // a_i moves with -sumGradient/rho_i^2, every fluid neighbor a_j with m_i/rho_i^2 grad W_ij
+            double diagonal = -invDensity2*sumGradient.dot(gradientB);
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                Vec3 gradient = kernels.spikyGradient(r,r2);
+                diagonal -= t.mass[k]*invDensity2*sumGradient.dot(gradient);
+                diagonal -= t.mass[k]*pi->mass*invDensity2*gradient.squaredNorm();
+            }
+            iisphDiagonal[i] = dt*dt*diagonal;
+        });
+}
+
+void SceneSPHWaterCube::relaxIISPHPressures(double h, double dt, double p0, double omega){
+    double h2 = h*h;
+    forEachNeighborhood(h, SPHTile::Positions,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double ap = 0;
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                ap += t.mass[k]*(accelerations[i] - accelerations[t.ids[k]]).dot(kernels.spikyGradient(r,r2));
+            }
+            // boundary particles do not accelerate
+            ap += accelerations[i].dot(boundaryGradient(pi->pos,b));
+            ap *= dt*dt;
+
+            // densityChanges holds the density reached with the advection velocities
+            double residual = p0 - densityChanges[i] - ap;
+            densityErrors[i] = std::max(-residual, 0.0);
+            if(iisphDiagonal[i] != 0)
+                pi->pressure = std::max(pi->pressure + omega*residual/iisphDiagonal[i], 0.0);
+            else
+                pi->pressure = 0;
+        });
+}
+
+void SceneSPHWaterCube::computePBFLambdas(double h, double p0, double relaxation){
+    if(tabulatedKernels) computePBFLambdasWith(poly6Table,spikyTable,h,p0,relaxation);
+    else computePBFLambdasWith(poly6,spiky,h,p0,relaxation);
+}
+
+void SceneSPHWaterCube::computePBFCorrections(double h, double p0){
+    if(tabulatedKernels) computePBFCorrectionsWith(spikyTable,h,p0);
+    else computePBFCorrectionsWith(spiky,h,p0);
+}
+
+template<class Density, class Gradient>
+void SceneSPHWaterCube::computePBFLambdasWith(const Density& w, const Gradient& gradW, double h, double p0, double relaxation){
+    double h2 = h*h;
+    forEachNeighborhood(h, SPHTile::Positions,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            double density = 0;
+            Vec3 gradientI(0,0,0);
+            double sumGradient2 = 0;
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2) continue;
+                density += t.mass[k]*w.value(r2);
+                if(r2 == 0.0) continue;
+                Vec3 gradient = (t.mass[k]/p0*gradW.gradientFactor(r2))*r;
+                gradientI += gradient;
+                sumGradient2 += gradient.squaredNorm();
+            }
+            // boundary particles are not moved by the constraint
+            for(unsigned int k=0; k<b.size; k++){
+                Vec3 r = pi->pos - Vec3(b.x[k],b.y[k],b.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2) continue;
+                density += b.mass[k]*w.value(r2);
+                if(r2 == 0.0) continue;
+                gradientI += (b.mass[k]/p0*gradW.gradientFactor(r2))*r;
+            }
+            density += p0*sdfBoundary.volume(sdfKernel(w),pi->pos);
+            gradientI += sdfBoundary.volumeGradient(sdfKernel(gradW),pi->pos);
+            pi->density = density;
+
+            // only compression is corrected, so the free surface does not clump
+            double constraint = std::max(density/p0 - 1, 0.0);
+            pbfLambda[i] = -constraint/(gradientI.squaredNorm() + sumGradient2 + relaxation);
+            densityErrors[i] = constraint*p0;
+        });
 }
 
-double getPijMeanDensitySquareBoundary(Particle* pi, Particle* pj){
-    return -pj->mass*2*(pi->pressure/(pi->density*pi->density));
+template<class Gradient>
+void SceneSPHWaterCube::computePBFCorrectionsWith(const Gradient& gradW, double h, double p0){
+    double h2 = h*h;
+    forEachNeighborhood(h, SPHTile::Positions,
+        [](unsigned int){ return true; },
+        [&](unsigned int i, const SPHTile& t, const SPHTile& b){
+            Particle *pi = fluidParticles[i];
+            Vec3 correction(0,0,0);
+            for(unsigned int k=0; k<t.size; k++){
+                Vec3 r = pi->pos - Vec3(t.x[k],t.y[k],t.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                correction += ((pbfLambda[i] + pbfLambda[t.ids[k]])*t.mass[k]/p0*gradW.gradientFactor(r2))*r;
+            }
+            // boundary particles mirror the constraint of the fluid particle
+            for(unsigned int k=0; k<b.size; k++){
+                Vec3 r = pi->pos - Vec3(b.x[k],b.y[k],b.z[k]);
+                double r2 = r.squaredNorm();
+                if(r2 > h2 || r2 == 0.0) continue;
+                correction += (2*pbfLambda[i]*b.mass[k]/p0*gradW.gradientFactor(r2))*r;
+            }
+            correction += 2*pbfLambda[i]*sdfBoundary.volumeGradient(sdfKernel(gradW),pi->pos);
+            accelerations[i] = correction;
+        });
 }
 
-Vec3 getVijMeanDensitySquare(Particle* pi, Particle* pj){
-    return -pj->mass/pj->density*(pj->vel-pi->vel)/pi->density;
+QStringList SceneSPHWaterCube::getOverlayLines() {
+    QStringList lines = neighborTuner.overlayLines();
+    if(!solverReport.isEmpty()) lines << solverReport;
+    if(widget->getSPHMethod() == SPHMethod::IterativeWeaklyCompressible) lines << convergenceLog.overlayLine();
+    if(widget->getSleeping()) lines << sleepTracker.overlayLine();
+    if(mixedPrecision && !precisionReport.isEmpty()) lines << precisionReport;
+    if(widget->getSurfaceMesh()) lines << surface.overlayLine();
+    if(widget->getInflow()) lines << "Inflow:  " + QString::number(numEmitted) + " emitted, " + QString::number(numDrained)
+                                     + " drained, " + QString::number(particlePool.getNumParked()) + " left in the pool";
+    if(widget->getAdaptiveResolution()){
+        adaptive.count(fluidParticles);
+        lines << adaptive.overlayLine();
+    }
+    return lines;
 }
 
 void SceneSPHWaterCube::update() {
@@ -735,51 +1929,129 @@ void SceneSPHWaterCube::update() {
     c = widget->getC()*dt; //20.04757082400839/s;
     k = widget->getK()*dt; //20.04757082400839/s;
 
-    hash->create(system.getParticles());
+    if(widget->getNeighborSearch() == NeighborSearchType::UniformGrid){
+        // the grid follows the container when it is dragged around
+        grid->setOrigin(colliderCube.pos-colliderCube.scale);
+        neighbors = grid;
+    } else if(widget->getNeighborSearch() == NeighborSearchType::ExactSpatialHash){
+        cellHash->resetStats();
+        neighbors = cellHash;
+    } else {
+        neighbors = hash;
+    }
 
-    if(widget->getSPHMethod() == SPHMethod::FullyCompressible){
-        double h = sqrt(water_radius*water_radius*4.f + water_radius*water_radius*4.f)*widget->getHReduction();
-        double p0 = widget->getRestDensity();
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::Boundary) continue; // not necessary to calculate density nor pressure for boundary particles
-            // find neighbors
-            hash->query(pi->pos,h);
-
-            // calculate density
-            pi->density = 0.f;
-            for(unsigned int nr=0; nr<hash->querySize;nr++){
-                Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                double k = getKernelFunctionSpiky(pi->pos-pj->pos,h);
-                if(k) pi->density += pj->mass*k;
+    // the periodic domain follows the container, the fluid that left it through a side comes
+    // back through the opposite one before it is binned
+    periodicDomain.setOrigin(colliderCube.pos-colliderCube.scale);
+    neighbors->setPeriodic(periodicDomain);
+    wrapParticles();
+
+    // the tap and the drain change the fluid before it is binned. Not with adaptive resolution,
+    // merging deletes particles instead of parking them
+    bool inflow = widget->getInflow() && !variableH &&
+                  !(widget->getAdaptiveResolution() && widget->getSPHMethod() <= SPHMethod::IterativeWeaklyCompressible);
+    if(inflow) emitAndDrain(dt,widget->getRestDensity());
+
+    // every thread of the pool gets its own query buffer and tile, large enough for the whole
+    // reserve of the tap
+    pool.setNumThreads(widget->getNumThreads());
+    threadData.resize(pool.getNumThreads());
+    int maxParticles = int(system.getNumParticles()) + particlePool.getNumParked();
+    for(SPHThreadData& td : threadData){
+        if(td.queryIds.size() < maxParticles) td.queryIds.resize(maxParticles);
+        if(td.boundaryIds.size() < boundaryParticles.size()) td.boundaryIds.resize(boundaryParticles.size());
+    }
+
+    // PBF searches the neighbors around the predicted positions
+    if(widget->getSPHMethod() == SPHMethod::PBF){
+        parallelFor(system.getNumParticles(), 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = system.getParticles()[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                pi->vel += dt*fGravity->getAcceleration();
+                pi->prevPos = pi->pos;
+                pi->pos += dt*pi->vel;
             }
+        });
+        wrapParticles();
+    }
 
-            // calculate pressure
-            pi->pressure = getPressureFunctionSound(pi->density,p0);
-        }
+    // the grid solvers do not look for SPH neighbors
+    bool hybrid = widget->getSPHMethod() == SPHMethod::FLIP || widget->getSPHMethod() == SPHMethod::APIC;
+
+    // the tuner measures this step with the current parameters, and changes them only when enabled
+    double h = sqrt(water_radius*water_radius*4.f + water_radius*water_radius*4.f)*widget->getHReduction();
+    kernels.setH(h);
+    spiky.setH(h);
+    poly6.setH(h);
+    cubicSpline.setH(h);
+    tabulatedKernels = widget->getTabulatedKernels();
+    mixedPrecision = widget->getMixedPrecision();
+    if(tabulatedKernels){
+        spikyTable.setH(h);
+        poly6Table.setH(h);
+        cubicSplineTable.setH(h);
+        viscosityTable.setH(h);
+    }
+    if(!hybrid){
+        neighborTuner.setEnabled(widget->getTuneNeighborSearch());
+        neighborTuner.beginStep(neighbors,h,fluidParticles.size());
+        neighbors->create(fluidParticles);
+        neighborTuner.endBuild();
+    }
 
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::Boundary) continue; // not necessary to calculate accel_pressure for boundary particles
-            // find neighbors
-            hash->query(pi->pos,h);
-
-            Vec3 a_pressure = Vec3(0.f,0.f,0.f);
-            for(unsigned int nr=0; nr<hash->querySize;nr++){
-                Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                if(pi->id != pj->id){
-                    double p_ij;
-                    if(pj->type == ParticleType::Boundary){
-                         p_ij = 0.f;//getPijMeanDensitySquareBoundary(pi,pj);
-                    } else {
-                        p_ij = getPijMeanDensitySquare(pi,pj);
-                    }
-                    Vec3 k = getKernelFunctionGradientSpiky(pi->pos-pj->pos,h);
-                    if(k != Vec3(0.f,0.f,0.f)) a_pressure += p_ij*k;
-                }
+    // every pass reads the state left by the previous one and writes its results to
+    // accelerations, which are applied once the pass is over for all particles
+    double v = widget->getKinematicViscosity();
+    double p0 = widget->getRestDensity();
+    solverReport.clear();
+
+    // PBF keeps Poly6 for its densities and the pressure solvers Spiky, which their own passes
+    // use. The variable h passes only have Spiky
+    bool adaptiveOn = widget->getAdaptiveResolution() && widget->getSPHMethod() <= SPHMethod::IterativeWeaklyCompressible;
+    if(widget->getSPHMethod() == SPHMethod::PBF) densityKernel = SPHDensityKernel::Poly6Density;
+    else if(widget->getSPHMethod() <= SPHMethod::IterativeWeaklyCompressible && !adaptiveOn && !variableH) densityKernel = widget->getDensityKernel();
+    else densityKernel = SPHDensityKernel::SpikyDensity;
+
+    // the boundary is only binned again when the container moves
+    if(!hybrid) updateBoundary(h,p0,densityKernel);
+
+    // settled particles sleep with the compressible methods, the pressure solvers couple them all
+    // calm: moving less than 1% of h per step, with the density changing less than 0.5%
+    bool sleeping = widget->getSleeping() && widget->getSPHMethod() <= SPHMethod::IterativeWeaklyCompressible;
+    sleepTracker.setThresholds(0.01*h/dt,0.005,10);
+
+    // merging and splitting every few steps, also only with the compressible methods: the
+    // pressure solvers and the grid transfers assume equal masses, so they get level 0 back
+    if(variableH) updateSmoothingLengths(h);
+    if(adaptResolution(h,adaptiveOn)){
+        sleepTracker.reset(fluidParticles,p0);
+        dfsphKappa.clear();
+        dfsphKappaV.clear();
+        iwcsphPressure.clear();
+    }
+    wakeParticles(h,sleeping);
+
+    // the mixed precision sums are checked against the double ones every few steps, at the
+    // state the passes start from
+    if(mixedPrecision && !hybrid && !variableH && ++stepsSincePrecisionCheck >= precisionCheckInterval){
+        stepsSincePrecisionCheck = 0;
+        measureMixedPrecision(h);
+    }
+
+    if(widget->getSPHMethod() == SPHMethod::FullyCompressible){
+        // density and pressure
+        computeDensities(h,p0,true);
+
+        // pressure acceleration, boundary particles do not push
+        computePressureAccelerations(h,false);
+        parallelFor(system.getNumParticles(), 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = system.getParticles()[i];
+                if(pi->type == ParticleType::Boundary || pi->asleep) continue;
+                fSPHSystem[i]->setForce(pi->mass*accelerations[i]);
             }
-            fSPHSystem[i]->setForce(pi->mass*a_pressure);
-        }
+        });
 
         // integration step
         Vecd ppos = system.getPositions();
@@ -788,182 +2060,470 @@ void SceneSPHWaterCube::update() {
     } else if (widget->getSPHMethod() == SPHMethod::WeaklyCompressible){
 
         // 1. for all particle i reconstruct density pi
-        double h = sqrt(water_radius*water_radius*4.f + water_radius*water_radius*4.f)*widget->getHReduction();
-        double v = widget->getKinematicViscosity();
-        double p0 = widget->getRestDensity();
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::NotBoundary){
-                // find neighbors
-                hash->query(pi->pos,h);
-
-                // calculate density
-                pi->density = 0.f;
-                for(unsigned int nr=0; nr<hash->querySize;nr++){
-                    Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                    double k = getKernelFunctionSpiky(pi->pos-pj->pos,h);
-                    if(k) pi->density += pj->mass*k;
-                }
-                pi->pressure = getPressureFunctionStateEquation(pi->density,p0);
-            }
-        }
+        computeDensities(h,p0,false);
 
         // 2. for all particle i compute viscocity and predicted velocity
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::NotBoundary){
-                // find neighbors
-                hash->query(pi->pos,h);
-
-                Vec3 laplacian_velocity = Vec3(0.f,0.f,0.f);
-                for(unsigned int nr=0; nr<hash->querySize;nr++){
-                    Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                    if(pi->id != pj->id){
-                        Vec3 v_ij = getVijMeanDensitySquare(pi,pj);
-                        double k = getKernelFunctionLaplacianViscosity(pi->pos-pj->pos,h);
-                        //double k = getKernelFunctionLaplacianViscosityImproved(pi->pos-pj->pos,h);
-                        if(k) laplacian_velocity += v_ij*k;
-                    }
-                }
-                Vec3 aSPHViscosity = v*laplacian_velocity;
-                pi->vel += dt*(aSPHViscosity+fGravity->getAcceleration());
+        computeViscosityAccelerations(h,v);
+        parallelFor(system.getNumParticles(), 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = system.getParticles()[i];
+                if(pi->type == ParticleType::Boundary || pi->asleep) continue;
+                pi->vel += dt*(accelerations[i]+fGravity->getAcceleration());
             }
-        }
+        });
 
         // 3. for all particle i compute pressure
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            // find neighbors
-            hash->query(pi->pos,h);
-            if(pi->type == ParticleType::NotBoundary){
-                Vec3 a_pressure = Vec3(0.f,0.f,0.f);
-                for(unsigned int nr=0; nr<hash->querySize;nr++){
-                    Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                    if(pi->id != pj->id){
-                        double p_ij;
-                        if(pj->type == ParticleType::Boundary){
-                             p_ij = getPijMeanDensitySquareBoundary(pi,pj);
-                        } else {
-                            p_ij = getPijMeanDensitySquare(pi,pj);
-                        }
-                        Vec3 k = getKernelFunctionGradientSpiky(pi->pos-pj->pos,h);
-                        //Vec3 k = getKernelFunctionGradientCubicSpline(pi->pos-pj->pos,h);
-                        if(k != Vec3(0.f,0.f,0.f)) a_pressure += p_ij*k;
-                    }
-                }
-                    pi->vel += dt*(a_pressure);
-                    pi->prevPos = pi->pos;
-                    pi->pos += dt*pi->vel;
+        computePressureAccelerations(h,true);
+        parallelFor(system.getNumParticles(), 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = system.getParticles()[i];
+                if(pi->type == ParticleType::Boundary || pi->asleep) continue;
+                pi->vel += dt*accelerations[i];
+                pi->prevPos = pi->pos;
+                pi->pos += dt*pi->vel;
             }
-        }
+        });
     } else if (widget->getSPHMethod() == SPHMethod::IterativeWeaklyCompressible){
-
-        double h = sqrt(water_radius*water_radius*4.f + water_radius*water_radius*4.f)*widget->getHReduction();
-        double v = widget->getKinematicViscosity();
-        double p0 = widget->getRestDensity();
-        // 1. for all particle i compute non-pressure accel
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::NotBoundary){
-                // find neighbors
-                hash->query(pi->pos,h);
-
-                // calculate density
-                pi->density = 0.f;
-                for(unsigned int nr=0; nr<hash->querySize;nr++){
-                    Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                    double k = getKernelFunctionSpiky(pi->pos-pj->pos,h);
-                    if(k) pi->density += pj->mass*k;
+        const int numFluid = fluidParticles.size();
+        predictedPositions.resize(numFluid);
+        densityErrors.resize(numFluid);
+        // warm start with half the pressures of the previous step, the full ones overshoot on impacts
+        if(iwcsphPressure.size() != numFluid) iwcsphPressure.fill(0.0, numFluid);
+        for(double& pressure : iwcsphPressure) pressure *= 0.5;
+        auto awake = [&](int i){ return !fluidParticles[i]->asleep; };
+        auto setPressures = [&](){
+            parallelFor(numFluid, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) if(awake(i)) fluidParticles[i]->pressure = iwcsphPressure[i];
+            });
+        };
+
+        // 1. non-pressure accelerations
+        computeDensities(h,p0,false);
+        computeViscosityAccelerations(h,v);
+        parallelFor(numFluid, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = fluidParticles[i];
+                predictedPositions[i] = pi->pos;
+                if(awake(i)) pi->vel += dt*(accelerations[i]+fGravity->getAcceleration());
+            }
+        });
+
+        // 2. every iteration moves the fluid to x + dt (v + dt a_p) to measure the densities there,
+        // and adds the state equation of the compression left, k (rho/rho0 - 1), to the pressures,
+        // until the average compression is below the tolerance. The last measure updates the
+        // pressures too, so the warm start is corrected even when it converges right away.
+        // k is bounded by the PCISPH step, the pressure that removes the error of a filled
+        // neighborhood in one iteration: a stiffer update overshoots and the iterations diverge
+        double tolerance = widget->getDensityErrorTolerance();
+        int maxIterations = widget->getMaxIterations();
+        double kIteration = std::min(k, computePCISPHDelta(h,p0,dt)*p0);
+        convergenceLog.beginStep(tolerance);
+        setPressures();
+        computePressureAccelerations(h,true);
+
+        int iterations = 0;
+        double avgError = 0, maxError = 0;
+        bool diverged = false;
+        while(iterations < maxIterations){
+            QElapsedTimer timer;
+            timer.start();
+            parallelFor(numFluid, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    Particle *pi = fluidParticles[i];
+                    if(awake(i)) pi->pos = predictedPositions[i] + dt*(pi->vel + dt*accelerations[i]);
                 }
-                pi->pressure = getPressureFunctionStateEquation(pi->density,p0);
+            });
+            computeDensities(h,p0,false);
+            parallelFor(numFluid, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    Particle *pi = fluidParticles[i];
+                    pi->pos = predictedPositions[i];
+                    densityErrors[i] = awake(i) ? std::max(pi->density/p0 - 1, 0.0) : 0.0;
+                }
+            });
+            iterations++;
+
+            // serial sums, the same whatever the number of threads
+            int numAwake = 0;
+            avgError = 0;
+            maxError = 0;
+            for(int i=0; i<numFluid; i++){
+                numAwake += awake(i);
+                avgError += densityErrors[i];
+                maxError = std::max(maxError, densityErrors[i]);
+            }
+            avgError /= std::max(numAwake,1);
+            if(!std::isfinite(avgError)){
+                convergenceLog.addIteration(avgError, maxError, 1e-6*double(timer.nsecsElapsed()));
+                diverged = true;
+                break;
             }
+
+            // the pressures stay positive, the free surface is left alone. The pressure accelerations
+            // then divide by rho^2 at least the rest density, as the PCISPH step does: a particle
+            // predicted alone at the surface, or further than the cells it was binned in where it
+            // does not even find itself, would be thrown out
+            parallelFor(numFluid, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    if(!awake(i)) continue;
+                    Particle *pi = fluidParticles[i];
+                    iwcsphPressure[i] = std::max(iwcsphPressure[i] + kIteration*(pi->density/p0 - 1), 0.0);
+                    pi->density = std::max(pi->density, float(p0));
+                }
+            });
+            setPressures();
+            computePressureAccelerations(h,true);
+            convergenceLog.addIteration(avgError, maxError, 1e-6*double(timer.nsecsElapsed()));
+            if(avgError <= tolerance) break;
         }
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::NotBoundary){
-                // find neighbors
-                hash->query(pi->pos,h);
-
-                Vec3 laplacian_velocity = Vec3(0.f,0.f,0.f);
-                for(unsigned int nr=0; nr<hash->querySize;nr++){
-                    Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                    if(pi->id != pj->id){
-                        Vec3 v_ij = getVijMeanDensitySquare(pi,pj);
-                        double k = getKernelFunctionLaplacianViscosity(pi->pos-pj->pos,h);
-                        //double k = getKernelFunctionLaplacianViscosityImproved(pi->pos-pj->pos,h);
-                        if(k) laplacian_velocity += v_ij*k;
-                    }
+        solverReport = "IWCSPH: " + QString::number(iterations) + " iterations, error "
+                     + QString::number(100*avgError, 'f', 3) + "% (max " + QString::number(100*maxError, 'f', 2) + "%), k "
+                     + QString::number(kIteration, 'g', 3);
+
+        // the step goes on without pressures rather than with the ones that blew up, and the
+        // next one starts cold. The densities are measured again where the particles are
+        if(diverged){
+            iwcsphPressure.fill(0.0);
+            computeDensities(h,p0,false);
+            setPressures();
+            accelerations.fill(Vec3(0,0,0));
+            solverReport += ", diverged";
+        }
+
+        // 3. integrate with the last pressure accelerations
+        parallelFor(numFluid, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = fluidParticles[i];
+                if(!awake(i)) continue;
+                pi->vel += dt*accelerations[i];
+                pi->prevPos = pi->pos;
+                pi->pos += dt*pi->vel;
+            }
+        });
+    } else if (widget->getSPHMethod() == SPHMethod::PCISPH){
+        const QVector<Particle*>& parts = system.getParticles();
+        int n = parts.size();
+        predictedPositions.resize(n);
+        nonPressureAccelerations.resize(n);
+        pressureAccelerations.resize(n);
+        densityErrors.resize(n);
+
+        // 1. non-pressure accelerations, pressures start from zero
+        computeDensities(h,p0,false);
+        computeViscosityAccelerations(h,v);
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                nonPressureAccelerations[i] = accelerations[i]+fGravity->getAcceleration();
+                pressureAccelerations[i] = Vec3(0,0,0);
+                predictedPositions[i] = parts[i]->pos;
+                densityErrors[i] = 0;
+                if(parts[i]->type == ParticleType::NotBoundary) parts[i]->pressure = 0;
+            }
+        });
+
+        // 2. predict, correct the pressures with the predicted density error until the average
+        // error is below the tolerance. The neighbors of the predicted densities are searched
+        // once for all the iterations
+        findPredictedNeighbors(h);
+        double delta = computePCISPHDelta(h,p0,dt);
+        double tolerance = widget->getDensityErrorTolerance();
+        int maxIterations = widget->getMaxIterations();
+        int numFluid = 0;
+        for(const Particle* pi : parts) numFluid += pi->type == ParticleType::NotBoundary;
+
+        int iterations = 0;
+        double avgError = 0;
+        while(iterations < maxIterations){
+            parallelFor(n, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    Particle *pi = parts[i];
+                    if(pi->type == ParticleType::Boundary) continue;
+                    Vec3 vel = pi->vel + dt*(nonPressureAccelerations[i]+pressureAccelerations[i]);
+                    predictedPositions[i] = pi->pos + dt*vel;
+                }
+            });
+
+            computePredictedDensities(h);
+            parallelFor(n, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    Particle *pi = parts[i];
+                    if(pi->type == ParticleType::Boundary) continue;
+                    // only compression is corrected, the free surface is left alone
+                    double error = pi->density-p0;
+                    pi->pressure = std::max(pi->pressure + delta*error, 0.0);
+                    densityErrors[i] = std::max(error, 0.0);
                 }
-                Vec3 aSPHViscosity = v*laplacian_velocity;
-                pi->vel += dt*(aSPHViscosity+fGravity->getAcceleration());
+            });
+
+            computePressureAccelerations(h,true);
+            std::swap(accelerations,pressureAccelerations);
+            iterations++;
+
+            // serial sum, the same whatever the number of threads
+            avgError = 0;
+            for(int i=0; i<n; i++) avgError += densityErrors[i];
+            avgError /= std::max(numFluid,1)*p0;
+            if(iterations >= 3 && avgError <= tolerance) break;
+        }
+        solverReport = "PCISPH: " + QString::number(iterations) + " iterations, error "
+                     + QString::number(100*avgError, 'f', 3) + "%";
+
+        // 3. integrate with the corrected pressure accelerations
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                pi->vel += dt*(nonPressureAccelerations[i]+pressureAccelerations[i]);
+                pi->prevPos = pi->pos;
+                pi->pos += dt*pi->vel;
             }
+        });
+    } else if (widget->getSPHMethod() == SPHMethod::DFSPH){
+        const QVector<Particle*>& parts = system.getParticles();
+        int n = parts.size();
+        if(dfsphKappa.size() != n){
+            dfsphKappa.fill(0.0, n);
+            dfsphKappaV.fill(0.0, n);
         }
-
-        // 2. for all particle i iterate  until density i similar to density 0, or iter_max
-        int iter_max = 0;
-        while(iter_max<5){
-            iter_max++;
-            for(int i=0; i<system.getNumParticles();i++) {
-                Particle *pi = system.getParticles()[i];
-                if(pi->type == ParticleType::NotBoundary){
-                    if(pi->density-p0<0.0001) continue; // if density is similiar to density 0 it should stop too
-                    // find neighbors
-                    hash->query(pi->pos,h);
-
-                    // calculate density
-                    pi->density = 0.f;
-                    for(unsigned int nr=0; nr<hash->querySize;nr++){
-                        Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                        double k = getKernelFunctionSpiky(pi->pos-pj->pos,h);
-                        if(k) pi->density += pj->mass*k;
+        dfsphAlpha.fill(0.0, n);
+        dfsphStep.fill(0.0, n);
+        densityChanges.fill(0.0, n);
+        densityErrors.fill(0.0, n);
+
+        double tolerance = widget->getDensityErrorTolerance();
+        int maxIterations = widget->getMaxIterations();
+        int numFluid = 0;
+        for(const Particle* pi : parts) numFluid += pi->type == ParticleType::NotBoundary;
+
+        // Jacobi iterations of one of the two solves. residual(i) is the density change to cancel
+        // for particle i, only compression is corrected and the error is the mean positive residual
+        // times errorScale. values holds the sum of the factors of the previous step, applied first
+        // to the particles that are compressed again, and then the sum of this step
+        auto solve = [&](QVector<double>& values, double scale, double errorScale, int minIterations,
+                         const std::function<double(int)>& residual) -> std::pair<int,double> {
+            computeDensityChanges(h);
+            parallelFor(n, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++){
+                    dfsphStep[i] = parts[i]->type == ParticleType::NotBoundary && residual(i) > 0 ? values[i] : 0;
+                    values[i] = 0;
+                }
+            });
+            applyDFSPHPressure(h,dfsphStep,scale,dt);
+
+            int iterations = 0;
+            double avgError = 0;
+            while(true){
+                computeDensityChanges(h);
+                parallelFor(n, 1024, [&](int begin, int end, int){
+                    for(int i=begin; i<end; i++){
+                        if(parts[i]->type == ParticleType::Boundary) continue;
+                        double r = residual(i);
+                        densityErrors[i] = std::max(r, 0.0)*errorScale;
+                        dfsphStep[i] = std::max(r, 0.0)*dfsphAlpha[i];
                     }
-                    pi->pressure = getPressureFunctionStateEquation(pi->density,p0);
+                });
+
+                // serial sum, the same whatever the number of threads
+                avgError = 0;
+                for(int i=0; i<n; i++) avgError += densityErrors[i];
+                avgError /= std::max(numFluid,1)*p0;
+                if((iterations >= minIterations && avgError <= tolerance) || iterations >= maxIterations) break;
+
+                parallelFor(n, 1024, [&](int begin, int end, int){
+                    for(int i=begin; i<end; i++) values[i] += dfsphStep[i];
+                });
+                applyDFSPHPressure(h,dfsphStep,scale,dt);
+                iterations++;
+            }
+            return std::make_pair(iterations, avgError);
+        };
+
+        // 1. densities and factors at the current positions
+        computeDensities(h,p0,false);
+        computeDFSPHFactors(h);
+
+        // 2. divergence-free solve, kappa_v = D rho/Dt alpha/dt
+        auto divergence = solve(dfsphKappaV, 1/dt, dt, 1, [&](int i){
+            return densityChanges[i];
+        });
+
+        // 3. non-pressure accelerations
+        computeViscosityAccelerations(h,v);
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                pi->vel += dt*(accelerations[i]+fGravity->getAcceleration());
+            }
+        });
+
+        // 4. constant density solve on the predicted densities rho_i + dt D rho_i/Dt,
+        // kappa = (rho* - rho0) alpha/dt^2
+        auto density = solve(dfsphKappa, 1/(dt*dt), 1, 2, [&](int i){
+            return parts[i]->density + dt*densityChanges[i] - p0;
+        });
+        solverReport = "DFSPH: " + QString::number(density.first) + "+" + QString::number(divergence.first)
+                     + " iterations, error " + QString::number(100*density.second, 'f', 3) + "% / "
+                     + QString::number(100*divergence.second, 'f', 3) + "%";
+
+        // 5. positions
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                pi->prevPos = pi->pos;
+                pi->pos += dt*pi->vel;
+            }
+        });
+    } else if (widget->getSPHMethod() == SPHMethod::PBF){
+        const QVector<Particle*>& parts = system.getParticles();
+        int n = parts.size();
+        pbfLambda.fill(0.0, n);
+        densityErrors.fill(0.0, n);
+        accelerations.fill(Vec3(0,0,0), n);
+
+        // constraint force mixing, a small fraction of the gradients of a filled neighborhood
+        double mass = poolParticles.size() ? poolParticles[0]->mass : 0.01;
+        Vec3 latticeGradient;
+        double latticeGradient2;
+        computeLatticeGradients(h,latticeGradient,latticeGradient2);
+        double relaxation = 0.01*mass*mass/(p0*p0)*latticeGradient2;
+
+        int numFluid = 0;
+        for(const Particle* pi : parts) numFluid += pi->type == ParticleType::NotBoundary;
+
+        // 1. a few Jacobi iterations on the density constraints, positions are already predicted
+        int iterations = widget->getMaxIterations();
+        double avgError = 0;
+        for(int it=0; it<iterations; it++){
+            computePBFLambdas(h,p0,relaxation);
+
+            avgError = 0;
+            for(int i=0; i<n; i++) avgError += densityErrors[i];
+            avgError /= std::max(numFluid,1)*p0;
+
+            computePBFCorrections(h,p0);
+            parallelFor(n, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    if(parts[i]->type == ParticleType::Boundary) continue;
+                    parts[i]->pos += accelerations[i];
                 }
+            });
+        }
+        solverReport = "PBF: " + QString::number(iterations) + " iterations, error "
+                     + QString::number(100*avgError, 'f', 3) + "%";
+
+        // 2. velocities from the displacement, smoothed by the viscosity
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                pi->vel = (pi->pos - pi->prevPos)/dt;
             }
-            for(int i=0; i<system.getNumParticles();i++) {
-                Particle *pi = system.getParticles()[i];
-                // find neighbors
-                hash->query(pi->pos,h);
-                if(pi->type == ParticleType::NotBoundary){
-                    if(pi->density-p0<0.0001) continue; // if density is similiar to density 0 it should stop too
-                    Vec3 a_pressure = Vec3(0.f,0.f,0.f);
-                    for(unsigned int nr=0; nr<hash->querySize;nr++){
-                        Particle *pj = system.getParticles()[hash->queryIds[nr]];
-                        if(pi->id != pj->id){
-                            double p_ij;
-                            if(pj->type == ParticleType::Boundary){
-                                 p_ij = getPijMeanDensitySquareBoundary(pi,pj);
-                            } else {
-                                p_ij = getPijMeanDensitySquare(pi,pj);
-                            }
-                            Vec3 k = getKernelFunctionGradientSpiky(pi->pos-pj->pos,h);
-                            //Vec3 k = getKernelFunctionGradientCubicSpline(pi->pos-pj->pos,h);
-                            if(k != Vec3(0.f,0.f,0.f)) a_pressure += p_ij*k;
-                        }
-                    }
-                        pi->vel += dt*(a_pressure);
+        });
+        if(v > 0){
+            computeViscosityAccelerations(h,v);
+            parallelFor(n, 1024, [&](int begin, int end, int){
+                for(int i=begin; i<end; i++) {
+                    if(parts[i]->type == ParticleType::Boundary) continue;
+                    parts[i]->vel += dt*accelerations[i];
                 }
+            });
+        }
+    } else if (widget->getSPHMethod() == SPHMethod::IISPH){
+        const QVector<Particle*>& parts = system.getParticles();
+        int n = parts.size();
+        iisphDiagonal.fill(0.0, n);
+        if(iisphPressure.size() != n) iisphPressure.fill(0.0, n);
+        densityChanges.fill(0.0, n);
+        densityErrors.fill(0.0, n);
+
+        double tolerance = widget->getDensityErrorTolerance();
+        int maxIterations = widget->getMaxIterations();
+        int numFluid = 0;
+        for(const Particle* pi : parts) numFluid += pi->type == ParticleType::NotBoundary;
+
+        // 1. densities, advection velocities and the density they lead to
+        computeDensities(h,p0,false);
+        computeViscosityAccelerations(h,v);
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                pi->vel += dt*(accelerations[i]+fGravity->getAcceleration());
             }
+        });
+        computeDensityChanges(h);
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                densityChanges[i] = pi->density + dt*densityChanges[i];
+                // warm start with half the pressure of the previous step, the density pass has
+                // just replaced the one of the particle with the state equation
+                pi->pressure = 0.5*iisphPressure[i];
+            }
+        });
+        computeIISPHDiagonal(h,dt);
+
+        // 2. relaxed Jacobi on the pressure Poisson equation until the average predicted
+        // compression is below the tolerance
+        const double omega = 0.5;
+        int iterations = 0;
+        double avgError = 0;
+        while(iterations < maxIterations){
+            computePressureAccelerations(h,true);
+            relaxIISPHPressures(h,dt,p0,omega);
+            iterations++;
+
+            // serial sum, the same whatever the number of threads
+            avgError = 0;
+            for(int i=0; i<n; i++) avgError += densityErrors[i];
+            avgError /= std::max(numFluid,1)*p0;
+            if(iterations >= 2 && avgError <= tolerance) break;
         }
-
-
-        // 3. for all particle i update pos
-        for(int i=0; i<system.getNumParticles();i++) {
-            Particle *pi = system.getParticles()[i];
-            if(pi->type == ParticleType::NotBoundary){
+        solverReport = "IISPH: " + QString::number(iterations) + " iterations, error "
+                     + QString::number(100*avgError, 'f', 3) + "%";
+
+        // 3. pressure accelerations of the final pressures and positions, the pressures are kept
+        // for the next step
+        computePressureAccelerations(h,true);
+        parallelFor(n, 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = parts[i];
+                if(pi->type == ParticleType::Boundary) continue;
+                iisphPressure[i] = pi->pressure;
+                pi->vel += dt*accelerations[i];
                 pi->prevPos = pi->pos;
                 pi->pos += dt*pi->vel;
             }
-        }
+        });
+    } else if (hybrid){
+        // cells of twice the spawn spacing, about 8 particles each, over the container
+        flip.setPool(&pool, ThreadPool::Schedule(widget->getSchedule()));
+        flip.setBounds(colliderCube.pos-colliderCube.scale, colliderCube.pos+colliderCube.scale, 4*water_radius);
+        flip.setTolerance(widget->getDensityErrorTolerance(), widget->getMaxIterations());
+        FlipSolver::Transfer transfer = widget->getSPHMethod() == SPHMethod::APIC ? FlipSolver::APIC : FlipSolver::FLIP;
+        flip.step(system.getParticles(), fGravity->getAcceleration(), dt, transfer, 0.95);
+        solverReport = QString(transfer == FlipSolver::APIC ? "APIC: " : "FLIP: ")
+                     + QString::number(flip.getNumFluidCells()) + " fluid cells, "
+                     + QString::number(flip.getIterations()) + " iterations, residual "
+                     + QString::number(flip.getResidual(), 'e', 2);
     }
+    if(!hybrid) neighborTuner.endStep();
 
 
 
 
-    // collisions
+    // collisions, a periodic domain only keeps the floor and the lid of the container
+    const bool periodic = periodicDomain.any();
+    Vec3 planesN[6];
+    double planesD[6];
+    colliderCube.getPlanes(planesN,planesD);
+    const ColliderPlane containerLid(planesN[2],planesD[2]), containerFloor(planesN[3],planesD[3]);
     for (int i=0; i<system.getNumParticles();i++) {
         Particle* pi = system.getParticles()[i];
-        if(pi->type == ParticleType::Boundary) continue;
+        if(pi->type == ParticleType::Boundary || pi->asleep) continue;
         // Floor collider
         if (colliderFloor.testCollision(pi)) {
             colliderFloor.resolveCollision(pi, bouncing, friction, dt);
@@ -973,6 +2533,12 @@ void SceneSPHWaterCube::update() {
             colliderSphere.resolveCollision(pi, bouncing, friction, dt);
         }
 
+        if (periodic) {
+            if (containerFloor.testCollision(pi)) containerFloor.resolveCollision(pi, bouncing, friction, dt);
+            if (containerLid.testCollision(pi)) containerLid.resolveCollision(pi, bouncing, friction, dt);
+            continue;
+        }
+
         // AABB collider: 3 times in case of corners
         if (colliderCube.testCollision(pi)) {
             colliderCube.resolveCollision(pi, bouncing, friction, dt);
@@ -984,6 +2550,37 @@ void SceneSPHWaterCube::update() {
             colliderCube.resolveCollision(pi, bouncing, friction, dt);
         }
     }
+
+    // the particles that stayed calm long enough fall asleep, only the slow ones need their
+    // neighbors counted to know whether they rest within the fluid
+    if(sleeping){
+        parallelFor(fluidParticles.size(), 1024, [&](int begin, int end, int){
+            for(int i=begin; i<end; i++) {
+                Particle *pi = fluidParticles[i];
+                if(!pi->asleep && !sleepTracker.isSlow(pi)) sleepTracker.update(pi,i,pi->density);
+            }
+        });
+        double h2 = h*h;
+        forEachNeighborhood(h, SPHTile::Positions,
+            [&](unsigned int i){ return !fluidParticles[i]->asleep && sleepTracker.isSlow(fluidParticles[i]); },
+            [&](unsigned int i, const SPHTile& t, const SPHTile&){
+                Particle *pi = fluidParticles[i];
+                int numNeighbors = 0;
+                for(unsigned int k=0; k<t.size; k++)
+                    numNeighbors += (pi->pos - Vec3(t.x[k],t.y[k],t.z[k])).squaredNorm() <= h2;
+                sleepTracker.update(pi,i,pi->density,numNeighbors > minSleepNeighbors);
+            });
+        sleepTracker.count(fluidParticles);
+    }
+
+    // the mesh of the previous step is drawn while the one of this step is built
+    if(widget->getSurfaceMesh()){
+        if(surface.takeMesh(surfaceMesh)) surfaceMeshChanged = true;
+        surface.setNumThreads(widget->getNumThreads());
+        std::vector<Vec3> positions(fluidParticles.size());
+        for(int i=0; i<fluidParticles.size(); i++) positions[i] = fluidParticles[i]->pos;
+        surface.submit(std::move(positions));
+    }
 }
 
 void SceneSPHWaterCube::mousePressed(const QMouseEvent* e, const Camera&)
@@ -1023,15 +2620,19 @@ void SceneSPHWaterCube::mouseMoved(const QMouseEvent* e, const Camera& cam)
         switch(widget->getMovableObjectId()) {
         case 0:
             colliderSphere.sphereC += disp;
+            sphereMoved = true;
             break;
         case 1:
             colliderCube.pos += disp;
             for(Particle* pi: system.getParticles()){
                 pi->pos += disp;
             }
+            boundaryMoved = true;
+            wakeEverything = true;
             break;
         case 2:
             fBlackhole->position += disp;
+            wakeEverything = true;
             break;
         }
     }
@@ -1047,6 +2648,8 @@ void SceneSPHWaterCube::keyPressed(const QKeyEvent * e, const Camera& cam)
         for(Particle* pi: system.getParticles()){
             pi->pos += disp;
         }
+        boundaryMoved = true;
+        wakeEverything = true;
     }
     if(keysPressed.contains(Qt::Key_S)){
         Vec3 disp = Vec3(0.f,0.f, 0.4f);
@@ -1054,18 +2657,24 @@ void SceneSPHWaterCube::keyPressed(const QKeyEvent * e, const Camera& cam)
         for(Particle* pi: system.getParticles()){
             pi->pos += disp;
         }
+        boundaryMoved = true;
+        wakeEverything = true;
     }
     if(keysPressed.contains(Qt::Key_A)){
         Vec3 disp = Vec3(0.3f,0.f, 0.f);
         for(Particle* pi: system.getParticles()){
             pi->pos += disp;
         }
+        boundaryMoved = true;
+        wakeEverything = true;
     }
     if(keysPressed.contains(Qt::Key_D)){
         Vec3 disp = Vec3(-0.3f,0.f, 0.f);
         for(Particle* pi: system.getParticles()){
             pi->pos += disp;
         }
+        boundaryMoved = true;
+        wakeEverything = true;
     }
 
 }
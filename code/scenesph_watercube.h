@@ -11,11 +11,62 @@
 #include "integrators.h"
 #include "colliders.h"
 #include "hash.h"
+#include "grid.h"
+#include "cellhash.h"
+#include "neighbortuner.h"
+#include "sphtile.h"
+#include "sphkernels.h"
+#include "sphkernelpolicies.h"
+#include "threadpool.h"
+#include "flipsolver.h"
+#include "sdfboundary.h"
+#include "sleeptracker.h"
+#include "adaptiveresolution.h"
+#include "convergencelog.h"
+#include "particlepool.h"
+#include "sphemitter.h"
+#include "surfacereconstruction.h"
 
 enum SPHMethod {
     FullyCompressible=0,
     WeaklyCompressible=1,
     IterativeWeaklyCompressible=2,
+    PCISPH=3,
+    DFSPH=4,
+    IISPH=5,
+    PBF=6,
+    FLIP=7,
+    APIC=8,
+};
+
+enum NeighborSearchType {
+    SpatialHash=0,
+    UniformGrid=1,
+    ExactSpatialHash=2,
+};
+
+enum SPHTraversal {
+    PerParticle=0,
+    CellWise=1,
+    SymmetricPairs=2,
+};
+
+enum BoundaryHandling {
+    BoundaryParticles=0,
+    SignedDistance=1,
+};
+
+enum SPHDensityKernel {
+    SpikyDensity=0,
+    Poly6Density=1,
+    CubicSplineDensity=2,
+};
+
+// scratch space owned by one thread of the pool
+struct SPHThreadData {
+    QVector<unsigned int> queryIds, boundaryIds;
+    unsigned int querySize = 0, boundarySize = 0;
+    SPHTile tile, boundaryTile;
 };
 
 class SceneSPHWaterCube : public Scene
@@ -42,6 +93,7 @@ public:
         bmax = Vec3( 50, 100, 50);
     }
     virtual unsigned int getNumParticles() { return system.getNumParticles(); }
+    virtual QStringList getOverlayLines();
 
     virtual QWidget* sceneUI() { return widget; }
     double getPressureFunctionSound(double pi, double p0);
@@ -49,15 +101,121 @@ public:
 
 public slots:
     void updateSimParams();
+    void exportConvergenceLog(const QString& path);
+    void exportSurfaceMesh(const QString& path);
 
 protected:
+    // runs fn(begin, end, thread) over [0, n) on the pool with the scheduling chosen in the widget
+    template<class Fn>
+    void parallelFor(int n, int chunk, const Fn& fn);
+    // calls eval(i, fluid, boundary) for every active fluid particle i with its fluid neighbor
+    // candidates in one tile and its boundary candidates, masses set to psi, in the other
+    template<class Active, class Eval>
+    void forEachNeighborhood(double h, int fields, const Active& active, const Eval& eval);
+    // same with the boundary candidates only, for the symmetric pair traversal
+    template<class Active, class Eval>
+    void forEachBoundaryNeighborhood(double h, int fields, const Active& active, const Eval& eval);
+    // rebins the boundary particles if the container moved or h changed, and recomputes their
+    // volumes psi_b = rho0/sum_k W_bk if h, rho0 or the density kernel changed. With signed
+    // distance boundaries, moves the walls and tabulates the kernel integrals instead
+    void updateBoundary(double h, double p0, int densityKernel);
+    template<class Kernel>
+    void computeBoundaryPsi(const Kernel& w, double h, double p0);
+    // registers the walls and the sphere with sdfBoundary when the boundary is a signed distance
+    void setupSDFBoundary();
+    // wakes the sleeping particles with a fast neighbor or close to the sphere if it moved,
+    // or all of them if the container, the blackhole or the parameters changed
+    void wakeParticles(double h, bool sleeping);
+    // every refineInterval steps merges the deep particles and splits the ones close to the
+    // surface or the walls, one level at a time. Disabled, splits everything back to level 0.
+    // Returns whether the fluid particles changed
+    bool adaptResolution(double h, bool enabled);
+    // the preferred axis to split a particle along, or the one with the most room inside the
+    // container when its children would not fit
+    Vec3 splitAxis(const Particle* p, int preferred) const;
+    // h_i of every fluid particle into smoothingLengths, variableH if any is not at level 0
+    void updateSmoothingLengths(double h);
+    // largest h_j/h close to every fluid particle into neighborScale, for the queries until the
+    // next refinement
+    void updateNeighborScales(double h);
+    // makes fluid the particles of the system, the forces and the neighbor search, the system
+    // keeps the boundary after them
+    void setFluidParticles(const QVector<Particle*>& pool, const QVector<Particle*>& drop);
+    // the parked particles of particlePool into the gravity, the blackhole and the forces of the
+    // system, before gravity as the SPH forces of the fluid
+    void registerParkedParticles();
+    // drains the fluid particles in the sink into the pool and emits from the tap with the
+    // particles left in it, into the drop group. Returns whether the fluid particles changed
+    bool emitAndDrain(double dt, double p0);
+    // brings the fluid particles that left the periodic domain back through the opposite side,
+    // prevPos along with them
+    void wrapParticles();
+    // boundary terms of a fluid particle at x: the boundary particles in b plus the signed
+    // distance colliders, sum psi_b W, sum psi_b grad W and the viscosity of a still boundary.
+    // Without a kernel they use Spiky and the viscosity kernel of SPHKernels
+    double boundaryDensity(const Vec3& x, const SPHTile& b) const;
+    Vec3 boundaryGradient(const Vec3& x, const SPHTile& b) const;
+    Vec3 boundaryViscosity(const Vec3& x, const Vec3& vel, double density, const SPHTile& b) const;
+    template<class Kernel>
+    double boundaryDensity(const Kernel& w, const Vec3& x, const SPHTile& b) const;
+    template<class Kernel>
+    Vec3 boundaryGradient(const Kernel& w, const Vec3& x, const SPHTile& b) const;
+    template<class Kernel>
+    Vec3 boundaryViscosity(const Kernel& w, const Vec3& x, const Vec3& vel, double density, const SPHTile& b) const;
+    // adds fn(i, j, acc) over every pair closer than h into result, with blocks as per-block accumulators
+    template<class T, class PairFn>
+    void accumulatePairs(double h, QVector<T>& result, QVector<T>& blocks, const T& zero, const PairFn& fn);
+    bool useSymmetricPairs();
+    // pick the kernels chosen for this step and run the passes templated on them
+    void computeDensities(double h, double p0, bool speedOfSound);
+    void computeViscosityAccelerations(double h, double v);
+    void computePressureAccelerations(double h, bool boundaryPressure);
+    template<class Kernel>
+    void computeDensitiesWith(const Kernel& w, double h, double p0, bool speedOfSound);
+    template<class Kernel>
+    void computeViscosityAccelerationsWith(const Kernel& w, double h, double v);
+    template<class Kernel>
+    void computePressureAccelerationsWith(const Kernel& w, double h, bool boundaryPressure);
+    // evaluates the densities, pressure and viscosity accelerations of the fluid with the mixed
+    // precision and the double sums, without applying them, into precisionReport
+    void measureMixedPrecision(double h);
+    // sums of grad W and |grad W|^2 over the neighbors of a particle in the spawn lattice
+    void computeLatticeGradients(double h, Vec3& sumGradient, double& sumGradient2);
+    // PCISPH: pressure change per unit of density error for a filled neighborhood
+    double computePCISPHDelta(double h, double p0, double dt);
+    // the fluid and boundary neighbor candidates of every fluid particle at the current positions
+    // into predictedNeighbors, once per step
+    void findPredictedNeighbors(double h);
+    // densities at predictedPositions, with the neighbors found at the current positions
+    void computePredictedDensities(double h);
+    // DFSPH: alpha_i = rho_i/(|sum m_j grad W_ij|^2 + sum |m_j grad W_ij|^2)
+    void computeDFSPHFactors(double h);
+    // D rho_i/Dt = sum m_j (v_i - v_j) . grad W_ij into densityChanges
+    void computeDensityChanges(double h);
+    // v_i -= dt sum m_j (k_i/rho_i + k_j/rho_j) grad W_ij, with k = values*scale
+    void applyDFSPHPressure(double h, const QVector<double>& values, double scale, double dt);
+    // IISPH: diagonal a_ii of the pressure system, d (A p)_i / d p_i
+    void computeIISPHDiagonal(double h, double dt);
+    // IISPH: one relaxed Jacobi step with (A p)_i = dt^2 sum m_j (a_i - a_j) . grad W_ij from the
+    // pressure accelerations, writes the predicted compression to densityErrors
+    void relaxIISPHPressures(double h, double dt, double p0, double omega);
+    // PBF: densities with Poly6 and lambda_i = -C_i/(sum |grad C_i|^2 + relaxation)
+    void computePBFLambdas(double h, double p0, double relaxation);
+    // PBF: position corrections 1/rho0 sum m_j (lambda_i + lambda_j) grad W_ij into accelerations
+    void computePBFCorrections(double h, double p0);
+    template<class Density, class Gradient>
+    void computePBFLambdasWith(const Density& w, const Gradient& gradW, double h, double p0, double relaxation);
+    template<class Gradient>
+    void computePBFCorrectionsWith(const Gradient& gradW, double h, double p0);
+
     WidgetSPHWaterCube* widget = nullptr;
 
     QOpenGLShaderProgram* shader = nullptr;
     QOpenGLVertexArrayObject* vaoSphereS = nullptr, *vaoSphereBigS = nullptr, *vaoCube = nullptr,*vaoMesh=nullptr;
     QOpenGLVertexArrayObject* vaoFloor   = nullptr;
-    QOpenGLBuffer* vboMesh=nullptr, *iboMesh=nullptr;
+    QOpenGLBuffer* vboMesh=nullptr, *nboMesh=nullptr, *iboMesh=nullptr;
     unsigned int numFacesSphereS=0, numFacesSphereBigS = 0, numFacesCube = 0;
+    unsigned int numMeshIndices = 0;
 
     IntegratorSymplecticEuler integrator;
     ParticleSystem system;
@@ -75,9 +233,11 @@ protected:
     double emitRate;
     double maxParticleLife;
 
+    // the particles of the system are the fluid ones followed by the boundary ones
     QVector<Particle*> poolParticles;
     QVector<Particle*> dropParticles;
     QVector<Particle*> boundaryParticles;
+    QVector<Particle*> fluidParticles;
     float water_radius=1.f;
     double c=0.f,k=0.f;
     Vec3i poolSize = Vec3i(25,5,25);
@@ -85,7 +245,109 @@ protected:
     Vec3 boundarySize = Vec3(25,30,25);
     int mouseX, mouseY;
 
-    Hash *hash;
+    Hash *hash = nullptr;
+    Grid *grid = nullptr;
+    CellHash *cellHash = nullptr;
+    NeighborSearch *neighbors = nullptr;
+    NeighborTuner neighborTuner;
+
+    // static boundary: binned apart from the fluid and only rebuilt when the container moves
+    Grid *boundaryGrid = nullptr;
+    QVector<double> boundaryPsi;
+    bool boundaryMoved = true;
+    double boundaryPsiH = 0, boundaryPsiP0 = 0;
+    int boundaryPsiKernel = SPHDensityKernel::SpikyDensity;
+
+    // walls of the container and the sphere as signed distances, chosen on reset
+    int boundaryHandling = BoundaryHandling::BoundaryParticles;
+    SDFBoundary sdfBoundary;
+    ColliderPlane containerWalls[6];
+    double sdfH = 0;
+
+    // periodic along x and z, chosen on reset: the container keeps its floor and its lid and the
+    // fluid interacts across the side walls, which are left out
+    PeriodicDomain periodicDomain;
+
+    // settled fluid skips the passes of the compressible methods
+    SleepTracker sleepTracker;
+    bool wakeEverything = true, sphereMoved = false;
+    static const int minSleepNeighbors = 8;   // fluid neighbors within h, itself included
+
+    // merged interior particles, as coarse as their support stays clear of the surface and the
+    // walls. With variableH the neighborhoods are searched up to (h_i + h*neighborScale_i)/2
+    AdaptiveResolution adaptive;
+    QVector<double> smoothingLengths, neighborScale;
+    double maxSmoothingLength = 0;
+    bool variableH = false;
+    int stepsSinceRefine = 0;
+    static const int refineInterval = 10;
+    QVector<double> surfaceDistance;
+    QVector<int> mergePartner;
+    SPHKernels kernels;
+    // the compressible methods take their density kernel from the widget, Spiky with variable h,
+    // and every kernel can be looked up in its table instead of evaluated
+    int densityKernel = SPHDensityKernel::SpikyDensity;
+    bool tabulatedKernels = false;
+    // the evaluated Spiky and viscosity kernels sum their tiles in mixed precision, compared to
+    // double every precisionCheckInterval steps
+    bool mixedPrecision = false;
+    int stepsSincePrecisionCheck = 0;
+    static const int precisionCheckInterval = 30;
+    QVector<Vec3> precisionErrors, precisionMagnitudes;
+    QString precisionReport;
+    SpikyKernel spiky;
+    Poly6Kernel poly6;
+    CubicSplineKernel cubicSpline;
+    KernelTable<SpikyKernel> spikyTable;
+    KernelTable<Poly6Kernel> poly6Table;
+    KernelTable<CubicSplineKernel> cubicSplineTable;
+    KernelTable<ViscosityKernel> viscosityTable;
+    QVector<Vec3> accelerations;
+    QVector<double> densities;
+
+    // pressure solvers
+    QVector<Vec3> predictedPositions;
+    QVector<Vec3> nonPressureAccelerations;
+    QVector<Vec3> pressureAccelerations;
+    // candidates of the predicted densities, the positions move by less than a cell in a step
+    QVector<QVector<unsigned int>> predictedNeighbors, predictedBoundaryNeighbors;
+    QVector<double> densityErrors;
+    QVector<double> densityChanges;
+    // DFSPH stiffness factors, accumulated over the solves of the previous step to warm start the
+    // next one: kappa*dt^2 for the density solve and kappa*dt for the divergence solve
+    QVector<double> dfsphAlpha, dfsphKappa, dfsphKappaV, dfsphStep;
+    QVector<double> iisphDiagonal;
+    // IISPH pressures of the previous step, the density passes overwrite the ones of the particles
+    QVector<double> iisphPressure;
+    QVector<double> pbfLambda;
+    // iterative weakly compressible: pressures kept from the previous step and the residuals
+    // of every iteration
+    QVector<double> iwcsphPressure;
+    ConvergenceLog convergenceLog;
+    QString solverReport;
+
+    // tap and drain of the container with the particles of a pool allocated on reset, whose
+    // reserve on top of the initial fluid the neighbor structures and the buffers are sized for
+    ParticlePool particlePool;
+    SPHEmitter tap;
+    SPHSink drain;
+    static const int poolReserve = 4000;
+    double tapSpeed = 20.0;
+    int numEmitted = 0, numDrained = 0;
+
+    // FLIP and APIC, on a MAC grid over the container instead of the SPH neighborhoods
+    FlipSolver flip;
+
+    // fluid surface drawn instead of the particles, built on a worker one step behind
+    SurfaceReconstruction surface;
+    Model surfaceMesh;
+    bool surfaceMeshChanged = false;
+
+    ThreadPool pool;
+    QVector<SPHThreadData> threadData;
+    static const int numPairBlocks = 16;
+    QVector<Vec3> accelerationBlocks;
+    QVector<double> densityBlocks;
 
     Particle* selectedPi=nullptr;
     int select_pi_status=0;//0:available; 1:found; 2:failed;
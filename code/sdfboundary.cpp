@@ -0,0 +1,69 @@
+#include "sdfboundary.h"
+#include <cmath>
+
+
+void SDFBoundary::setKernel(Kernel k, double h, const std::function<double(double)>& w) {
+    Table& t = tables[k];
+    t.h = h;
+    t.invStep = numSamples/(2*h);
+
+    // S on a finer grid than the table, so V integrated from it keeps its accuracy
+    const int refine = 8;
+    const int n = numSamples*refine;
+    const int simpson = 64;
+    double step = 2*h/n;
+    QVector<double> slab(n+1), volume(n+1);
+    for(int i=0; i<=n; i++) {
+        double a = std::abs(-h + i*step);
+        double dr = (h - a)/simpson;
+        double sum = w(a)*a + w(h)*h;
+        for(int j=1; j<simpson; j++) {
+            double r = a + j*dr;
+            sum += (j & 1 ? 4 : 2)*w(r)*r;
+        }
+        slab[i] = 2*M_PI*sum*dr/3;
+    }
+    volume[n] = 0;
+    for(int i=n-1; i>=0; i--) volume[i] = volume[i+1] + 0.5*(slab[i] + slab[i+1])*step;
+
+    t.volume.resize(numSamples+1);
+    t.slab.resize(numSamples+1);
+    for(int i=0; i<=numSamples; i++) {
+        t.volume[i] = volume[i*refine];
+        t.slab[i] = slab[i*refine];
+    }
+}
+
+double SDFBoundary::sample(const Table& t, const QVector<double>& values, double d) const {
+    // deeper than h inside the solid the whole kernel is covered
+    double u = (d + t.h)*t.invStep;
+    if (u <= 0) return values[0];
+    int i = int(u);
+    if (i >= numSamples) return values[numSamples];
+    double f = u - i;
+    return (1 - f)*values[i] + f*values[i+1];
+}
+
+double SDFBoundary::volume(Kernel k, const Vec3& x) const {
+    const Table& t = tables[k];
+    double v = 0;
+    for(const Collider* c : colliders) {
+        Vec3 n;
+        double d = c->signedDistance(x, n);
+        if (d >= t.h) continue;
+        v += sample(t, t.volume, d);
+    }
+    return v;
+}
+
+Vec3 SDFBoundary::volumeGradient(Kernel k, const Vec3& x) const {
+    const Table& t = tables[k];
+    Vec3 gradient(0,0,0);
+    for(const Collider* c : colliders) {
+        Vec3 n;
+        double d = c->signedDistance(x, n);
+        if (d >= t.h) continue;
+        gradient -= sample(t, t.slab, d)*n;
+    }
+    return gradient;
+}
@@ -0,0 +1,55 @@
+#ifndef SDFBOUNDARY_H
+#define SDFBOUNDARY_H
+
+#include <QVector>
+#include <functional>
+#include "colliders.h"
+
+/*
+ *  Boundary contribution of solid colliders computed from their signed distance, instead of
+ *  sampling their surface with boundary particles. Within the kernel support the solid is taken
+ *  as the half space behind the tangent plane, so the integral of a radial kernel over it only
+ *  depends on the signed distance d: V(d) = int_d^h S(z) dz, where S(z) = 2 pi int_|z|^h W(r) r dr
+ *  is the integral over the plane at height z. V and S are tabulated once per kernel and h, and
+ *  the gradient of V with respect to the particle is -S(d) n, pointing into the solid. The
+ *  contributions of several colliders add up, so a box given as its six walls gets both walls
+ *  along its edges.
+ */
+class SDFBoundary {
+public:
+    enum Kernel {
+        Spiky              = 0,
+        Poly6              = 1,
+        ViscosityLaplacian = 2,
+        CubicSpline        = 3,
+        NumKernels         = 4,
+    };
+
+    // tabulates the half space integrals of the radial kernel w(r) with support h
+    void setKernel(Kernel k, double h, const std::function<double(double)>& w);
+
+    // the colliders are only referenced, they can move between steps
+    void clearColliders() { colliders.clear(); }
+    void addCollider(const Collider* c) { colliders.push_back(c); }
+
+    // integral of the kernel centered at x over the solid side of every collider
+    double volume(Kernel k, const Vec3& x) const;
+    // its gradient with respect to x
+    Vec3 volumeGradient(Kernel k, const Vec3& x) const;
+
+protected:
+    struct Table {
+        double h = 0;
+        double invStep = 0;
+        // V and S at d = -h + i*2h/numSamples
+        QVector<double> volume, slab;
+    };
+
+    double sample(const Table& t, const QVector<double>& values, double d) const;
+
+    static const int numSamples = 256;
+    Table tables[NumKernels];
+    QVector<const Collider*> colliders;
+};
+
+#endif // SDFBOUNDARY_H
@@ -0,0 +1,159 @@
+#include "slabdecomposition.h"
+#include <algorithm>
+#include <limits>
+
+// id, position, velocity and mass
+static const int particleDoubles = 8;
+
+static void pack(std::vector<double>& buffer, const Particle* p) {
+    buffer.push_back(p->id);
+    buffer.push_back(p->pos.x());
+    buffer.push_back(p->pos.y());
+    buffer.push_back(p->pos.z());
+    buffer.push_back(p->vel.x());
+    buffer.push_back(p->vel.y());
+    buffer.push_back(p->vel.z());
+    buffer.push_back(p->mass);
+}
+
+static void unpack(const double* data, Particle* p) {
+    p->id = (unsigned int)data[0];
+    p->pos = Vec3(data[1], data[2], data[3]);
+    p->prevPos = p->pos;
+    p->vel = Vec3(data[4], data[5], data[6]);
+    p->mass = data[7];
+    p->type = ParticleType::NotBoundary;
+}
+
+
+SlabDecomposition::SlabDecomposition(MPI_Comm comm_var) {
+    comm = comm_var;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &numRanks);
+    neighbors[0] = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    neighbors[1] = rank < numRanks - 1 ? rank + 1 : MPI_PROC_NULL;
+    lower = -std::numeric_limits<double>::infinity();
+    upper =  std::numeric_limits<double>::infinity();
+}
+
+SlabDecomposition::~SlabDecomposition() {
+    for (Particle* p : ghosts) delete p;
+}
+
+void SlabDecomposition::setCuts(const QVector<double>& cuts_var) {
+    cuts = cuts_var;
+    lower = rank > 0 ? cuts[rank-1] : -std::numeric_limits<double>::infinity();
+    upper = rank < numRanks - 1 ? cuts[rank] : std::numeric_limits<double>::infinity();
+}
+
+QVector<double> SlabDecomposition::balancedCuts(QVector<double> xs, int numRanks) {
+    std::sort(xs.begin(), xs.end());
+    QVector<double> result;
+    for (int r = 1; r < numRanks; r++) {
+        result.push_back(xs.empty() ? 0.0 : xs[int((long long)r*xs.size()/numRanks)]);
+    }
+    return result;
+}
+
+double SlabDecomposition::minWidth() const {
+    double width = std::numeric_limits<double>::infinity();
+    for (int r = 1; r < cuts.size(); r++) width = std::min(width, cuts[r] - cuts[r-1]);
+    return width;
+}
+
+void SlabDecomposition::exchange(const std::vector<double> send[2], std::vector<double>& recv, int recvCount[2]) {
+    int sendCount[2] = {int(send[0].size()), int(send[1].size())};
+    recvCount[0] = recvCount[1] = 0;
+
+    // what goes left comes from the right, and the other way around
+    MPI_Sendrecv(&sendCount[0], 1, MPI_INT, neighbors[0], 0, &recvCount[1], 1, MPI_INT, neighbors[1], 0,
+                 comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&sendCount[1], 1, MPI_INT, neighbors[1], 1, &recvCount[0], 1, MPI_INT, neighbors[0], 1,
+                 comm, MPI_STATUS_IGNORE);
+
+    recv.resize(recvCount[0] + recvCount[1]);
+    MPI_Sendrecv(send[0].data(), sendCount[0], MPI_DOUBLE, neighbors[0], 2,
+                 recv.data() + recvCount[0], recvCount[1], MPI_DOUBLE, neighbors[1], 2, comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(send[1].data(), sendCount[1], MPI_DOUBLE, neighbors[1], 3,
+                 recv.data(), recvCount[0], MPI_DOUBLE, neighbors[0], 3, comm, MPI_STATUS_IGNORE);
+}
+
+int SlabDecomposition::migrate(QVector<Particle*>& owned) {
+    int sent = 0;
+    for (;;) {
+        sendBuffers[0].clear();
+        sendBuffers[1].clear();
+        int kept = 0;
+        for (Particle* p : owned) {
+            if (owns(p->pos)) {
+                owned[kept++] = p;
+                continue;
+            }
+            pack(sendBuffers[p->pos.x() < lower ? 0 : 1], p);
+            delete p;
+            sent++;
+        }
+        owned.resize(kept);
+
+        int recvCount[2];
+        exchange(sendBuffers, recvBuffer, recvCount);
+
+        // a particle faster than a slab per step is not home yet, it goes on in the next round
+        int strays = 0;
+        for (size_t k = 0; k < recvBuffer.size(); k += particleDoubles) {
+            Particle* p = new Particle();
+            unpack(&recvBuffer[k], p);
+            strays += !owns(p->pos);
+            owned.push_back(p);
+        }
+        int allStrays = 0;
+        MPI_Allreduce(&strays, &allStrays, 1, MPI_INT, MPI_SUM, comm);
+        if (allStrays == 0) return sent;
+    }
+}
+
+void SlabDecomposition::exchangeGhosts(const QVector<Particle*>& owned, double h) {
+    for (int side = 0; side < 2; side++) {
+        sentGhosts[side].clear();
+        sendBuffers[side].clear();
+    }
+    for (int i = 0; i < owned.size(); i++) {
+        double x = owned[i]->pos.x();
+        if (neighbors[0] != MPI_PROC_NULL && x < lower + h) {
+            sentGhosts[0].push_back(i);
+            pack(sendBuffers[0], owned[i]);
+        }
+        if (neighbors[1] != MPI_PROC_NULL && x >= upper - h) {
+            sentGhosts[1].push_back(i);
+            pack(sendBuffers[1], owned[i]);
+        }
+    }
+
+    int recvCount[2];
+    exchange(sendBuffers, recvBuffer, recvCount);
+
+    numGhosts = int(recvBuffer.size())/particleDoubles;
+    while (ghosts.size() < numGhosts) ghosts.push_back(new Particle());
+    for (int g = 0; g < numGhosts; g++) {
+        unpack(&recvBuffer[g*particleDoubles], ghosts[g]);
+        ghosts[g]->density = 0;
+        ghosts[g]->pressure = 0;
+    }
+}
+
+void SlabDecomposition::refreshGhosts(const QVector<Particle*>& owned) {
+    for (int side = 0; side < 2; side++) {
+        sendBuffers[side].clear();
+        for (int i : sentGhosts[side]) {
+            sendBuffers[side].push_back(owned[i]->density);
+            sendBuffers[side].push_back(owned[i]->pressure);
+        }
+    }
+
+    int recvCount[2];
+    exchange(sendBuffers, recvBuffer, recvCount);
+    for (int g = 0; g < numGhosts; g++) {
+        ghosts[g]->density = float(recvBuffer[2*g]);
+        ghosts[g]->pressure = float(recvBuffer[2*g + 1]);
+    }
+}
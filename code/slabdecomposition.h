@@ -0,0 +1,71 @@
+#ifndef SLABDECOMPOSITION_H
+#define SLABDECOMPOSITION_H
+
+#include <mpi.h>
+#include <vector>
+#include <QVector>
+#include "particle.h"
+
+/*
+ *  Domain cut in slabs along x, one per MPI rank. Rank r owns the particles with x in
+ *  [cuts[r-1], cuts[r]), the first and the last slab are open towards the outside. Particles that
+ *  left their slab migrate to the rank next to it, and every rank gets as ghosts the particles of
+ *  its two neighbors within h of its faces. That is every particle a kernel of an owned one can
+ *  reach, as long as no slab is thinner than h. Once the densities are known the ghosts are
+ *  refreshed with them, in the order of the last exchange.
+ *
+ *  Particles travel as packed doubles with MPI_Sendrecv between neighbors, the ranks at the ends
+ *  talk to MPI_PROC_NULL. Ghosts are particles of the decomposition, reused from one exchange to
+ *  the next.
+ */
+class SlabDecomposition {
+public:
+    SlabDecomposition(MPI_Comm comm_var = MPI_COMM_WORLD);
+    ~SlabDecomposition();
+
+    int getRank() const { return rank; }
+    int getNumRanks() const { return numRanks; }
+    MPI_Comm getComm() const { return comm; }
+
+    // numRanks-1 increasing cuts between the slabs
+    void setCuts(const QVector<double>& cuts_var);
+    // cuts leaving about the same number of xs in every slab
+    static QVector<double> balancedCuts(QVector<double> xs, int numRanks);
+    // thinnest slab between two cuts, infinite with less than three ranks
+    double minWidth() const;
+
+    bool owns(const Vec3& pos) const {
+        return pos.x() >= lower && pos.x() < upper;
+    }
+
+    // sends the owned particles out of the slab towards their rank, appends the ones coming in.
+    // Repeats until no rank has a particle to send, returns how many this rank sent
+    int migrate(QVector<Particle*>& owned);
+
+    // ghosts from the neighbors with position, velocity and mass
+    void exchangeGhosts(const QVector<Particle*>& owned, double h);
+    // densities and pressures of the ghosts of the last exchange
+    void refreshGhosts(const QVector<Particle*>& owned);
+
+    int getNumGhosts() const { return numGhosts; }
+    Particle* getGhost(int g) const { return ghosts[g]; }
+
+protected:
+    // sends to the left and right neighbors, receives from both, concatenated left then right
+    void exchange(const std::vector<double> send[2], std::vector<double>& recv, int recvCount[2]);
+
+    MPI_Comm comm;
+    int rank = 0, numRanks = 1;
+    int neighbors[2];
+    QVector<double> cuts;
+    double lower, upper;
+
+    // owned particles sent as ghosts to each neighbor in the last exchange
+    std::vector<int> sentGhosts[2];
+    QVector<Particle*> ghosts;
+    int numGhosts = 0;
+
+    std::vector<double> sendBuffers[2], recvBuffer;
+};
+
+#endif // SLABDECOMPOSITION_H
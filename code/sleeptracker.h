@@ -0,0 +1,107 @@
+#ifndef SLEEPTRACKER_H
+#define SLEEPTRACKER_H
+
+#include <QVector>
+#include <QString>
+#include <cmath>
+#include "particle.h"
+
+/*
+ *  Puts particles to sleep once they have stayed calm for a few steps: slower than sleepSpeed
+ *  and, in scenes with densities, with a density change below densityTolerance of the rest
+ *  density per step. Sleeping particles have Particle::asleep set and no velocity or force,
+ *  forces skip them and the scenes leave them out of their passes. Waking them is up to the
+ *  scene: when a neighbor moves faster than wakeSpeed, or when a collider or a force field moves.
+ */
+class SleepTracker {
+public:
+    SleepTracker(double sleepSpeed_var = 0.1, double densityTolerance_var = 1e-3, int stepsToSleep_var = 10){
+        setThresholds(sleepSpeed_var, densityTolerance_var, stepsToSleep_var);
+    }
+
+    void setThresholds(double sleepSpeed_var, double densityTolerance_var, int stepsToSleep_var){
+        sleepSpeed = sleepSpeed_var;
+        wakeSpeed = 2*sleepSpeed_var;
+        densityTolerance = densityTolerance_var;
+        stepsToSleep = stepsToSleep_var;
+    }
+
+    // everybody awake, restDensity 0 ignores the densities
+    void reset(const QVector<Particle*>& parts, double restDensity_var){
+        restDensity = restDensity_var;
+        calmSteps.fill(0, parts.size());
+        lastDensity.fill(0.0, parts.size());
+        for(Particle* p : parts) p->asleep = false;
+        numAsleep = 0;
+        numParticles = parts.size();
+    }
+
+    // the scene moved particle i to index j of its list, j <= i
+    void move(int i, int j){
+        calmSteps[j] = calmSteps[i];
+        lastDensity[j] = lastDensity[i];
+    }
+
+    // particles left or joined at the end of the list, the new ones awake
+    void resize(int n){
+        calmSteps.resize(n);
+        lastDensity.resize(n);
+        numParticles = n;
+    }
+
+    bool isSlow(const Particle* p) const { return p->vel.squaredNorm() < sleepSpeed*sleepSpeed; }
+
+    // call once per step for every awake particle i once it has moved, with its new density.
+    // Unsupported particles, like a lone drop stuck on a wall with nobody around to wake it,
+    // never fall asleep. Only touches particle i, so it can run in parallel
+    void update(Particle* p, int i, double density, bool supported = true){
+        bool calm = supported && isSlow(p);
+        if(restDensity > 0) calm = calm && std::abs(density - lastDensity[i]) < densityTolerance*restDensity;
+        lastDensity[i] = density;
+        if(!calm){
+            calmSteps[i] = 0;
+            return;
+        }
+        if(++calmSteps[i] < stepsToSleep) return;
+        p->asleep = true;
+        p->vel = Vec3(0,0,0);
+        p->force = Vec3(0,0,0);
+        p->prevPos = p->pos;
+    }
+
+    void wake(Particle* p, int i){
+        p->asleep = false;
+        calmSteps[i] = 0;
+    }
+
+    void wakeAll(const QVector<Particle*>& parts){
+        for(int i=0; i<parts.size() && i<calmSteps.size(); i++) wake(parts[i], i);
+        numAsleep = 0;
+    }
+
+    // a neighbor moving this fast wakes a sleeping particle
+    double getWakeSpeed() const { return wakeSpeed; }
+
+    // serial count for the overlay, call after the step
+    void count(const QVector<Particle*>& parts){
+        numAsleep = 0;
+        for(const Particle* p : parts) numAsleep += p->asleep;
+        numParticles = parts.size();
+    }
+
+    int getNumAsleep() const { return numAsleep; }
+
+    QString overlayLine() const {
+        return "Sleeping:  " + QString::number(numAsleep) + " / " + QString::number(numParticles);
+    }
+
+protected:
+    double sleepSpeed, wakeSpeed, densityTolerance;
+    int stepsToSleep;
+    double restDensity = 0;
+    QVector<int> calmSteps;
+    QVector<double> lastDensity;
+    int numAsleep = 0, numParticles = 0;
+};
+
+#endif // SLEEPTRACKER_H
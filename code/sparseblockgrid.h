@@ -0,0 +1,134 @@
+#ifndef SPARSEBLOCKGRID_H
+#define SPARSEBLOCKGRID_H
+
+#include <vector>
+#include <algorithm>
+#include "threadpool.h"
+
+/*
+ *  Grid of values stored only in the blocks of BlockSize^3 cells that were touched, so its memory
+ *  follows the fluid instead of the box around it. Blocks are found by their block coordinates in
+ *  an open addressing table hashed like Hash::hashCoords, and their tiles of values come from a
+ *  pool: clear() gives them back, so a grid refilled every step stops allocating once it has
+ *  seen its largest fluid. Cells are indexed like Grid, z fastest.
+ *
+ *  Touching blocks is serial, the values of the blocks can then be filled in parallel.
+ */
+template<class T, int BlockSize = 8>
+class SparseBlockGrid {
+public:
+    static constexpr int BlockCells = BlockSize*BlockSize*BlockSize;
+
+    struct Block {
+        int coord[3];
+        T* values;
+    };
+
+    SparseBlockGrid(){
+        table.assign(64, -1);
+    }
+
+    // no blocks, the tiles go back to the pool
+    void clear(){
+        blocks.clear();
+        std::fill(table.begin(), table.end(), -1);
+        freeTiles.clear();
+        for(std::vector<T>& tile : tiles) freeTiles.push_back(tile.data());
+    }
+
+    int getNumBlocks() const { return int(blocks.size()); }
+    Block& getBlock(int b){ return blocks[b]; }
+    const Block& getBlock(int b) const { return blocks[b]; }
+
+    // block of a cell coordinate, rounding down for the negative ones
+    static int blockCoord(int c){
+        return c >= 0 ? c/BlockSize : -((-c-1)/BlockSize) - 1;
+    }
+
+    static int cellIndex(int xi, int yi, int zi){
+        return (xi*BlockSize + yi)*BlockSize + zi;
+    }
+
+    // index of the block, -1 if it was not touched
+    int find(int bx, int by, int bz) const {
+        for(unsigned int s = hashCoords(bx, by, bz); ; s = (s + 1) & (table.size() - 1)){
+            int b = table[s];
+            if(b < 0) return -1;
+            const int* c = blocks[b].coord;
+            if(c[0] == bx && c[1] == by && c[2] == bz) return b;
+        }
+    }
+
+    // index of the block, added with all its values set to fill if it was not touched
+    int touch(int bx, int by, int bz, const T& fill = T()){
+        unsigned int s = hashCoords(bx, by, bz);
+        for(; table[s] >= 0; s = (s + 1) & (table.size() - 1)){
+            const int* c = blocks[table[s]].coord;
+            if(c[0] == bx && c[1] == by && c[2] == bz) return table[s];
+        }
+
+        Block block = {{bx, by, bz}, takeTile()};
+        std::fill(block.values, block.values + BlockCells, fill);
+        blocks.push_back(block);
+        table[s] = int(blocks.size()) - 1;
+
+        // keep the table at most half full
+        if(2*blocks.size() > table.size()) rehash(2*table.size());
+        return int(blocks.size()) - 1;
+    }
+
+    // value of a cell, missing if its block was not touched
+    T value(int xi, int yi, int zi, const T& missing = T()) const {
+        int bx = blockCoord(xi), by = blockCoord(yi), bz = blockCoord(zi);
+        int b = find(bx, by, bz);
+        if(b < 0) return missing;
+        return blocks[b].values[cellIndex(xi - bx*BlockSize, yi - by*BlockSize, zi - bz*BlockSize)];
+    }
+
+    // calls fn(b, thread) for every block b on the pool
+    template<class Fn>
+    void forEachBlock(ThreadPool& pool, ThreadPool::Schedule schedule, const Fn& fn){
+        pool.parallelFor(getNumBlocks(), schedule, 1, [&](int begin, int end, int thread){
+            for(int b=begin; b<end; b++) fn(b, thread);
+        });
+    }
+
+    // tiles in the pool, in use or not, and the table
+    size_t getMemoryBytes() const {
+        return tiles.size()*BlockCells*sizeof(T) + table.size()*sizeof(int) + blocks.capacity()*sizeof(Block);
+    }
+
+protected:
+    unsigned int hashCoords(int xi, int yi, int zi) const {
+        unsigned int h = (unsigned(xi) * 92837111u) ^ (unsigned(yi) * 689287499u) ^ (unsigned(zi) * 283923481u); // fantasy function
+        return h & (table.size() - 1);
+    }
+
+    T* takeTile(){
+        if(freeTiles.empty()){
+            tiles.emplace_back(size_t(BlockCells));
+            return tiles.back().data();
+        }
+        T* tile = freeTiles.back();
+        freeTiles.pop_back();
+        return tile;
+    }
+
+    void rehash(size_t size){
+        table.assign(size, -1);
+        for(int b=0; b<getNumBlocks(); b++){
+            const int* c = blocks[b].coord;
+            unsigned int s = hashCoords(c[0], c[1], c[2]);
+            while(table[s] >= 0) s = (s + 1) & (table.size() - 1);
+            table[s] = b;
+        }
+    }
+
+    std::vector<Block> blocks;
+    std::vector<int> table;
+    // the data of a tile never moves, freeTiles points into tiles
+    std::vector<std::vector<T>> tiles;
+    std::vector<T*> freeTiles;
+};
+
+#endif // SPARSEBLOCKGRID_H
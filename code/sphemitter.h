@@ -0,0 +1,72 @@
+#ifndef SPHEMITTER_H
+#define SPHEMITTER_H
+
+#include <QVector>
+#include <cmath>
+#include "defines.h"
+
+/*
+ *  Inflow of fluid through a disk: a layer of particles on a square lattice of the spawn spacing
+ *  every time the inflow has moved one spacing, so the new fluid starts near its rest density.
+ *  The layer is laid out once in setDisk, emitting only calls spawn(pos, vel) per particle.
+ */
+class SPHEmitter {
+public:
+    // disk of the given radius around center facing dir, with the lattice of the fluid
+    void setDisk(const Vec3& center_var, const Vec3& dir_var, double radius, double spacing_var){
+        center = center_var;
+        dir = dir_var.normalized();
+        spacing = spacing_var;
+        Vec3 u = dir.cross(std::abs(dir.x()) < 0.9 ? Vec3(1,0,0) : Vec3(0,1,0)).normalized();
+        Vec3 v = dir.cross(u);
+        int n = int(radius/spacing);
+        layer.clear();
+        for(int i=-n; i<=n; i++)
+            for(int j=-n; j<=n; j++)
+                if((i*i + j*j)*spacing*spacing <= radius*radius) layer.push_back(spacing*(double(i)*u + double(j)*v));
+    }
+
+    // the disk follows the container
+    void setCenter(const Vec3& center_var){ center = center_var; }
+
+    int getLayerSize() const { return layer.size(); }
+
+    // emits the layers due after dt at speed, each one already moved by the time left in the
+    // step. Stops at the first particle spawn refuses, returns how many were spawned
+    template<class Spawn>
+    int step(double dt, double speed, const Spawn& spawn){
+        int numSpawned = 0;
+        travelled += speed*dt;
+        while(travelled >= spacing){
+            travelled -= spacing;
+            Vec3 pos = center + travelled*dir;
+            for(const Vec3& offset : layer){
+                if(!spawn(pos + offset, speed*dir)){
+                    travelled = 0;
+                    return numSpawned;
+                }
+                numSpawned++;
+            }
+        }
+        return numSpawned;
+    }
+
+    void reset(){ travelled = 0; }
+
+protected:
+    Vec3 center = Vec3(0,0,0), dir = Vec3(0,-1,0);
+    double spacing = 1, travelled = 0;
+    QVector<Vec3> layer;
+};
+
+// outflow: the fluid particles entering the box are drained
+struct SPHSink {
+    Vec3 bmin = Vec3(0,0,0), bmax = Vec3(0,0,0);
+
+    bool contains(const Vec3& x) const {
+        return x.x() >= bmin.x() && x.y() >= bmin.y() && x.z() >= bmin.z()
+            && x.x() <= bmax.x() && x.y() <= bmax.y() && x.z() <= bmax.z();
+    }
+};
+
+#endif // SPHEMITTER_H
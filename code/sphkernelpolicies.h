@@ -0,0 +1,302 @@
+#ifndef SPHKERNELPOLICIES_H
+#define SPHKERNELPOLICIES_H
+
+#include <QVector>
+#include <algorithm>
+#include <cmath>
+#include "sphtile.h"
+#include "sphkernels.h"
+
+/*
+ *  Kernels as policy types, so the passes of the water cube are templated on them and the kernel
+ *  is inlined into their loops. A policy keeps its normalization for one h and evaluates from the
+ *  squared distance, r2 <= h2 tested by the caller: value W(r), gradientFactor g with
+ *  grad W(r) = g r for r2 > 0, and laplacian. KernelTable<K> is the fast path of any of them,
+ *  sampled in q2 = r2/h2 so a lookup needs no square root.
+ */
+
+struct Poly6Kernel {
+    void setH(double h_var){
+        h = h_var;
+        h2 = h*h;
+        double h9 = h2*h2*h2*h2*h;
+        coef = 315.0/(64.0*M_PI*h9);
+        gradCoef = -945.0/(32.0*M_PI*h9);
+    }
+    double value(double r2) const {
+        double d = h2 - r2;
+        return coef*d*d*d;
+    }
+    double gradientFactor(double r2) const {
+        double d = h2 - r2;
+        return gradCoef*d*d;
+    }
+    double laplacian(double r2) const {
+        return gradCoef*(h2 - r2)*(3*h2 - 7*r2);
+    }
+
+    double h = 0, h2 = 0;
+    double coef = 0, gradCoef = 0;
+};
+
+struct SpikyKernel {
+    void setH(double h_var){
+        h = h_var;
+        h2 = h*h;
+        double h6 = h2*h2*h2;
+        coef = 15.0/(M_PI*h6);
+        gradCoef = -45.0/(M_PI*h6);
+    }
+    double value(double r2) const {
+        double h_r = h - std::sqrt(r2);
+        return coef*h_r*h_r*h_r;
+    }
+    double gradientFactor(double r2) const {
+        double r = std::sqrt(r2);
+        double h_r = h - r;
+        return gradCoef*h_r*h_r/r;
+    }
+    double laplacian(double r2) const {
+        double r = std::sqrt(r2);
+        return -2*gradCoef*(h - r)*(2*r - h)/r;
+    }
+
+    double h = 0, h2 = 0;
+    double coef = 0, gradCoef = 0;
+};
+
+// Mueller et al. 2003, only its laplacian is used, for the viscosity
+struct ViscosityKernel {
+    void setH(double h_var){
+        h = h_var;
+        h2 = h*h;
+        invH = 1.0/h;
+        coef = 15.0/(2*M_PI*h2*h);
+        lapCoef = 45.0/(M_PI*h2*h2*h);
+    }
+    double value(double r2) const {
+        double r = std::sqrt(r2);
+        double q = r*invH;
+        return coef*(-0.5*q*q*q + q*q + 0.5/q - 1);
+    }
+    double gradientFactor(double r2) const {
+        double r = std::sqrt(r2);
+        return coef*(-1.5*r*invH/h2 + 2/h2 - 0.5*h/(r2*r));
+    }
+    double laplacian(double r2) const {
+        return lapCoef*(1.0 - std::sqrt(r2)*invH);
+    }
+
+    double h = 0, h2 = 0, invH = 0;
+    double coef = 0, lapCoef = 0;
+};
+
+// Monaghan's cubic B-spline with its support scaled to h
+struct CubicSplineKernel {
+    void setH(double h_var){
+        h = h_var;
+        h2 = h*h;
+        invH = 1.0/h;
+        sigma = 8.0/(M_PI*h2*h);
+    }
+    double value(double r2) const {
+        double q = std::sqrt(r2)*invH;
+        if(q <= 0.5) return sigma*(6*(q*q*q - q*q) + 1);
+        double q1 = 1 - q;
+        return sigma*2*q1*q1*q1;
+    }
+    double gradientFactor(double r2) const {
+        double q = std::sqrt(r2)*invH;
+        if(q <= 0.5) return sigma/h2*(18*q - 12);
+        double q1 = 1 - q;
+        return -sigma/h2*6*q1*q1/q;
+    }
+    double laplacian(double r2) const {
+        double q = std::sqrt(r2)*invH;
+        if(q <= 0.5) return sigma/h2*(72*q - 36);
+        return sigma/h2*12*(1 - q)*(2*q - 1)/q;
+    }
+
+    double h = 0, h2 = 0, invH = 0;
+    double sigma = 0;
+};
+
+// Spiky and viscosity kernels of SPHKernels, whose tile sums below are vectorized by hand
+struct BatchedSpikyKernel {
+    explicit BatchedSpikyKernel(const SPHKernels& k) : kernels(k), h2(k.h2) {}
+    double value(double r2) const { return kernels.spiky(r2); }
+    double gradientFactor(double r2) const {
+        double r = std::sqrt(r2);
+        double h_r = kernels.h - r;
+        return kernels.spikyGradCoef/r*h_r*h_r;
+    }
+
+    const SPHKernels& kernels;
+    double h2;
+};
+
+struct BatchedViscosityKernel {
+    explicit BatchedViscosityKernel(const SPHKernels& k) : kernels(k), h2(k.h2) {}
+    double laplacian(double r2) const { return kernels.viscosityLaplacian(r2); }
+
+    const SPHKernels& kernels;
+    double h2;
+};
+
+// the same kernels with the tile sums in mixed precision, the tiles need SPHTile::setOrigin.
+// Pairs summed outside of the tiles stay in double
+struct MixedSpikyKernel : BatchedSpikyKernel {
+    explicit MixedSpikyKernel(const SPHKernels& k) : BatchedSpikyKernel(k) {}
+};
+
+struct MixedViscosityKernel : BatchedViscosityKernel {
+    explicit MixedViscosityKernel(const SPHKernels& k) : BatchedViscosityKernel(k) {}
+};
+
+/*
+ *  K sampled at numSamples+1 equally spaced q2 and interpolated linearly. Where K is singular at
+ *  r = 0, like the Spiky gradient, the first sample repeats the second one: coincident particles
+ *  are rare and the gradient sums skip r2 == 0 anyway.
+ */
+template<class K>
+class KernelTable {
+public:
+    static const int numSamples = 1024;
+
+    // tabulates again only when h changes
+    void setH(double h_var){
+        if(h_var == h) return;
+        kernel.setH(h_var);
+        h = h_var;
+        h2 = h*h;
+        invStep = numSamples/h2;
+        // one extra sample so r2 == h2 interpolates without a test
+        values.resize(numSamples+2);
+        gradientFactors.resize(numSamples+2);
+        laplacians.resize(numSamples+2);
+        for(int i=numSamples; i>=0; i--){
+            double r2 = i*h2/numSamples;
+            values[i] = finiteOr(kernel.value(r2), values[i+1]);
+            gradientFactors[i] = finiteOr(kernel.gradientFactor(r2), gradientFactors[i+1]);
+            laplacians[i] = finiteOr(kernel.laplacian(r2), laplacians[i+1]);
+        }
+        values[numSamples+1] = values[numSamples];
+        gradientFactors[numSamples+1] = gradientFactors[numSamples];
+        laplacians[numSamples+1] = laplacians[numSamples];
+    }
+
+    double value(double r2) const { return sample(values, r2); }
+    double gradientFactor(double r2) const { return sample(gradientFactors, r2); }
+    double laplacian(double r2) const { return sample(laplacians, r2); }
+
+    const K& analytic() const { return kernel; }
+
+    double h = 0, h2 = 0;
+
+protected:
+    static double finiteOr(double v, double fallback) { return std::isfinite(v) ? v : fallback; }
+
+    double sample(const QVector<double>& samples, double r2) const {
+        double u = r2*invStep;
+        int i = int(u);
+        double f = u - i;
+        const double* s = samples.constData() + i;
+        return s[0] + f*(s[1] - s[0]);
+    }
+
+    K kernel;
+    double invStep = 0;
+    QVector<double> values, gradientFactors, laplacians;
+};
+
+// the tile sums of SPHKernels for any policy, written without branches: the kernel is evaluated
+// at r2 clamped to (0, h2], so it stays finite, and selected only within the support
+template<class K>
+double tileDensity(const K& w, const Vec3& pos, const SPHTile& t){
+    double density = 0.0;
+    for(unsigned int j=0; j<t.size; j++){
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        double wij = w.value(std::min(r2, w.h2));
+        density += r2 <= w.h2 ? t.mass[j]*wij : 0.0;
+    }
+    return density;
+}
+
+template<class K>
+Vec3 tileViscosity(const K& w, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t){
+    double sx = 0.0, sy = 0.0, sz = 0.0;
+    for(unsigned int j=0; j<t.size; j++){
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        double lap = w.laplacian(std::min(r2, w.h2));
+        double coef = r2 <= w.h2 ? -t.mass[j]/t.density[j]/density*lap : 0.0;
+        sx += coef*(t.vx[j]-vel.x());
+        sy += coef*(t.vy[j]-vel.y());
+        sz += coef*(t.vz[j]-vel.z());
+    }
+    return Vec3(sx, sy, sz);
+}
+
+template<class K>
+Vec3 tilePressure(const K& w, const Vec3& pos, double pressure, double density, const SPHTile& t){
+    const double minR2 = 1e-12*w.h2;
+    double pi_rho2 = pressure/(density*density);
+    double sx = 0.0, sy = 0.0, sz = 0.0;
+    for(unsigned int j=0; j<t.size; j++){
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        double factor = w.gradientFactor(std::min(std::max(r2, minR2), w.h2));
+        // r2 == 0 is the particle itself
+        double p_ij = -t.mass[j]*(pi_rho2 + t.pressure[j]/(t.density[j]*t.density[j]));
+        double g = r2 <= w.h2 && r2 > 0.0 ? p_ij*factor : 0.0;
+        sx += g*dx;
+        sy += g*dy;
+        sz += g*dz;
+    }
+    return Vec3(sx, sy, sz);
+}
+
+template<class K>
+Vec3 tileGradient(const K& w, const Vec3& pos, const SPHTile& t){
+    const double minR2 = 1e-12*w.h2;
+    double sx = 0.0, sy = 0.0, sz = 0.0;
+    for(unsigned int j=0; j<t.size; j++){
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        double factor = w.gradientFactor(std::min(std::max(r2, minR2), w.h2));
+        double g = r2 <= w.h2 && r2 > 0.0 ? t.mass[j]*factor : 0.0;
+        sx += g*dx;
+        sy += g*dy;
+        sz += g*dz;
+    }
+    return Vec3(sx, sy, sz);
+}
+
+inline double tileDensity(const BatchedSpikyKernel& w, const Vec3& pos, const SPHTile& t){
+    return w.kernels.density(pos, t);
+}
+inline Vec3 tilePressure(const BatchedSpikyKernel& w, const Vec3& pos, double pressure, double density, const SPHTile& t){
+    return w.kernels.pressure(pos, pressure, density, t);
+}
+inline Vec3 tileGradient(const BatchedSpikyKernel& w, const Vec3& pos, const SPHTile& t){
+    return w.kernels.gradient(pos, t);
+}
+inline Vec3 tileViscosity(const BatchedViscosityKernel& w, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t){
+    return w.kernels.viscosity(pos, vel, density, t);
+}
+
+inline double tileDensity(const MixedSpikyKernel& w, const Vec3& pos, const SPHTile& t){
+    return w.kernels.densityMixed(pos, t);
+}
+inline Vec3 tilePressure(const MixedSpikyKernel& w, const Vec3& pos, double pressure, double density, const SPHTile& t){
+    return w.kernels.pressureMixed(pos, pressure, density, t);
+}
+inline Vec3 tileGradient(const MixedSpikyKernel& w, const Vec3& pos, const SPHTile& t){
+    return w.kernels.gradientMixed(pos, t);
+}
+inline Vec3 tileViscosity(const MixedViscosityKernel& w, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t){
+    return w.kernels.viscosityMixed(pos, vel, density, t);
+}
+
+#endif // SPHKERNELPOLICIES_H
@@ -0,0 +1,911 @@
+#include "sphkernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define SPH_KERNELS_X86
+    #include <immintrin.h>
+#endif
+
+
+SPHKernels::SPHKernels(double h_var) {
+    backend = bestBackend();
+    setH(h_var);
+}
+
+void SPHKernels::setH(double h_var) {
+    // same pi as the per pair kernels of the water cube
+    const double pi = 3.14159192;
+    h = h_var;
+    h2 = h*h;
+    invH = 1.0/h;
+    double h5 = h*h*h*h*h;
+    double h6 = h5*h;
+    spikyCoef     =  15.0/(pi*h6);
+    spikyGradCoef = -45.0/(pi*h6);
+    viscLapCoef   =  45.0/(pi*h5);
+}
+
+SPHKernels::Backend SPHKernels::bestBackend() {
+#ifdef SPH_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return AVX2;
+#endif
+    return Scalar;
+}
+
+const char* SPHKernels::backendName(Backend b) {
+    switch (b) {
+        case AVX512: return "AVX-512";
+        case AVX2:   return "AVX2";
+        default:     return "Scalar";
+    }
+}
+
+
+/*
+ *  Scalar loops, also used for the candidates left over by the vector loops
+ */
+
+static double densityScalar(const SPHKernels& k, const Vec3& pos, const SPHTile& t, unsigned int j) {
+    double density = 0.0;
+    for (; j < t.size; j++) {
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        if (r2 <= k.h2) density += t.mass[j]*k.spiky(r2);
+    }
+    return density;
+}
+
+static Vec3 viscosityScalar(const SPHKernels& k, const Vec3& pos, const Vec3& vel, double density,
+                            const SPHTile& t, unsigned int j) {
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        if (r2 > k.h2) continue;
+        double coef = -t.mass[j]/t.density[j]/density*k.viscosityLaplacian(r2);
+        sum += coef*Vec3(t.vx[j]-vel.x(), t.vy[j]-vel.y(), t.vz[j]-vel.z());
+    }
+    return sum;
+}
+
+static Vec3 pressureScalar(const SPHKernels& k, const Vec3& pos, double pressure, double density,
+                           const SPHTile& t, unsigned int j) {
+    double pi_rho2 = pressure/(density*density);
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        Vec3 r(pos.x()-t.x[j], pos.y()-t.y[j], pos.z()-t.z[j]);
+        double r2 = r.squaredNorm();
+        // r2 == 0 is the particle itself
+        if (r2 > k.h2 || r2 == 0.0) continue;
+        double p_ij = -t.mass[j]*(pi_rho2 + t.pressure[j]/(t.density[j]*t.density[j]));
+        sum += p_ij*k.spikyGradient(r, r2);
+    }
+    return sum;
+}
+
+static Vec3 gradientScalar(const SPHKernels& k, const Vec3& pos, const SPHTile& t, unsigned int j) {
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        Vec3 r(pos.x()-t.x[j], pos.y()-t.y[j], pos.z()-t.z[j]);
+        double r2 = r.squaredNorm();
+        if (r2 > k.h2 || r2 == 0.0) continue;
+        sum += t.mass[j]*k.spikyGradient(r, r2);
+    }
+    return sum;
+}
+
+
+#ifdef SPH_KERNELS_X86
+
+/*
+ *  AVX2, 4 candidates per iteration
+ */
+
+__attribute__((target("avx2,fma")))
+static inline double hsum(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2,fma")))
+static double densityAVX2(const SPHKernels& k, const Vec3& pos, const SPHTile& t) {
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d h = _mm256_set1_pd(k.h), h2 = _mm256_set1_pd(k.h2), c = _mm256_set1_pd(k.spikyCoef);
+    __m256d acc = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d in = _mm256_cmp_pd(r2, h2, _CMP_LE_OQ);
+
+        __m256d h_r = _mm256_sub_pd(h, _mm256_sqrt_pd(r2));
+        __m256d w = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(c, h_r), h_r), h_r);
+        acc = _mm256_add_pd(acc, _mm256_and_pd(in, _mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), w)));
+    }
+    return hsum(acc) + densityScalar(k, pos, t, j);
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 viscosityAVX2(const SPHKernels& k, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) {
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d vxi = _mm256_set1_pd(vel.x()), vyi = _mm256_set1_pd(vel.y()), vzi = _mm256_set1_pd(vel.z());
+    const __m256d h2 = _mm256_set1_pd(k.h2), invH = _mm256_set1_pd(k.invH), one = _mm256_set1_pd(1.0);
+    const __m256d c = _mm256_set1_pd(-k.viscLapCoef), rhoi = _mm256_set1_pd(density);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d in = _mm256_cmp_pd(r2, h2, _CMP_LE_OQ);
+
+        // -m_j/rho_j/rho_i * lap W
+        __m256d lap = _mm256_mul_pd(c, _mm256_fnmadd_pd(_mm256_sqrt_pd(r2), invH, one));
+        __m256d rhoij = _mm256_mul_pd(_mm256_loadu_pd(&t.density[j]), rhoi);
+        __m256d coef = _mm256_and_pd(in, _mm256_div_pd(_mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), lap), rhoij));
+
+        ax = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vx[j]), vxi), ax);
+        ay = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vy[j]), vyi), ay);
+        az = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vz[j]), vzi), az);
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az)) + viscosityScalar(k, pos, vel, density, t, j);
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 pressureAVX2(const SPHKernels& k, const Vec3& pos, double pressure, double density, const SPHTile& t) {
+    const double pi_rho2 = pressure/(density*density);
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d h = _mm256_set1_pd(k.h), h2 = _mm256_set1_pd(k.h2), zero = _mm256_setzero_pd();
+    const __m256d c = _mm256_set1_pd(k.spikyGradCoef);
+    const __m256d pi = _mm256_set1_pd(pi_rho2);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(r2, h2, _CMP_LE_OQ), _mm256_cmp_pd(r2, zero, _CMP_GT_OQ));
+
+        // -p_ij/m_j
+        __m256d rhoj = _mm256_loadu_pd(&t.density[j]);
+        __m256d p = _mm256_add_pd(pi, _mm256_div_pd(_mm256_loadu_pd(&t.pressure[j]), _mm256_mul_pd(rhoj, rhoj)));
+
+        // p_ij * spikyGradCoef/r * (h-r)^2
+        __m256d r = _mm256_sqrt_pd(r2);
+        __m256d h_r = _mm256_sub_pd(h, r);
+        __m256d g = _mm256_mul_pd(_mm256_div_pd(c, r), _mm256_mul_pd(h_r, h_r));
+        __m256d s = _mm256_and_pd(in, _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), p), g));
+
+        ax = _mm256_fnmadd_pd(s, dx, ax);
+        ay = _mm256_fnmadd_pd(s, dy, ay);
+        az = _mm256_fnmadd_pd(s, dz, az);
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az)) + pressureScalar(k, pos, pressure, density, t, j);
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 gradientAVX2(const SPHKernels& k, const Vec3& pos, const SPHTile& t) {
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d h = _mm256_set1_pd(k.h), h2 = _mm256_set1_pd(k.h2), zero = _mm256_setzero_pd();
+    const __m256d c = _mm256_set1_pd(k.spikyGradCoef);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(r2, h2, _CMP_LE_OQ), _mm256_cmp_pd(r2, zero, _CMP_GT_OQ));
+
+        // m_j * spikyGradCoef/r * (h-r)^2
+        __m256d r = _mm256_sqrt_pd(r2);
+        __m256d h_r = _mm256_sub_pd(h, r);
+        __m256d g = _mm256_mul_pd(_mm256_div_pd(c, r), _mm256_mul_pd(h_r, h_r));
+        __m256d s = _mm256_and_pd(in, _mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), g));
+
+        ax = _mm256_fmadd_pd(s, dx, ax);
+        ay = _mm256_fmadd_pd(s, dy, ay);
+        az = _mm256_fmadd_pd(s, dz, az);
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az)) + gradientScalar(k, pos, t, j);
+}
+
+
+/*
+ *  AVX-512, 8 candidates per iteration
+ */
+
+__attribute__((target("avx512f")))
+static double densityAVX512(const SPHKernels& k, const Vec3& pos, const SPHTile& t) {
+    const __m512d xi = _mm512_set1_pd(pos.x()), yi = _mm512_set1_pd(pos.y()), zi = _mm512_set1_pd(pos.z());
+    const __m512d h = _mm512_set1_pd(k.h), h2 = _mm512_set1_pd(k.h2), c = _mm512_set1_pd(k.spikyCoef);
+    __m512d acc = _mm512_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+8 <= t.size; j += 8) {
+        __m512d dx = _mm512_sub_pd(xi, _mm512_loadu_pd(&t.x[j]));
+        __m512d dy = _mm512_sub_pd(yi, _mm512_loadu_pd(&t.y[j]));
+        __m512d dz = _mm512_sub_pd(zi, _mm512_loadu_pd(&t.z[j]));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __mmask8 in = _mm512_cmp_pd_mask(r2, h2, _CMP_LE_OQ);
+
+        __m512d h_r = _mm512_sub_pd(h, _mm512_sqrt_pd(r2));
+        __m512d w = _mm512_mul_pd(_mm512_mul_pd(_mm512_mul_pd(c, h_r), h_r), h_r);
+        acc = _mm512_mask_add_pd(acc, in, acc, _mm512_mul_pd(_mm512_loadu_pd(&t.mass[j]), w));
+    }
+    return _mm512_reduce_add_pd(acc) + densityScalar(k, pos, t, j);
+}
+
+__attribute__((target("avx512f")))
+static Vec3 viscosityAVX512(const SPHKernels& k, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) {
+    const __m512d xi = _mm512_set1_pd(pos.x()), yi = _mm512_set1_pd(pos.y()), zi = _mm512_set1_pd(pos.z());
+    const __m512d vxi = _mm512_set1_pd(vel.x()), vyi = _mm512_set1_pd(vel.y()), vzi = _mm512_set1_pd(vel.z());
+    const __m512d h2 = _mm512_set1_pd(k.h2), invH = _mm512_set1_pd(k.invH), one = _mm512_set1_pd(1.0);
+    const __m512d c = _mm512_set1_pd(-k.viscLapCoef), rhoi = _mm512_set1_pd(density);
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+8 <= t.size; j += 8) {
+        __m512d dx = _mm512_sub_pd(xi, _mm512_loadu_pd(&t.x[j]));
+        __m512d dy = _mm512_sub_pd(yi, _mm512_loadu_pd(&t.y[j]));
+        __m512d dz = _mm512_sub_pd(zi, _mm512_loadu_pd(&t.z[j]));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __mmask8 in = _mm512_cmp_pd_mask(r2, h2, _CMP_LE_OQ);
+
+        // -m_j/rho_j/rho_i * lap W
+        __m512d lap = _mm512_mul_pd(c, _mm512_fnmadd_pd(_mm512_sqrt_pd(r2), invH, one));
+        __m512d rhoij = _mm512_mul_pd(_mm512_loadu_pd(&t.density[j]), rhoi);
+        __m512d coef = _mm512_maskz_div_pd(in, _mm512_mul_pd(_mm512_loadu_pd(&t.mass[j]), lap), rhoij);
+
+        ax = _mm512_fmadd_pd(coef, _mm512_sub_pd(_mm512_loadu_pd(&t.vx[j]), vxi), ax);
+        ay = _mm512_fmadd_pd(coef, _mm512_sub_pd(_mm512_loadu_pd(&t.vy[j]), vyi), ay);
+        az = _mm512_fmadd_pd(coef, _mm512_sub_pd(_mm512_loadu_pd(&t.vz[j]), vzi), az);
+    }
+    return Vec3(_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay), _mm512_reduce_add_pd(az))
+            + viscosityScalar(k, pos, vel, density, t, j);
+}
+
+__attribute__((target("avx512f")))
+static Vec3 pressureAVX512(const SPHKernels& k, const Vec3& pos, double pressure, double density, const SPHTile& t) {
+    const double pi_rho2 = pressure/(density*density);
+    const __m512d xi = _mm512_set1_pd(pos.x()), yi = _mm512_set1_pd(pos.y()), zi = _mm512_set1_pd(pos.z());
+    const __m512d h = _mm512_set1_pd(k.h), h2 = _mm512_set1_pd(k.h2), zero = _mm512_setzero_pd();
+    const __m512d c = _mm512_set1_pd(k.spikyGradCoef);
+    const __m512d pi = _mm512_set1_pd(pi_rho2);
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+8 <= t.size; j += 8) {
+        __m512d dx = _mm512_sub_pd(xi, _mm512_loadu_pd(&t.x[j]));
+        __m512d dy = _mm512_sub_pd(yi, _mm512_loadu_pd(&t.y[j]));
+        __m512d dz = _mm512_sub_pd(zi, _mm512_loadu_pd(&t.z[j]));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __mmask8 in = _mm512_cmp_pd_mask(r2, h2, _CMP_LE_OQ) & _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+
+        // -p_ij/m_j
+        __m512d rhoj = _mm512_loadu_pd(&t.density[j]);
+        __m512d p = _mm512_add_pd(pi, _mm512_div_pd(_mm512_loadu_pd(&t.pressure[j]), _mm512_mul_pd(rhoj, rhoj)));
+
+        // p_ij * spikyGradCoef/r * (h-r)^2
+        __m512d r = _mm512_sqrt_pd(r2);
+        __m512d h_r = _mm512_sub_pd(h, r);
+        __m512d g = _mm512_mul_pd(_mm512_div_pd(c, r), _mm512_mul_pd(h_r, h_r));
+        __m512d s = _mm512_maskz_mul_pd(in, _mm512_mul_pd(_mm512_loadu_pd(&t.mass[j]), p), g);
+
+        ax = _mm512_fnmadd_pd(s, dx, ax);
+        ay = _mm512_fnmadd_pd(s, dy, ay);
+        az = _mm512_fnmadd_pd(s, dz, az);
+    }
+    return Vec3(_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay), _mm512_reduce_add_pd(az))
+            + pressureScalar(k, pos, pressure, density, t, j);
+}
+
+__attribute__((target("avx512f")))
+static Vec3 gradientAVX512(const SPHKernels& k, const Vec3& pos, const SPHTile& t) {
+    const __m512d xi = _mm512_set1_pd(pos.x()), yi = _mm512_set1_pd(pos.y()), zi = _mm512_set1_pd(pos.z());
+    const __m512d h = _mm512_set1_pd(k.h), h2 = _mm512_set1_pd(k.h2), zero = _mm512_setzero_pd();
+    const __m512d c = _mm512_set1_pd(k.spikyGradCoef);
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+8 <= t.size; j += 8) {
+        __m512d dx = _mm512_sub_pd(xi, _mm512_loadu_pd(&t.x[j]));
+        __m512d dy = _mm512_sub_pd(yi, _mm512_loadu_pd(&t.y[j]));
+        __m512d dz = _mm512_sub_pd(zi, _mm512_loadu_pd(&t.z[j]));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __mmask8 in = _mm512_cmp_pd_mask(r2, h2, _CMP_LE_OQ) & _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+
+        // m_j * spikyGradCoef/r * (h-r)^2
+        __m512d r = _mm512_sqrt_pd(r2);
+        __m512d h_r = _mm512_sub_pd(h, r);
+        __m512d g = _mm512_mul_pd(_mm512_div_pd(c, r), _mm512_mul_pd(h_r, h_r));
+        __m512d s = _mm512_maskz_mul_pd(in, _mm512_loadu_pd(&t.mass[j]), g);
+
+        ax = _mm512_fmadd_pd(s, dx, ax);
+        ay = _mm512_fmadd_pd(s, dy, ay);
+        az = _mm512_fmadd_pd(s, dz, az);
+    }
+    return Vec3(_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay), _mm512_reduce_add_pd(az))
+            + gradientScalar(k, pos, t, j);
+}
+
+#endif // SPH_KERNELS_X86
+
+
+double SPHKernels::density(const Vec3& pos, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return densityAVX512(*this, pos, t);
+    if (backend == AVX2)   return densityAVX2(*this, pos, t);
+#endif
+    return densityScalar(*this, pos, t, 0);
+}
+
+Vec3 SPHKernels::viscosity(const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return viscosityAVX512(*this, pos, vel, density, t);
+    if (backend == AVX2)   return viscosityAVX2(*this, pos, vel, density, t);
+#endif
+    return viscosityScalar(*this, pos, vel, density, t, 0);
+}
+
+Vec3 SPHKernels::pressure(const Vec3& pos, double pressure, double density, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return pressureAVX512(*this, pos, pressure, density, t);
+    if (backend == AVX2)   return pressureAVX2(*this, pos, pressure, density, t);
+#endif
+    return pressureScalar(*this, pos, pressure, density, t, 0);
+}
+
+Vec3 SPHKernels::gradient(const Vec3& pos, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return gradientAVX512(*this, pos, t);
+    if (backend == AVX2)   return gradientAVX2(*this, pos, t);
+#endif
+    return gradientScalar(*this, pos, t, 0);
+}
+
+
+/*
+ *  Variable smoothing lengths, the coefficients change with every pair. Scalar loops and AVX2,
+ *  which the AVX-512 backend also uses
+ */
+
+static const double kernelPi = 3.14159192;
+
+static double densityScalar(double hi, const Vec3& pos, const SPHTile& t, unsigned int j) {
+    double density = 0.0;
+    for (; j < t.size; j++) {
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        double h = 0.5*(hi + t.h[j]);
+        if (r2 > h*h) continue;
+        double h3 = h*h*h;
+        double h_r = h - std::sqrt(r2);
+        density += t.mass[j]*15.0/(kernelPi*h3*h3)*h_r*h_r*h_r;
+    }
+    return density;
+}
+
+static Vec3 viscosityScalar(double hi, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t,
+                            unsigned int j) {
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        double dx = pos.x()-t.x[j], dy = pos.y()-t.y[j], dz = pos.z()-t.z[j];
+        double r2 = dx*dx + dy*dy + dz*dz;
+        double h = 0.5*(hi + t.h[j]);
+        if (r2 > h*h) continue;
+        double h2 = h*h;
+        double laplacian = 45.0/(kernelPi*h2*h2*h)*(1.0 - std::sqrt(r2)/h);
+        double coef = -t.mass[j]/t.density[j]/density*laplacian;
+        sum += coef*Vec3(t.vx[j]-vel.x(), t.vy[j]-vel.y(), t.vz[j]-vel.z());
+    }
+    return sum;
+}
+
+static Vec3 pressureScalar(double hi, const Vec3& pos, double pressure, double density, const SPHTile& t,
+                           unsigned int j) {
+    double pi_rho2 = pressure/(density*density);
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        Vec3 r(pos.x()-t.x[j], pos.y()-t.y[j], pos.z()-t.z[j]);
+        double r2 = r.squaredNorm();
+        double h = 0.5*(hi + t.h[j]);
+        if (r2 > h*h || r2 == 0.0) continue;
+        double h3 = h*h*h;
+        double r_norm = std::sqrt(r2);
+        double h_r = h - r_norm;
+        Vec3 gradient = r*(-45.0/(kernelPi*h3*h3)/r_norm*h_r*h_r);
+        double p_ij = -t.mass[j]*(pi_rho2 + t.pressure[j]/(t.density[j]*t.density[j]));
+        sum += p_ij*gradient;
+    }
+    return sum;
+}
+
+#ifdef SPH_KERNELS_X86
+
+// h_ij of 4 candidates
+__attribute__((target("avx2,fma")))
+static inline __m256d pairH(__m256d hi, const SPHTile& t, unsigned int j) {
+    return _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_add_pd(hi, _mm256_loadu_pd(&t.h[j])));
+}
+
+__attribute__((target("avx2,fma")))
+static double densityAVX2(double hi_var, const Vec3& pos, const SPHTile& t) {
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d hi = _mm256_set1_pd(hi_var), c = _mm256_set1_pd(15.0/kernelPi);
+    __m256d acc = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d h = pairH(hi, t, j);
+        __m256d in = _mm256_cmp_pd(r2, _mm256_mul_pd(h, h), _CMP_LE_OQ);
+
+        // 15/(pi h^6) (h-r)^3
+        __m256d h3 = _mm256_mul_pd(_mm256_mul_pd(h, h), h);
+        __m256d h_r = _mm256_sub_pd(h, _mm256_sqrt_pd(r2));
+        __m256d w = _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(c, h_r), h_r), h_r), _mm256_mul_pd(h3, h3));
+        acc = _mm256_add_pd(acc, _mm256_and_pd(in, _mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), w)));
+    }
+    return hsum(acc) + densityScalar(hi_var, pos, t, j);
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 viscosityAVX2(double hi_var, const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) {
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d vxi = _mm256_set1_pd(vel.x()), vyi = _mm256_set1_pd(vel.y()), vzi = _mm256_set1_pd(vel.z());
+    const __m256d hi = _mm256_set1_pd(hi_var), one = _mm256_set1_pd(1.0);
+    const __m256d c = _mm256_set1_pd(-45.0/kernelPi), rhoi = _mm256_set1_pd(density);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d h = pairH(hi, t, j);
+        __m256d h2 = _mm256_mul_pd(h, h);
+        __m256d in = _mm256_cmp_pd(r2, h2, _CMP_LE_OQ);
+
+        // -m_j/rho_j/rho_i * 45/(pi h^5) (1 - r/h)
+        __m256d invH = _mm256_div_pd(one, h);
+        __m256d lap = _mm256_mul_pd(_mm256_div_pd(c, _mm256_mul_pd(_mm256_mul_pd(h2, h2), h)),
+                                    _mm256_fnmadd_pd(_mm256_sqrt_pd(r2), invH, one));
+        __m256d rhoij = _mm256_mul_pd(_mm256_loadu_pd(&t.density[j]), rhoi);
+        __m256d coef = _mm256_and_pd(in, _mm256_div_pd(_mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), lap), rhoij));
+
+        ax = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vx[j]), vxi), ax);
+        ay = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vy[j]), vyi), ay);
+        az = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vz[j]), vzi), az);
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az)) + viscosityScalar(hi_var, pos, vel, density, t, j);
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 pressureAVX2(double hi_var, const Vec3& pos, double pressure, double density, const SPHTile& t) {
+    const double pi_rho2 = pressure/(density*density);
+    const __m256d xi = _mm256_set1_pd(pos.x()), yi = _mm256_set1_pd(pos.y()), zi = _mm256_set1_pd(pos.z());
+    const __m256d hi = _mm256_set1_pd(hi_var), zero = _mm256_setzero_pd();
+    const __m256d c = _mm256_set1_pd(-45.0/kernelPi);
+    const __m256d pi = _mm256_set1_pd(pi_rho2);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    unsigned int j = 0;
+    for (; j+4 <= t.size; j += 4) {
+        __m256d dx = _mm256_sub_pd(xi, _mm256_loadu_pd(&t.x[j]));
+        __m256d dy = _mm256_sub_pd(yi, _mm256_loadu_pd(&t.y[j]));
+        __m256d dz = _mm256_sub_pd(zi, _mm256_loadu_pd(&t.z[j]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m256d h = pairH(hi, t, j);
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(r2, _mm256_mul_pd(h, h), _CMP_LE_OQ), _mm256_cmp_pd(r2, zero, _CMP_GT_OQ));
+
+        // -p_ij/m_j
+        __m256d rhoj = _mm256_loadu_pd(&t.density[j]);
+        __m256d p = _mm256_add_pd(pi, _mm256_div_pd(_mm256_loadu_pd(&t.pressure[j]), _mm256_mul_pd(rhoj, rhoj)));
+
+        // p_ij * -45/(pi h^6)/r * (h-r)^2
+        __m256d h3 = _mm256_mul_pd(_mm256_mul_pd(h, h), h);
+        __m256d r = _mm256_sqrt_pd(r2);
+        __m256d h_r = _mm256_sub_pd(h, r);
+        __m256d g = _mm256_mul_pd(_mm256_div_pd(c, _mm256_mul_pd(_mm256_mul_pd(h3, h3), r)), _mm256_mul_pd(h_r, h_r));
+        __m256d s = _mm256_and_pd(in, _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(&t.mass[j]), p), g));
+
+        ax = _mm256_fnmadd_pd(s, dx, ax);
+        ay = _mm256_fnmadd_pd(s, dy, ay);
+        az = _mm256_fnmadd_pd(s, dz, az);
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az)) + pressureScalar(hi_var, pos, pressure, density, t, j);
+}
+
+#endif // SPH_KERNELS_X86
+
+
+double SPHKernels::density(const Vec3& pos, double hi, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend != Scalar) return densityAVX2(hi, pos, t);
+#endif
+    return densityScalar(hi, pos, t, 0);
+}
+
+Vec3 SPHKernels::viscosity(const Vec3& pos, const Vec3& vel, double density, double hi, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend != Scalar) return viscosityAVX2(hi, pos, vel, density, t);
+#endif
+    return viscosityScalar(hi, pos, vel, density, t, 0);
+}
+
+Vec3 SPHKernels::pressure(const Vec3& pos, double pressure, double density, double hi, const SPHTile& t) const {
+#ifdef SPH_KERNELS_X86
+    if (backend != Scalar) return pressureAVX2(hi, pos, pressure, density, t);
+#endif
+    return pressureScalar(hi, pos, pressure, density, t, 0);
+}
+
+
+/*
+ *  Mixed precision: offsets and kernel values in float, products and sums in double. Scalar
+ *  loops, AVX2 with 8 candidates and AVX-512 with 16 per iteration. The pair terms of the
+ *  particles come from the double fields of the tile, so only the geometry is rounded. The
+ *  vector loops run up to the paddedSize of the tile, its padding adds nothing
+ */
+
+static double densityMixedScalar(const SPHKernels& k, const float* xi, const SPHTile& t, unsigned int j) {
+    const float h = float(k.h), h2 = float(k.h2), c = float(k.spikyCoef);
+    double density = 0.0;
+    for (; j < t.size; j++) {
+        float dx = xi[0]-t.fx[j], dy = xi[1]-t.fy[j], dz = xi[2]-t.fz[j];
+        float r2 = dx*dx + dy*dy + dz*dz;
+        if (r2 > h2) continue;
+        float h_r = h - std::sqrt(r2);
+        density += t.mass[j]*double(c*h_r*h_r*h_r);
+    }
+    return density;
+}
+
+static Vec3 viscosityMixedScalar(const SPHKernels& k, const float* xi, const Vec3& vel, double density,
+                                 const SPHTile& t, unsigned int j) {
+    const float h2 = float(k.h2), invH = float(k.invH), c = float(k.viscLapCoef);
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        float dx = xi[0]-t.fx[j], dy = xi[1]-t.fy[j], dz = xi[2]-t.fz[j];
+        float r2 = dx*dx + dy*dy + dz*dz;
+        if (r2 > h2) continue;
+        float laplacian = c*(1.0f - std::sqrt(r2)*invH);
+        double coef = -t.mass[j]/t.density[j]/density*laplacian;
+        sum += coef*Vec3(t.vx[j]-vel.x(), t.vy[j]-vel.y(), t.vz[j]-vel.z());
+    }
+    return sum;
+}
+
+static Vec3 pressureMixedScalar(const SPHKernels& k, const float* xi, double pressure, double density,
+                                const SPHTile& t, unsigned int j) {
+    const float h = float(k.h), h2 = float(k.h2), c = float(k.spikyGradCoef);
+    double pi_rho2 = pressure/(density*density);
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        float dx = xi[0]-t.fx[j], dy = xi[1]-t.fy[j], dz = xi[2]-t.fz[j];
+        float r2 = dx*dx + dy*dy + dz*dz;
+        // r2 == 0 is the particle itself
+        if (r2 > h2 || r2 == 0.0f) continue;
+        float r = std::sqrt(r2);
+        float h_r = h - r;
+        float g = c/r*h_r*h_r;
+        double p_ij = -t.mass[j]*(pi_rho2 + t.pressure[j]/(t.density[j]*t.density[j]));
+        sum += (p_ij*g)*Vec3(dx, dy, dz);
+    }
+    return sum;
+}
+
+static Vec3 gradientMixedScalar(const SPHKernels& k, const float* xi, const SPHTile& t, unsigned int j) {
+    const float h = float(k.h), h2 = float(k.h2), c = float(k.spikyGradCoef);
+    Vec3 sum(0.0, 0.0, 0.0);
+    for (; j < t.size; j++) {
+        float dx = xi[0]-t.fx[j], dy = xi[1]-t.fy[j], dz = xi[2]-t.fz[j];
+        float r2 = dx*dx + dy*dy + dz*dz;
+        if (r2 > h2 || r2 == 0.0f) continue;
+        float r = std::sqrt(r2);
+        float h_r = h - r;
+        sum += (t.mass[j]*double(c/r*h_r*h_r))*Vec3(dx, dy, dz);
+    }
+    return sum;
+}
+
+#ifdef SPH_KERNELS_X86
+
+// the float lanes 0-3 and 4-7 as doubles
+__attribute__((target("avx2,fma")))
+static inline __m256d lowHalf(__m256 v) { return _mm256_cvtps_pd(_mm256_castps256_ps128(v)); }
+__attribute__((target("avx2,fma")))
+static inline __m256d highHalf(__m256 v) { return _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)); }
+
+__attribute__((target("avx2,fma")))
+static double densityMixedAVX2(const SPHKernels& k, const float* p, const SPHTile& t) {
+    const __m256 xi = _mm256_set1_ps(p[0]), yi = _mm256_set1_ps(p[1]), zi = _mm256_set1_ps(p[2]);
+    const __m256 h = _mm256_set1_ps(float(k.h)), h2 = _mm256_set1_ps(float(k.h2)), c = _mm256_set1_ps(float(k.spikyCoef));
+    __m256d acc = _mm256_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 8) {
+        __m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(&t.fx[j]));
+        __m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(&t.fy[j]));
+        __m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(&t.fz[j]));
+        __m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+        __m256 in = _mm256_cmp_ps(r2, h2, _CMP_LE_OQ);
+
+        __m256 h_r = _mm256_sub_ps(h, _mm256_sqrt_ps(r2));
+        __m256 w = _mm256_and_ps(in, _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(c, h_r), h_r), h_r));
+        acc = _mm256_fmadd_pd(_mm256_loadu_pd(&t.mass[j]), lowHalf(w), acc);
+        acc = _mm256_fmadd_pd(_mm256_loadu_pd(&t.mass[j+4]), highHalf(w), acc);
+    }
+    return hsum(acc);
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 viscosityMixedAVX2(const SPHKernels& k, const float* p, const Vec3& vel, double density, const SPHTile& t) {
+    const __m256 xi = _mm256_set1_ps(p[0]), yi = _mm256_set1_ps(p[1]), zi = _mm256_set1_ps(p[2]);
+    const __m256 h2 = _mm256_set1_ps(float(k.h2)), invH = _mm256_set1_ps(float(k.invH)), one = _mm256_set1_ps(1.0f);
+    const __m256 c = _mm256_set1_ps(float(-k.viscLapCoef));
+    const __m256d vxi = _mm256_set1_pd(vel.x()), vyi = _mm256_set1_pd(vel.y()), vzi = _mm256_set1_pd(vel.z());
+    const __m256d rhoi = _mm256_set1_pd(density);
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 8) {
+        __m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(&t.fx[j]));
+        __m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(&t.fy[j]));
+        __m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(&t.fz[j]));
+        __m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+        __m256 in = _mm256_cmp_ps(r2, h2, _CMP_LE_OQ);
+        __m256 lap = _mm256_and_ps(in, _mm256_mul_ps(c, _mm256_fnmadd_ps(_mm256_sqrt_ps(r2), invH, one)));
+
+        // -m_j/rho_j/rho_i * lap W, 4 candidates at a time
+        for (unsigned int i = j; i < j+8; i += 4) {
+            __m256d l = i == j ? lowHalf(lap) : highHalf(lap);
+            __m256d rhoij = _mm256_mul_pd(_mm256_loadu_pd(&t.density[i]), rhoi);
+            __m256d coef = _mm256_div_pd(_mm256_mul_pd(_mm256_loadu_pd(&t.mass[i]), l), rhoij);
+            ax = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vx[i]), vxi), ax);
+            ay = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vy[i]), vyi), ay);
+            az = _mm256_fmadd_pd(coef, _mm256_sub_pd(_mm256_loadu_pd(&t.vz[i]), vzi), az);
+        }
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az));
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 pressureMixedAVX2(const SPHKernels& k, const float* p, double pressure, double density, const SPHTile& t) {
+    const __m256 xi = _mm256_set1_ps(p[0]), yi = _mm256_set1_ps(p[1]), zi = _mm256_set1_ps(p[2]);
+    const __m256 h = _mm256_set1_ps(float(k.h)), h2 = _mm256_set1_ps(float(k.h2)), zero = _mm256_setzero_ps();
+    const __m256 c = _mm256_set1_ps(float(k.spikyGradCoef));
+    const __m256d pi = _mm256_set1_pd(pressure/(density*density));
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 8) {
+        __m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(&t.fx[j]));
+        __m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(&t.fy[j]));
+        __m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(&t.fz[j]));
+        __m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+        __m256 in = _mm256_and_ps(_mm256_cmp_ps(r2, h2, _CMP_LE_OQ), _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+
+        // spikyGradCoef/r * (h-r)^2
+        __m256 r = _mm256_sqrt_ps(r2);
+        __m256 h_r = _mm256_sub_ps(h, r);
+        __m256 g = _mm256_and_ps(in, _mm256_mul_ps(_mm256_div_ps(c, r), _mm256_mul_ps(h_r, h_r)));
+
+        // times p_ij, 4 candidates at a time
+        for (unsigned int i = j; i < j+8; i += 4) {
+            bool low = i == j;
+            __m256d rhoj = _mm256_loadu_pd(&t.density[i]);
+            __m256d pij = _mm256_add_pd(pi, _mm256_div_pd(_mm256_loadu_pd(&t.pressure[i]), _mm256_mul_pd(rhoj, rhoj)));
+            __m256d s = _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(&t.mass[i]), pij), low ? lowHalf(g) : highHalf(g));
+            ax = _mm256_fnmadd_pd(s, low ? lowHalf(dx) : highHalf(dx), ax);
+            ay = _mm256_fnmadd_pd(s, low ? lowHalf(dy) : highHalf(dy), ay);
+            az = _mm256_fnmadd_pd(s, low ? lowHalf(dz) : highHalf(dz), az);
+        }
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az));
+}
+
+__attribute__((target("avx2,fma")))
+static Vec3 gradientMixedAVX2(const SPHKernels& k, const float* p, const SPHTile& t) {
+    const __m256 xi = _mm256_set1_ps(p[0]), yi = _mm256_set1_ps(p[1]), zi = _mm256_set1_ps(p[2]);
+    const __m256 h = _mm256_set1_ps(float(k.h)), h2 = _mm256_set1_ps(float(k.h2)), zero = _mm256_setzero_ps();
+    const __m256 c = _mm256_set1_ps(float(k.spikyGradCoef));
+    __m256d ax = _mm256_setzero_pd(), ay = _mm256_setzero_pd(), az = _mm256_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 8) {
+        __m256 dx = _mm256_sub_ps(xi, _mm256_loadu_ps(&t.fx[j]));
+        __m256 dy = _mm256_sub_ps(yi, _mm256_loadu_ps(&t.fy[j]));
+        __m256 dz = _mm256_sub_ps(zi, _mm256_loadu_ps(&t.fz[j]));
+        __m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+        __m256 in = _mm256_and_ps(_mm256_cmp_ps(r2, h2, _CMP_LE_OQ), _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+
+        __m256 r = _mm256_sqrt_ps(r2);
+        __m256 h_r = _mm256_sub_ps(h, r);
+        __m256 g = _mm256_and_ps(in, _mm256_mul_ps(_mm256_div_ps(c, r), _mm256_mul_ps(h_r, h_r)));
+
+        for (unsigned int i = j; i < j+8; i += 4) {
+            bool low = i == j;
+            __m256d s = _mm256_mul_pd(_mm256_loadu_pd(&t.mass[i]), low ? lowHalf(g) : highHalf(g));
+            ax = _mm256_fmadd_pd(s, low ? lowHalf(dx) : highHalf(dx), ax);
+            ay = _mm256_fmadd_pd(s, low ? lowHalf(dy) : highHalf(dy), ay);
+            az = _mm256_fmadd_pd(s, low ? lowHalf(dz) : highHalf(dz), az);
+        }
+    }
+    return Vec3(hsum(ax), hsum(ay), hsum(az));
+}
+
+// the float lanes 0-7 and 8-15 as doubles
+__attribute__((target("avx512f")))
+static inline __m512d lowHalf(__m512 v) { return _mm512_cvtps_pd(_mm512_castps512_ps256(v)); }
+__attribute__((target("avx512f")))
+static inline __m512d highHalf(__m512 v) {
+    return _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+
+__attribute__((target("avx512f")))
+static double densityMixedAVX512(const SPHKernels& k, const float* p, const SPHTile& t) {
+    const __m512 xi = _mm512_set1_ps(p[0]), yi = _mm512_set1_ps(p[1]), zi = _mm512_set1_ps(p[2]);
+    const __m512 h = _mm512_set1_ps(float(k.h)), h2 = _mm512_set1_ps(float(k.h2)), c = _mm512_set1_ps(float(k.spikyCoef));
+    __m512d acc = _mm512_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 16) {
+        __m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(&t.fx[j]));
+        __m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(&t.fy[j]));
+        __m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(&t.fz[j]));
+        __m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+        __mmask16 in = _mm512_cmp_ps_mask(r2, h2, _CMP_LE_OQ);
+
+        __m512 h_r = _mm512_sub_ps(h, _mm512_sqrt_ps(r2));
+        __m512 w = _mm512_maskz_mul_ps(in, _mm512_mul_ps(_mm512_mul_ps(c, h_r), h_r), h_r);
+        acc = _mm512_fmadd_pd(_mm512_loadu_pd(&t.mass[j]), lowHalf(w), acc);
+        acc = _mm512_fmadd_pd(_mm512_loadu_pd(&t.mass[j+8]), highHalf(w), acc);
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx512f")))
+static Vec3 viscosityMixedAVX512(const SPHKernels& k, const float* p, const Vec3& vel, double density, const SPHTile& t) {
+    const __m512 xi = _mm512_set1_ps(p[0]), yi = _mm512_set1_ps(p[1]), zi = _mm512_set1_ps(p[2]);
+    const __m512 h2 = _mm512_set1_ps(float(k.h2)), invH = _mm512_set1_ps(float(k.invH)), one = _mm512_set1_ps(1.0f);
+    const __m512 c = _mm512_set1_ps(float(-k.viscLapCoef));
+    const __m512d vxi = _mm512_set1_pd(vel.x()), vyi = _mm512_set1_pd(vel.y()), vzi = _mm512_set1_pd(vel.z());
+    const __m512d rhoi = _mm512_set1_pd(density);
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 16) {
+        __m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(&t.fx[j]));
+        __m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(&t.fy[j]));
+        __m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(&t.fz[j]));
+        __m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+        __mmask16 in = _mm512_cmp_ps_mask(r2, h2, _CMP_LE_OQ);
+        __m512 lap = _mm512_maskz_mul_ps(in, c, _mm512_fnmadd_ps(_mm512_sqrt_ps(r2), invH, one));
+
+        // -m_j/rho_j/rho_i * lap W, 8 candidates at a time
+        for (unsigned int i = j; i < j+16; i += 8) {
+            __m512d l = i == j ? lowHalf(lap) : highHalf(lap);
+            __m512d rhoij = _mm512_mul_pd(_mm512_loadu_pd(&t.density[i]), rhoi);
+            __m512d coef = _mm512_div_pd(_mm512_mul_pd(_mm512_loadu_pd(&t.mass[i]), l), rhoij);
+            ax = _mm512_fmadd_pd(coef, _mm512_sub_pd(_mm512_loadu_pd(&t.vx[i]), vxi), ax);
+            ay = _mm512_fmadd_pd(coef, _mm512_sub_pd(_mm512_loadu_pd(&t.vy[i]), vyi), ay);
+            az = _mm512_fmadd_pd(coef, _mm512_sub_pd(_mm512_loadu_pd(&t.vz[i]), vzi), az);
+        }
+    }
+    return Vec3(_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay), _mm512_reduce_add_pd(az));
+}
+
+__attribute__((target("avx512f")))
+static Vec3 pressureMixedAVX512(const SPHKernels& k, const float* p, double pressure, double density, const SPHTile& t) {
+    const __m512 xi = _mm512_set1_ps(p[0]), yi = _mm512_set1_ps(p[1]), zi = _mm512_set1_ps(p[2]);
+    const __m512 h = _mm512_set1_ps(float(k.h)), h2 = _mm512_set1_ps(float(k.h2)), zero = _mm512_setzero_ps();
+    const __m512 c = _mm512_set1_ps(float(k.spikyGradCoef));
+    const __m512d pi = _mm512_set1_pd(pressure/(density*density));
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 16) {
+        __m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(&t.fx[j]));
+        __m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(&t.fy[j]));
+        __m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(&t.fz[j]));
+        __m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+        __mmask16 in = _mm512_cmp_ps_mask(r2, h2, _CMP_LE_OQ) & _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+
+        // spikyGradCoef/r * (h-r)^2
+        __m512 r = _mm512_sqrt_ps(r2);
+        __m512 h_r = _mm512_sub_ps(h, r);
+        __m512 g = _mm512_maskz_mul_ps(in, _mm512_div_ps(c, r), _mm512_mul_ps(h_r, h_r));
+
+        // times p_ij, 8 candidates at a time
+        for (unsigned int i = j; i < j+16; i += 8) {
+            bool low = i == j;
+            __m512d rhoj = _mm512_loadu_pd(&t.density[i]);
+            __m512d pij = _mm512_add_pd(pi, _mm512_div_pd(_mm512_loadu_pd(&t.pressure[i]), _mm512_mul_pd(rhoj, rhoj)));
+            __m512d s = _mm512_mul_pd(_mm512_mul_pd(_mm512_loadu_pd(&t.mass[i]), pij), low ? lowHalf(g) : highHalf(g));
+            ax = _mm512_fnmadd_pd(s, low ? lowHalf(dx) : highHalf(dx), ax);
+            ay = _mm512_fnmadd_pd(s, low ? lowHalf(dy) : highHalf(dy), ay);
+            az = _mm512_fnmadd_pd(s, low ? lowHalf(dz) : highHalf(dz), az);
+        }
+    }
+    return Vec3(_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay), _mm512_reduce_add_pd(az));
+}
+
+__attribute__((target("avx512f")))
+static Vec3 gradientMixedAVX512(const SPHKernels& k, const float* p, const SPHTile& t) {
+    const __m512 xi = _mm512_set1_ps(p[0]), yi = _mm512_set1_ps(p[1]), zi = _mm512_set1_ps(p[2]);
+    const __m512 h = _mm512_set1_ps(float(k.h)), h2 = _mm512_set1_ps(float(k.h2)), zero = _mm512_setzero_ps();
+    const __m512 c = _mm512_set1_ps(float(k.spikyGradCoef));
+    __m512d ax = _mm512_setzero_pd(), ay = _mm512_setzero_pd(), az = _mm512_setzero_pd();
+
+    for (unsigned int j = 0; j < t.paddedSize; j += 16) {
+        __m512 dx = _mm512_sub_ps(xi, _mm512_loadu_ps(&t.fx[j]));
+        __m512 dy = _mm512_sub_ps(yi, _mm512_loadu_ps(&t.fy[j]));
+        __m512 dz = _mm512_sub_ps(zi, _mm512_loadu_ps(&t.fz[j]));
+        __m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+        __mmask16 in = _mm512_cmp_ps_mask(r2, h2, _CMP_LE_OQ) & _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+
+        __m512 r = _mm512_sqrt_ps(r2);
+        __m512 h_r = _mm512_sub_ps(h, r);
+        __m512 g = _mm512_maskz_mul_ps(in, _mm512_div_ps(c, r), _mm512_mul_ps(h_r, h_r));
+
+        for (unsigned int i = j; i < j+16; i += 8) {
+            bool low = i == j;
+            __m512d s = _mm512_mul_pd(_mm512_loadu_pd(&t.mass[i]), low ? lowHalf(g) : highHalf(g));
+            ax = _mm512_fmadd_pd(s, low ? lowHalf(dx) : highHalf(dx), ax);
+            ay = _mm512_fmadd_pd(s, low ? lowHalf(dy) : highHalf(dy), ay);
+            az = _mm512_fmadd_pd(s, low ? lowHalf(dz) : highHalf(dz), az);
+        }
+    }
+    return Vec3(_mm512_reduce_add_pd(ax), _mm512_reduce_add_pd(ay), _mm512_reduce_add_pd(az));
+}
+
+#endif // SPH_KERNELS_X86
+
+
+double SPHKernels::densityMixed(const Vec3& pos, const SPHTile& t) const {
+    float p[3];
+    t.relative(pos, p);
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return densityMixedAVX512(*this, p, t);
+    if (backend == AVX2)   return densityMixedAVX2(*this, p, t);
+#endif
+    return densityMixedScalar(*this, p, t, 0);
+}
+
+Vec3 SPHKernels::viscosityMixed(const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) const {
+    float p[3];
+    t.relative(pos, p);
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return viscosityMixedAVX512(*this, p, vel, density, t);
+    if (backend == AVX2)   return viscosityMixedAVX2(*this, p, vel, density, t);
+#endif
+    return viscosityMixedScalar(*this, p, vel, density, t, 0);
+}
+
+Vec3 SPHKernels::pressureMixed(const Vec3& pos, double pressure, double density, const SPHTile& t) const {
+    float p[3];
+    t.relative(pos, p);
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return pressureMixedAVX512(*this, p, pressure, density, t);
+    if (backend == AVX2)   return pressureMixedAVX2(*this, p, pressure, density, t);
+#endif
+    return pressureMixedScalar(*this, p, pressure, density, t, 0);
+}
+
+Vec3 SPHKernels::gradientMixed(const Vec3& pos, const SPHTile& t) const {
+    float p[3];
+    t.relative(pos, p);
+#ifdef SPH_KERNELS_X86
+    if (backend == AVX512) return gradientMixedAVX512(*this, p, t);
+    if (backend == AVX2)   return gradientMixedAVX2(*this, p, t);
+#endif
+    return gradientMixedScalar(*this, p, t, 0);
+}
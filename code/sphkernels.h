@@ -0,0 +1,80 @@
+#ifndef SPHKERNELS_H
+#define SPHKERNELS_H
+
+#include <cmath>
+#include "sphtile.h"
+
+/*
+ *  Spiky and viscosity kernels with their normalization constants computed once per h. The
+ *  scalar versions take the squared distance, already tested against h2 by the caller. The
+ *  batched versions evaluate one particle against every candidate of a tile, with AVX-512 or
+ *  AVX2 when the CPU has them and a scalar loop otherwise. Fluid and boundary candidates come
+ *  in separate tiles, so no loop tests the particle type.
+ *
+ *  The mixed precision sums compute the offsets and the kernel values in float lanes, twice as
+ *  many per vector, from the positions of the tile relative to its origin, and accumulate the
+ *  products with the masses, densities, pressures and velocities in double.
+ */
+class SPHKernels {
+public:
+    enum Backend {
+        Scalar = 0,
+        AVX2   = 1,
+        AVX512 = 2,
+    };
+
+    SPHKernels(double h_var = 1.0);
+
+    void setH(double h_var);
+
+    static Backend bestBackend();
+    static const char* backendName(Backend b);
+
+    // W(r), r2 <= h2
+    double spiky(double r2) const {
+        double h_r = h - std::sqrt(r2);
+        return spikyCoef*h_r*h_r*h_r;
+    }
+
+    // grad W(r), 0 < r2 <= h2
+    Vec3 spikyGradient(const Vec3& r, double r2) const {
+        double r_norm = std::sqrt(r2);
+        double h_r = h - r_norm;
+        return r*(spikyGradCoef/r_norm*h_r*h_r);
+    }
+
+    // laplacian of the viscosity kernel, r2 <= h2
+    double viscosityLaplacian(double r2) const {
+        return viscLapCoef*(1.0 - std::sqrt(r2)*invH);
+    }
+
+    // sum of m_j W(x_i - x_j) over the tile, x_i included if it is in it
+    double density(const Vec3& pos, const SPHTile& t) const;
+
+    // sum of -m_j/rho_j (v_j - v_i)/rho_i lap W(x_i - x_j) over the tile
+    Vec3 viscosity(const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) const;
+
+    // sum of p_ij grad W(x_i - x_j) over a tile of fluid particles
+    Vec3 pressure(const Vec3& pos, double pressure, double density, const SPHTile& t) const;
+
+    // sum of m_j grad W(x_i - x_j) over the tile, x_i skipped if it is in it
+    Vec3 gradient(const Vec3& pos, const SPHTile& t) const;
+
+    // the same sums with variable smoothing lengths: candidate j uses the support
+    // h_ij = (hi + t.h[j])/2, the tile has to be loaded with the smoothing lengths
+    double density(const Vec3& pos, double hi, const SPHTile& t) const;
+    Vec3 viscosity(const Vec3& pos, const Vec3& vel, double density, double hi, const SPHTile& t) const;
+    Vec3 pressure(const Vec3& pos, double pressure, double density, double hi, const SPHTile& t) const;
+
+    // the same four sums in mixed precision, the tile needs its relativePositions
+    double densityMixed(const Vec3& pos, const SPHTile& t) const;
+    Vec3 viscosityMixed(const Vec3& pos, const Vec3& vel, double density, const SPHTile& t) const;
+    Vec3 pressureMixed(const Vec3& pos, double pressure, double density, const SPHTile& t) const;
+    Vec3 gradientMixed(const Vec3& pos, const SPHTile& t) const;
+
+    double h, h2, invH;
+    double spikyCoef, spikyGradCoef, viscLapCoef;
+    Backend backend;
+};
+
+#endif // SPHKERNELS_H
@@ -0,0 +1,145 @@
+#ifndef SPHTILE_H
+#define SPHTILE_H
+
+#include <QVector>
+#include "particle.h"
+#include "periodicdomain.h"
+
+/*
+ *  Structure of arrays copy of the candidates returned by a neighbor query. It is filled once
+ *  per query, either for a single particle or for a whole cell, and then every particle of the
+ *  group is evaluated against it with contiguous loads.
+ */
+class SPHTile {
+public:
+    enum Fields {
+        Positions  = 0, // positions, masses and types are always loaded
+        Velocities = 1,
+        Densities  = 2, // densities and pressures
+    };
+
+    // masses, when given, replace the particle masses: boundary tiles carry their psi volumes.
+    // smoothingLengths, when given, are copied to h for the adaptive resolution
+    void load(const QVector<Particle *>& parts, const QVector<unsigned int>& queryIds, unsigned int n, int fields,
+              const QVector<double>* masses = nullptr, const QVector<double>* smoothingLengths = nullptr){
+        // with relativePositions the tile is padded to whole vectors of the mixed precision sums
+        unsigned int capacity = relativePositions ? (n + MixedLanes - 1)/MixedLanes*MixedLanes : n;
+        if(int(capacity) > ids.size()){
+            ids.resize(capacity); type.resize(capacity);
+            x.resize(capacity); y.resize(capacity); z.resize(capacity); mass.resize(capacity);
+            vx.resize(capacity); vy.resize(capacity); vz.resize(capacity);
+            density.resize(capacity); pressure.resize(capacity);
+        }
+        size = n;
+        paddedSize = capacity;
+
+        // offsets from the first candidate, within twice the search radius of every other one
+        float *qx = nullptr, *qy = nullptr, *qz = nullptr;
+        if(relativePositions && n > 0){
+            if(int(capacity) > fx.size()){
+                fx.resize(capacity); fy.resize(capacity); fz.resize(capacity);
+            }
+            qx = fx.data(); qy = fy.data(); qz = fz.data();
+            origin = parts[queryIds[0]]->pos;
+        }
+
+        if(smoothingLengths){
+            if(int(n) > h.size()) h.resize(n);
+            for(unsigned int j=0; j<n; j++) h[j] = (*smoothingLengths)[queryIds[j]];
+        }
+
+        for(unsigned int j=0; j<n; j++){
+            const Particle* p = parts[queryIds[j]];
+            ids[j]  = queryIds[j];
+            type[j] = p->type;
+            x[j] = p->pos.x();
+            y[j] = p->pos.y();
+            z[j] = p->pos.z();
+            mass[j] = masses ? (*masses)[queryIds[j]] : p->mass;
+            if(qx){
+                qx[j] = float(p->pos.x() - origin.x());
+                qy[j] = float(p->pos.y() - origin.y());
+                qz[j] = float(p->pos.z() - origin.z());
+            }
+        }
+        if(fields & Velocities){
+            for(unsigned int j=0; j<n; j++){
+                const Particle* p = parts[queryIds[j]];
+                vx[j] = p->vel.x();
+                vy[j] = p->vel.y();
+                vz[j] = p->vel.z();
+            }
+        }
+        if(fields & Densities){
+            for(unsigned int j=0; j<n; j++){
+                const Particle* p = parts[queryIds[j]];
+                density[j]  = p->density;
+                pressure[j] = p->pressure;
+            }
+        }
+
+        // padding out of reach, without mass and with finite terms
+        if(qx){
+            for(unsigned int j=n; j<capacity; j++){
+                qx[j] = qy[j] = qz[j] = 1e18f;
+                mass[j] = 0.0;
+                vx[j] = vy[j] = vz[j] = 0.0;
+                density[j] = 1.0;
+                pressure[j] = 0.0;
+            }
+        }
+    }
+
+    // in a periodic domain, moves the loaded positions to their images closest to ref, so the
+    // kernels see the minimum image displacements without knowing about the domain
+    void nearestImages(const PeriodicDomain& domain, const Vec3& ref){
+        double* coords[3] = {x.data(), y.data(), z.data()};
+        for(int a=0; a<3; a++){
+            if(!domain.isPeriodic(a)) continue;
+            for(unsigned int j=0; j<size; j++) coords[a][j] = domain.nearestImage(coords[a][j], ref[a], a);
+        }
+        if(relativePositions) setOrigin(ref);
+    }
+
+    // positions relative to origin in single precision, for the mixed precision sums of
+    // SPHKernels. Offsets from a point next to the particles keep the digits a float of the
+    // absolute coordinates would lose. load and nearestImages set them with relativePositions,
+    // load also pads the tile to paddedSize
+    void setOrigin(const Vec3& origin_var){
+        origin = origin_var;
+        if(int(size) > fx.size()){
+            fx.resize(size); fy.resize(size); fz.resize(size);
+        }
+        // through the pointers, QVector::operator[] would check for a detach on every element
+        const double *px = x.constData(), *py = y.constData(), *pz = z.constData();
+        float *qx = fx.data(), *qy = fy.data(), *qz = fz.data();
+        const double ox = origin.x(), oy = origin.y(), oz = origin.z();
+        for(unsigned int j=0; j<size; j++){
+            qx[j] = float(px[j] - ox);
+            qy[j] = float(py[j] - oy);
+            qz[j] = float(pz[j] - oz);
+        }
+    }
+
+    // offset of pos from the origin, rounded like the ones of the tile
+    void relative(const Vec3& pos, float r[3]) const {
+        r[0] = float(pos.x() - origin.x());
+        r[1] = float(pos.y() - origin.y());
+        r[2] = float(pos.z() - origin.z());
+    }
+
+    static const unsigned int MixedLanes = 16;
+
+    unsigned int size = 0, paddedSize = 0;
+    bool relativePositions = false;
+    QVector<unsigned int> ids;
+    QVector<int> type;
+    QVector<double> x, y, z, mass;
+    QVector<double> vx, vy, vz;
+    QVector<double> density, pressure;
+    QVector<double> h;
+    Vec3 origin = Vec3(0,0,0);
+    QVector<float> fx, fy, fz;
+};
+
+#endif // SPHTILE_H
@@ -0,0 +1,375 @@
+#include "surfacereconstruction.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+#include <algorithm>
+#include <cmath>
+
+
+namespace {
+
+// corner c of a cell sits at (c&1, (c>>1)&1, (c>>2)&1), edge 4a+k runs along axis a
+struct MarchingCubesTables {
+    int edgeCorner[12][2];
+    int edgeAxis[12];
+    std::vector<int> triangles[256];
+
+    MarchingCubesTables();
+};
+
+// The triangles of every case come from the faces of the cell: on each face every run of inside
+// corners is cut off by one segment, so the diagonal cases keep their inside corners apart and
+// two cells sharing a face cut it the same way. Oriented along the face cycles, the segments
+// chain into closed loops around the cell, which are triangulated as fans.
+MarchingCubesTables::MarchingCubesTables() {
+    int edgeOf[8][8];
+    for (int a = 0; a < 3; a++) {
+        int u = (a+1)%3, v = (a+2)%3;
+        for (int k = 0; k < 4; k++) {
+            int c0 = ((k&1) << u) | ((k>>1) << v);
+            int c1 = c0 | (1 << a);
+            int e = 4*a + k;
+            edgeCorner[e][0] = c0;
+            edgeCorner[e][1] = c1;
+            edgeAxis[e] = a;
+            edgeOf[c0][c1] = edgeOf[c1][c0] = e;
+        }
+    }
+
+    for (int config = 0; config < 256; config++) {
+        // next[e]: the segment starting on edge e ends on edge next[e]
+        int next[12];
+        std::fill(next, next+12, -1);
+        for (int a = 0; a < 3; a++) {
+            int u = (a+1)%3, v = (a+2)%3;
+            for (int side = 0; side < 2; side++) {
+                // corners counterclockwise seen from outside of the cell
+                int cycle[4] = {0, 1 << u, (1 << u) | (1 << v), 1 << v};
+                if (side == 0) std::swap(cycle[1], cycle[3]);
+                bool inside[4];
+                for (int i = 0; i < 4; i++) {
+                    cycle[i] |= side << a;
+                    inside[i] = (config >> cycle[i]) & 1;
+                }
+                for (int i = 0; i < 4; i++) {
+                    if (!inside[i] || inside[(i+3)%4]) continue;
+                    int j = i;
+                    while (inside[(j+1)%4]) j = (j+1)%4;
+                    next[edgeOf[cycle[(i+3)%4]][cycle[i]]] = edgeOf[cycle[j]][cycle[(j+1)%4]];
+                }
+            }
+        }
+
+        bool visited[12] = {false};
+        for (int e = 0; e < 12; e++) {
+            if (next[e] < 0 || visited[e]) continue;
+            std::vector<int> loop;
+            for (int f = e; !visited[f]; f = next[f]) {
+                visited[f] = true;
+                loop.push_back(f);
+            }
+            for (unsigned int k = 1; k+1 < loop.size(); k++) {
+                triangles[config].push_back(loop[0]);
+                triangles[config].push_back(loop[k]);
+                triangles[config].push_back(loop[k+1]);
+            }
+        }
+    }
+}
+
+const MarchingCubesTables& marchingCubes() {
+    static const MarchingCubesTables tables;
+    return tables;
+}
+
+}
+
+
+SurfaceReconstruction::SurfaceReconstruction() {
+}
+
+SurfaceReconstruction::~SurfaceReconstruction() {
+    if (!worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeUp.notify_all();
+    worker.join();
+}
+
+void SurfaceReconstruction::setSpacing(double particleSpacing) {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [&]{ return !jobPending; });
+    cellSize = 0.5*particleSpacing;
+    radius = 2*particleSpacing;
+    volume = particleSpacing*particleSpacing*particleSpacing;
+}
+
+void SurfaceReconstruction::setNumThreads(int numThreads) {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [&]{ return !jobPending; });
+    pool.setNumThreads(numThreads);
+}
+
+Model SurfaceReconstruction::reconstruct(const std::vector<Vec3>& positions) {
+    QElapsedTimer timer;
+    timer.start();
+
+    const int reach = int(std::ceil(radius/(BlockSize*cellSize)));
+    const int n = int(positions.size());
+
+    // the blocks of the nodes every splat reaches, and of the nodes one below them so that the
+    // cells ending in the splat are marched too; the other nodes of the field are 0
+    field.clear();
+    particleBlock.resize(n);
+    for (int i = 0; i < n; i++) {
+        const Vec3& x = positions[i];
+        int own[3], lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            own[a] = FieldGrid::blockCoord(int(std::floor(x[a]/cellSize)));
+            lo[a] = FieldGrid::blockCoord(int(std::ceil((x[a] - radius)/cellSize)) - 1);
+            hi[a] = FieldGrid::blockCoord(int(std::floor((x[a] + radius)/cellSize)));
+        }
+        particleBlock[i] = field.touch(own[0], own[1], own[2], 0.f);
+        for (int bx = lo[0]; bx <= hi[0]; bx++)
+            for (int by = lo[1]; by <= hi[1]; by++)
+                for (int bz = lo[2]; bz <= hi[2]; bz++)
+                    field.touch(bx, by, bz, 0.f);
+    }
+    const int numActive = field.getNumBlocks();
+
+    // particles sorted by block
+    blockStart.assign(numActive + 1, 0);
+    for (int i = 0; i < n; i++) blockStart[particleBlock[i]]++;
+    int start = 0;
+    for (int b = 0; b <= numActive; b++) {
+        start += blockStart[b];
+        blockStart[b] = start;
+    }
+    blockParticles.resize(n);
+    for (int i = n-1; i >= 0; i--) blockParticles[--blockStart[particleBlock[i]]] = i;
+
+    // every block splats the particles around it, then marches its cells once all the blocks
+    // next to it are complete
+    scratch.resize(pool.getNumThreads());
+    if (int(meshes.size()) < numActive) meshes.resize(numActive);
+    field.forEachBlock(pool, ThreadPool::Dynamic, [&](int b, int) {
+        splatBlock(b, reach, positions);
+    });
+    field.forEachBlock(pool, ThreadPool::Dynamic, [&](int b, int thread) {
+        gatherBlock(b, scratch[thread]);
+        marchBlock(b, meshes[b], scratch[thread]);
+    });
+
+    // the blocks in order, their indices shifted past the vertices of the previous ones
+    size_t numVertices = 0, numIndices = 0;
+    for (int b = 0; b < numActive; b++) {
+        numVertices += meshes[b].coords.size()/3;
+        numIndices += meshes[b].indices.size();
+    }
+    std::vector<float> coords, normals;
+    std::vector<unsigned int> indices;
+    coords.reserve(3*numVertices);
+    normals.reserve(3*numVertices);
+    indices.reserve(numIndices);
+    for (int b = 0; b < numActive; b++) {
+        const BlockMesh& mesh = meshes[b];
+        unsigned int offset = coords.size()/3;
+        coords.insert(coords.end(), mesh.coords.begin(), mesh.coords.end());
+        normals.insert(normals.end(), mesh.normals.begin(), mesh.normals.end());
+        for (unsigned int i : mesh.indices) indices.push_back(offset + i);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    numBlocks = numActive;
+    numTriangles = int(indices.size()/3);
+    memoryBytes = field.getMemoryBytes();
+    ms = timer.nsecsElapsed()*1e-6;
+    return Model(coords, normals, indices);
+}
+
+void SurfaceReconstruction::splatBlock(int b, int reach, const std::vector<Vec3>& positions) {
+    FieldGrid::Block& block = field.getBlock(b);
+    const double R2 = radius*radius;
+    const double poly6 = volume*315.0/(64.0*M_PI*std::pow(radius, 9));
+    const int* c = block.coord;
+    Vec3 origin(c[0]*BlockSize*cellSize, c[1]*BlockSize*cellSize, c[2]*BlockSize*cellSize);
+
+    for (int x = c[0]-reach; x <= c[0]+reach; x++)
+        for (int y = c[1]-reach; y <= c[1]+reach; y++)
+            for (int z = c[2]-reach; z <= c[2]+reach; z++) {
+                int other = field.find(x, y, z);
+                if (other < 0) continue;
+                for (int p = blockStart[other]; p < blockStart[other+1]; p++) {
+                    Vec3 xp = positions[blockParticles[p]] - origin;
+                    int lo[3], hi[3];
+                    for (int a = 0; a < 3; a++) {
+                        lo[a] = std::max(0, int(std::ceil((xp[a] - radius)/cellSize)));
+                        hi[a] = std::min(BlockSize - 1, int(std::floor((xp[a] + radius)/cellSize)));
+                    }
+                    for (int i = lo[0]; i <= hi[0]; i++) {
+                        double dx = i*cellSize - xp[0];
+                        for (int j = lo[1]; j <= hi[1]; j++) {
+                            double dy = j*cellSize - xp[1];
+                            double rowR2 = R2 - dx*dx - dy*dy;
+                            if (rowR2 <= 0) continue;
+                            // only the nodes of the row inside the ball
+                            double half = std::sqrt(rowR2);
+                            int k0 = std::max(lo[2], int(std::ceil((xp[2] - half)/cellSize)));
+                            int k1 = std::min(hi[2], int(std::floor((xp[2] + half)/cellSize)));
+                            float* row = &block.values[FieldGrid::cellIndex(i, j, 0)];
+                            for (int k = k0; k <= k1; k++) {
+                                double dz = k*cellSize - xp[2];
+                                double q = rowR2 - dz*dz;
+                                row[k] += float(poly6*q*q*q);
+                            }
+                        }
+                    }
+                }
+            }
+}
+
+void SurfaceReconstruction::gatherBlock(int b, Scratch& s) {
+    // nodes -1 to BlockSize+1 along each axis
+    const int N = BlockSize + 3;
+    s.field.resize(N*N*N);
+    const int* c = field.getBlock(b).coord;
+
+    // values of the block and of the ones next to it, null where nothing was splatted
+    const float* tiles[3][3][3];
+    for (int x = 0; x < 3; x++)
+        for (int y = 0; y < 3; y++)
+            for (int z = 0; z < 3; z++) {
+                int other = field.find(c[0]+x-1, c[1]+y-1, c[2]+z-1);
+                tiles[x][y][z] = other < 0 ? nullptr : field.getBlock(other).values;
+            }
+
+    auto tileOf = [](int i) { return i < 0 ? 0 : (i < BlockSize ? 1 : 2); };
+    for (int i = -1; i <= BlockSize+1; i++) {
+        int ti = tileOf(i), li = i - (ti-1)*BlockSize;
+        for (int j = -1; j <= BlockSize+1; j++) {
+            int tj = tileOf(j), lj = j - (tj-1)*BlockSize;
+            float* row = &s.field[((i+1)*N + (j+1))*N];
+            for (int k = -1; k <= BlockSize+1; k++) {
+                int tk = tileOf(k), lk = k - (tk-1)*BlockSize;
+                const float* tile = tiles[ti][tj][tk];
+                row[k+1] = tile ? tile[FieldGrid::cellIndex(li, lj, lk)] : 0.f;
+            }
+        }
+    }
+}
+
+void SurfaceReconstruction::marchBlock(int b, BlockMesh& mesh, Scratch& s) {
+    const MarchingCubesTables& mc = marchingCubes();
+    const int N = BlockSize + 3, M = BlockSize + 1;
+    s.edgeVertex.assign(M*M*M*3, -1);
+    mesh.coords.clear();
+    mesh.normals.clear();
+    mesh.indices.clear();
+
+    auto value = [&](int i, int j, int k) {
+        return s.field[((i+1)*N + (j+1))*N + (k+1)];
+    };
+    // the field grows towards the fluid, the normals point away from it
+    auto normal = [&](int i, int j, int k) {
+        return Vec3(value(i-1,j,k) - value(i+1,j,k), value(i,j-1,k) - value(i,j+1,k), value(i,j,k-1) - value(i,j,k+1));
+    };
+    const int* coord = field.getBlock(b).coord;
+    Vec3 origin(coord[0]*BlockSize*cellSize, coord[1]*BlockSize*cellSize, coord[2]*BlockSize*cellSize);
+
+    // vertex on edge e of cell (i,j,k), created by the first cell asking for it
+    auto vertex = [&](int e, int i, int j, int k) {
+        int c0 = mc.edgeCorner[e][0], axis = mc.edgeAxis[e];
+        int node[3] = {i + (c0&1), j + ((c0>>1)&1), k + ((c0>>2)&1)};
+        int& v = s.edgeVertex[((node[0]*M + node[1])*M + node[2])*3 + axis];
+        if (v >= 0) return v;
+
+        int other[3] = {node[0], node[1], node[2]};
+        other[axis]++;
+        double fa = value(node[0], node[1], node[2]), fb = value(other[0], other[1], other[2]);
+        double t = (isoValue - fa)/(fb - fa);
+        Vec3 pos(node[0], node[1], node[2]);
+        pos[axis] += t;
+        pos = origin + cellSize*pos;
+        Vec3 n = (1 - t)*normal(node[0], node[1], node[2]) + t*normal(other[0], other[1], other[2]);
+        double len = n.norm();
+        if (len > 0) n /= len;
+
+        v = int(mesh.coords.size()/3);
+        for (int a = 0; a < 3; a++) {
+            mesh.coords.push_back(float(pos[a]));
+            mesh.normals.push_back(float(n[a]));
+        }
+        return v;
+    };
+
+    for (int i = 0; i < BlockSize; i++)
+        for (int j = 0; j < BlockSize; j++)
+            for (int k = 0; k < BlockSize; k++) {
+                int config = 0;
+                for (int c = 0; c < 8; c++)
+                    if (value(i + (c&1), j + ((c>>1)&1), k + ((c>>2)&1)) > isoValue) config |= 1 << c;
+                for (int e : mc.triangles[config]) mesh.indices.push_back(vertex(e, i, j, k));
+            }
+}
+
+void SurfaceReconstruction::submit(std::vector<Vec3>&& positions) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!worker.joinable()) worker = std::thread(&SurfaceReconstruction::workerLoop, this);
+    jobDone.wait(lock, [&]{ return !jobPending; });
+    jobPositions = std::move(positions);
+    jobPending = true;
+    wakeUp.notify_one();
+}
+
+bool SurfaceReconstruction::takeMesh(Model& mesh) {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [&]{ return !jobPending; });
+    if (!meshReady) return false;
+    mesh = jobMesh;
+    meshReady = false;
+    return true;
+}
+
+void SurfaceReconstruction::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wakeUp.wait(lock, [&]{ return quit || jobPending; });
+        if (quit) return;
+        std::vector<Vec3> positions;
+        positions.swap(jobPositions);
+        lock.unlock();
+        Model mesh = reconstruct(positions);
+        lock.lock();
+        jobMesh = mesh;
+        jobPending = false;
+        meshReady = true;
+        jobDone.notify_all();
+    }
+}
+
+QString SurfaceReconstruction::overlayLine() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return "Surface:  " + QString::number(numBlocks) + " blocks, " + QString::number(numTriangles)
+         + " triangles, " + QString::number(memoryBytes/1024) + " KB, " + QString::number(ms, 'f', 2) + " ms";
+}
+
+bool SurfaceReconstruction::writeOBJ(Model& mesh, const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) return false;
+    QTextStream out(&file);
+    const std::vector<float>& coords = mesh.getVertexCoords();
+    const std::vector<float>& normals = mesh.getNormals();
+    const std::vector<unsigned int>& indices = mesh.getIndices();
+    for (size_t i = 0; i < coords.size(); i += 3)
+        out << "v " << coords[i] << " " << coords[i+1] << " " << coords[i+2] << "\n";
+    for (size_t i = 0; i < normals.size(); i += 3)
+        out << "vn " << normals[i] << " " << normals[i+1] << " " << normals[i+2] << "\n";
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        out << "f";
+        for (int c = 0; c < 3; c++) out << " " << indices[i+c]+1 << "//" << indices[i+c]+1;
+        out << "\n";
+    }
+    return true;
+}
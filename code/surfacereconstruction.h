@@ -0,0 +1,99 @@
+#ifndef SURFACERECONSTRUCTION_H
+#define SURFACERECONSTRUCTION_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <QString>
+#include "defines.h"
+#include "model.h"
+#include "threadpool.h"
+#include "sparseblockgrid.h"
+
+/*
+ *  Fluid surface as an indexed triangle mesh. The particles are splatted into a SparseBlockGrid
+ *  holding only the blocks their splats reach, and marching cubes extracts the iso-surface of
+ *  every block in parallel. The field is sum_j V W(|x - x_j|, R)
+ *  with the poly6 kernel and V the volume of a particle of the lattice, about 1 inside the fluid,
+ *  and the surface is its 0.5 level. Vertices are shared within a block, their normals follow
+ *  the gradient of the field.
+ *
+ *  submit() hands the positions to a worker thread with its own pool and returns right away, the
+ *  next takeMesh() waits for that mesh, so it is built while the simulation takes its next step
+ *  and is shown one frame behind.
+ */
+class SurfaceReconstruction {
+public:
+    static constexpr int BlockSize = 8;
+
+    SurfaceReconstruction();
+    ~SurfaceReconstruction();
+
+    // particles of a lattice of the given spacing: cells of half of it, splats of twice it
+    void setSpacing(double particleSpacing);
+    void setNumThreads(int numThreads);
+
+    // builds the mesh on the calling thread, not while the worker builds one
+    Model reconstruct(const std::vector<Vec3>& positions);
+
+    // builds the mesh on the worker, after the one it may still be building
+    void submit(std::vector<Vec3>&& positions);
+    // waits for the submitted mesh, false if nothing was submitted since the last take
+    bool takeMesh(Model& mesh);
+
+    // blocks, triangles, grid memory and time of the last mesh
+    QString overlayLine() const;
+
+    // v, vn and f lines, false if the file cannot be written
+    static bool writeOBJ(Model& mesh, const QString& path);
+
+protected:
+    typedef SparseBlockGrid<float, BlockSize> FieldGrid;
+
+    // part of the mesh in a block
+    struct BlockMesh {
+        std::vector<float> coords, normals;
+        std::vector<unsigned int> indices;
+    };
+
+    // field of the block with one node of apron for the gradients and the vertex of each of its
+    // edges, per thread
+    struct Scratch {
+        std::vector<float> field;
+        std::vector<int> edgeVertex;
+    };
+
+    // field of block b from the particles of the blocks within reach of it
+    void splatBlock(int b, int reach, const std::vector<Vec3>& positions);
+    // field of block b and its apron, from the blocks next to it
+    void gatherBlock(int b, Scratch& scratch);
+    void marchBlock(int b, BlockMesh& mesh, Scratch& scratch);
+    void workerLoop();
+
+    double cellSize = 1, radius = 4, volume = 8;
+    double isoValue = 0.5;
+
+    ThreadPool pool;
+    std::vector<Scratch> scratch;
+
+    // field, the particles of every block of it and the mesh of every block
+    FieldGrid field;
+    std::vector<int> particleBlock, blockStart, blockParticles;
+    std::vector<BlockMesh> meshes;
+
+    // last mesh
+    int numBlocks = 0, numTriangles = 0;
+    size_t memoryBytes = 0;
+    double ms = 0;
+
+    // worker
+    std::thread worker;
+    mutable std::mutex mutex;
+    std::condition_variable wakeUp, jobDone;
+    std::vector<Vec3> jobPositions;
+    Model jobMesh;
+    bool jobPending = false, meshReady = false, quit = false;
+};
+
+#endif // SURFACERECONSTRUCTION_H
@@ -0,0 +1,99 @@
+#include "threadpool.h"
+#include <algorithm>
+
+
+ThreadPool::ThreadPool(int numThreads) {
+    nextChunk = 0;
+    startWorkers(std::max(numThreads, 1) - 1);
+}
+
+ThreadPool::~ThreadPool() {
+    stopWorkers();
+}
+
+void ThreadPool::setNumThreads(int numThreads) {
+    numThreads = std::max(numThreads, 1);
+    if (numThreads == getNumThreads()) return;
+    stopWorkers();
+    startWorkers(numThreads - 1);
+}
+
+void ThreadPool::startWorkers(int numWorkers) {
+    // new workers wait for the next job, not for the ones run before they existed
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = false;
+    for (int i = 0; i < numWorkers; i++) {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i + 1, generation));
+    }
+}
+
+void ThreadPool::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wakeUp.notify_all();
+    for (std::thread& w : workers) w.join();
+    workers.clear();
+}
+
+void ThreadPool::parallelFor(int n, Schedule schedule, int chunk, const std::function<void(int, int, int)>& fn) {
+    if (n <= 0) return;
+    if (workers.empty()) {
+        fn(0, n, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        jobSize = n;
+        jobChunk = std::max(chunk, 1);
+        jobSchedule = schedule;
+        nextChunk = 0;
+        pendingWorkers = int(workers.size());
+        generation++;
+    }
+    wakeUp.notify_all();
+
+    runJob(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [this] { return pendingWorkers == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::workerLoop(int thread, unsigned long long seen) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeUp.wait(lock, [&] { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+        }
+
+        runJob(thread);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pendingWorkers--;
+        }
+        jobDone.notify_one();
+    }
+}
+
+void ThreadPool::runJob(int thread) {
+    if (jobSchedule == Static) {
+        int numThreads = getNumThreads();
+        int begin = int((long long)jobSize * thread / numThreads);
+        int end = int((long long)jobSize * (thread + 1) / numThreads);
+        if (begin < end) (*job)(begin, end, thread);
+        return;
+    }
+
+    while (true) {
+        int begin = nextChunk.fetch_add(jobChunk);
+        if (begin >= jobSize) return;
+        (*job)(begin, std::min(begin + jobChunk, jobSize), thread);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/*
+ *  Fixed set of worker threads for data parallel loops. The calling thread takes part as
+ *  thread 0, so with a single thread the loop simply runs inline.
+ */
+class ThreadPool {
+public:
+    enum Schedule {
+        Static  = 0, // one contiguous range per thread
+        Dynamic = 1, // chunks handed out on demand
+    };
+
+    ThreadPool(int numThreads = 1);
+    ~ThreadPool();
+
+    void setNumThreads(int numThreads);
+    int getNumThreads() const { return int(workers.size()) + 1; }
+
+    // calls fn(begin, end, thread) on ranges covering [0, n), thread is in [0, getNumThreads())
+    void parallelFor(int n, Schedule schedule, int chunk, const std::function<void(int, int, int)>& fn);
+
+protected:
+    void startWorkers(int numWorkers);
+    void stopWorkers();
+    void workerLoop(int thread, unsigned long long seen);
+    void runJob(int thread);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeUp, jobDone;
+    unsigned long long generation = 0;
+    int pendingWorkers = 0;
+    bool quit = false;
+
+    // current job
+    const std::function<void(int, int, int)>* job = nullptr;
+    int jobSize = 0, jobChunk = 1;
+    Schedule jobSchedule = Static;
+    std::atomic<int> nextChunk;
+};
+
+#endif // THREADPOOL_H
@@ -53,3 +53,7 @@ bool WidgetCloth::getRenderCloth() const {
 bool WidgetCloth::getSelfCollisions() const {
     return ui->checkBox_selfcollisions->isChecked();
 }
+
+bool WidgetCloth::getTuneNeighborSearch() const {
+    return ui->checkBox_tune->isChecked();
+}
@@ -23,6 +23,7 @@ public:
     bool getRenderParticles() const;
     bool getRenderCloth() const;
     bool getSelfCollisions() const;
+    bool getTuneNeighborSearch() const;
 
 signals:
     void updatedParameters();
@@ -53,3 +53,7 @@ bool WidgetOP::getRenderCloth() const {
 bool WidgetOP::getSelfCollisions() const {
     return ui->checkBox_selfcollisions->isChecked();
 }
+
+bool WidgetOP::getTuneNeighborSearch() const {
+    return ui->checkBox_tune->isChecked();
+}
@@ -27,3 +27,7 @@ int WidgetSnowball::getBlackholeIntensity() const {
 int WidgetSnowball::getMovableObjectId() const {
     return ui->radioButton->isChecked()?0:1;
 }
+
+bool WidgetSnowball::getSleeping() const {
+    return ui->checkBox_sleeping->isChecked();
+}
@@ -17,6 +17,7 @@ public:
     double getGravity()    const;
     int getBlackholeIntensity()    const;
     int getMovableObjectId() const;
+    bool getSleeping() const;
 
 signals:
     void updatedParameters();
@@ -1,10 +1,18 @@
 #include "widgetsph_watercube.h"
 #include "ui_widgetsph_watercube.h"
+#include <QThread>
+#include <QFileDialog>
 
 enum comboBoxSPHMethod {
     FullyCompressibleMethod = 0,
     WeaklyCompressibleMethod = 1,
     IterativeWeaklyCompressibleMethod = 2,
+    PCISPHMethod = 3,
+    DFSPHMethod = 4,
+    IISPHMethod = 5,
+    PBFMethod = 6,
+    FLIPMethod = 7,
+    APICMethod = 8,
 };
 
 void WidgetSPHWaterCube::setDefaultParameters(){
@@ -21,11 +29,42 @@ void WidgetSPHWaterCube::setDefaultParameters(){
         ui->spinBox_k->setValue(7.f);
         ui->spinBox_kinematic_viscosity->setValue(0.f);
     }else if(ui->comboBox->currentIndex() == comboBoxSPHMethod::IterativeWeaklyCompressibleMethod  ){
-        ui->spinBox_h_reduction->setValue(0.7f);
-        ui->spinBox_rest_density->setValue(0.004000f);
+        ui->spinBox_h_reduction->setValue(1.f);
+        ui->spinBox_rest_density->setValue(0.002428f);
         ui->spinBox_c->setValue(300.f);
-        ui->spinBox_k->setValue(2.f);
+        ui->spinBox_k->setValue(1000.f);
+        ui->spinBox_kinematic_viscosity->setValue(0.f);
+        ui->spinBox_density_error->setValue(1.f);
+        ui->spinBox_max_iterations->setValue(20);
+    }else if(ui->comboBox->currentIndex() == comboBoxSPHMethod::PCISPHMethod){
+        ui->spinBox_h_reduction->setValue(1.f);
+        ui->spinBox_rest_density->setValue(0.002428f);
+        ui->spinBox_kinematic_viscosity->setValue(0.f);
+        ui->spinBox_density_error->setValue(1.f);
+        ui->spinBox_max_iterations->setValue(50);
+    }else if(ui->comboBox->currentIndex() == comboBoxSPHMethod::DFSPHMethod){
+        ui->spinBox_h_reduction->setValue(1.f);
+        ui->spinBox_rest_density->setValue(0.002428f);
+        ui->spinBox_kinematic_viscosity->setValue(0.f);
+        ui->spinBox_density_error->setValue(0.1f);
+        ui->spinBox_max_iterations->setValue(100);
+    }else if(ui->comboBox->currentIndex() == comboBoxSPHMethod::IISPHMethod){
+        ui->spinBox_h_reduction->setValue(1.f);
+        ui->spinBox_rest_density->setValue(0.002428f);
         ui->spinBox_kinematic_viscosity->setValue(0.f);
+        ui->spinBox_density_error->setValue(0.1f);
+        ui->spinBox_max_iterations->setValue(100);
+    }else if(ui->comboBox->currentIndex() == comboBoxSPHMethod::PBFMethod){
+        // Poly6 density of the spawn lattice, the iterations are always all run
+        ui->spinBox_h_reduction->setValue(1.f);
+        ui->spinBox_rest_density->setValue(0.001211f);
+        ui->spinBox_kinematic_viscosity->setValue(0.f);
+        ui->spinBox_max_iterations->setValue(3);
+    }else if(ui->comboBox->currentIndex() == comboBoxSPHMethod::FLIPMethod ||
+             ui->comboBox->currentIndex() == comboBoxSPHMethod::APICMethod){
+        // the tolerance is the relative residual of the pressure projection
+        ui->spinBox_density_error->setValue(0.01f);
+        ui->spinBox_max_iterations->setValue(200);
     }
 }
 
@@ -34,12 +73,23 @@ WidgetSPHWaterCube::WidgetSPHWaterCube(QWidget *parent) :
     ui(new Ui::WidgetSPHWaterCube)
 {
     ui->setupUi(this);
+    ui->spinBox_threads->setValue(QThread::idealThreadCount());
 
     connect(ui->btnUpdate, &QPushButton::clicked, this,
             [=] (void) { emit updatedParameters();});
 
     connect(ui->btnDefaultParameters, &QPushButton::clicked, this,
             [=] (void) { setDefaultParameters();});
+
+    connect(ui->btnExportLog, &QPushButton::clicked, this, [=] (void) {
+        QString path = QFileDialog::getSaveFileName(this, "Export convergence log", "convergence.csv", "CSV files (*.csv)");
+        if (!path.isEmpty()) emit exportedConvergenceLog(path);
+    });
+
+    connect(ui->btnExportMesh, &QPushButton::clicked, this, [=] (void) {
+        QString path = QFileDialog::getSaveFileName(this, "Export surface mesh", "surface.obj", "OBJ files (*.obj)");
+        if (!path.isEmpty()) emit exportedSurfaceMesh(path);
+    });
 }
 
 WidgetSPHWaterCube::~WidgetSPHWaterCube()
@@ -78,3 +128,67 @@ double WidgetSPHWaterCube::getKinematicViscosity() const {
 int WidgetSPHWaterCube::getSPHMethod() const {
     return ui->comboBox->currentIndex();
 }
+
+int WidgetSPHWaterCube::getNeighborSearch() const {
+    return ui->comboBox_neighbor_search->currentIndex();
+}
+
+int WidgetSPHWaterCube::getTraversal() const {
+    return ui->comboBox_traversal->currentIndex();
+}
+
+int WidgetSPHWaterCube::getBoundaryHandling() const {
+    return ui->comboBox_boundary->currentIndex();
+}
+
+bool WidgetSPHWaterCube::getSleeping() const {
+    return ui->checkBox_sleeping->isChecked();
+}
+
+bool WidgetSPHWaterCube::getAdaptiveResolution() const {
+    return ui->checkBox_adaptive->isChecked();
+}
+
+bool WidgetSPHWaterCube::getInflow() const {
+    return ui->checkBox_inflow->isChecked();
+}
+
+bool WidgetSPHWaterCube::getPeriodic() const {
+    return ui->checkBox_periodic->isChecked();
+}
+
+bool WidgetSPHWaterCube::getSurfaceMesh() const {
+    return ui->checkBox_surface->isChecked();
+}
+
+bool WidgetSPHWaterCube::getTuneNeighborSearch() const {
+    return ui->checkBox_tune->isChecked();
+}
+
+int WidgetSPHWaterCube::getDensityKernel() const {
+    return ui->comboBox_kernel->currentIndex();
+}
+
+bool WidgetSPHWaterCube::getTabulatedKernels() const {
+    return ui->checkBox_tabulated->isChecked();
+}
+
+bool WidgetSPHWaterCube::getMixedPrecision() const {
+    return ui->checkBox_mixed->isChecked();
+}
+
+double WidgetSPHWaterCube::getDensityErrorTolerance() const {
+    return ui->spinBox_density_error->value()/100.0;
+}
+
+int WidgetSPHWaterCube::getMaxIterations() const {
+    return ui->spinBox_max_iterations->value();
+}
+
+int WidgetSPHWaterCube::getNumThreads() const {
+    return ui->spinBox_threads->value();
+}
+
+int WidgetSPHWaterCube::getSchedule() const {
+    return ui->comboBox_schedule->currentIndex();
+}
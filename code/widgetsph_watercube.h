@@ -17,15 +17,33 @@ public:
     double getGravity()    const;
     int getMovableObjectId() const;
     int getSPHMethod() const;
+    int getNeighborSearch() const;
+    int getTraversal() const;
+    int getBoundaryHandling() const;
+    bool getSleeping() const;
+    bool getAdaptiveResolution() const;
+    bool getInflow() const;
+    bool getPeriodic() const;
+    bool getSurfaceMesh() const;
+    bool getTuneNeighborSearch() const;
+    int getDensityKernel() const;
+    bool getTabulatedKernels() const;
+    bool getMixedPrecision() const;
+    int getNumThreads() const;
+    int getSchedule() const;
     double getHReduction() const;
     double getRestDensity() const;
     double getC() const;
     double getK() const;
     double getKinematicViscosity() const;
+    double getDensityErrorTolerance() const;
+    int getMaxIterations() const;
     void setDefaultParameters();
 
 signals:
     void updatedParameters();
+    void exportedConvergenceLog(const QString& path);
+    void exportedSurfaceMesh(const QString& path);
     void releasedLockedParticles();
 
 private: